@@ -0,0 +1,289 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+// fixed size array for the big infoset tables.
+// memory comes from mmap in 2MB aligned chunks so that it can be backed by huge pages (explicit hugetlb if the
+// machine has some reserved, transparent huge pages otherwise), and the elements are constructed by all cores at once.
+// constructing in parallel is also the first touch, so the pages are faulted in by many threads instead of one.
+//
+// an Array can also be backed by a file (MAP_SHARED): training then mutates the file in place, a checkpoint is an
+// msync (plus a reflink copy if we want to keep it) and a restart just maps the file again.
+// file layout: one 4KB FileHeader page followed by the raw elements. elements are never constructed in that mode,
+// so T has to be valid when all of its bytes are zero (a new file is a sparse file full of zeros).
+
+#include <cstddef>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <type_traits>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "parallel.hpp"
+#include "topology.hpp"
+
+namespace arena {
+    constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+    inline size_t round_up(size_t bytes, size_t alignment) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    // returns 2MB aligned, zeroed memory, or nullptr
+    inline void* allocate_huge(size_t bytes, bool &explicit_huge_pages) {
+        bytes = round_up(bytes, HUGE_PAGE_SIZE);
+        explicit_huge_pages = false;
+#ifdef MAP_HUGETLB
+        void *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0); // fails if not enough huge pages are reserved
+        if(ptr != MAP_FAILED) {
+            explicit_huge_pages = true;
+            return ptr;
+        }
+#endif
+        // no reserved huge pages: over-allocate so that we can cut out an aligned range and ask for THP on it
+        size_t padded = bytes + HUGE_PAGE_SIZE;
+        void *raw = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(raw == MAP_FAILED) {
+            return nullptr;
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = round_up(start, HUGE_PAGE_SIZE);
+        if(aligned > start) {
+            munmap(raw, aligned - start);
+        }
+        uintptr_t tail = aligned + bytes;
+        uintptr_t raw_end = start + padded;
+        if(raw_end > tail) {
+            munmap(reinterpret_cast<void*>(tail), raw_end - tail);
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(reinterpret_cast<void*>(aligned), bytes, MADV_HUGEPAGE);
+#endif
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    constexpr size_t FILE_HEADER_BYTES = 4096;
+    constexpr char FILE_MAGIC[8] = {'M', 'C', 'C', 'F', 'R', 'T', 'B', 'L'};
+    constexpr uint32_t FILE_VERSION = 1;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t element_bytes;
+        uint64_t size;
+        uint64_t iterations; // maintained by the training loop
+        uint64_t tag; // free for the caller, e.g. the infoset layout the rows are stored in
+    };
+    static_assert(sizeof(FileHeader) <= FILE_HEADER_BYTES, "header has to fit in its page");
+
+    // reflinks a file (shares the blocks, instant). false, and no file at dst, if the filesystem does not support it
+    inline bool reflink_file(int src_fd, const std::string &dst) {
+        int dst_fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(dst_fd < 0) {
+            throw std::runtime_error("could not create " + dst);
+        }
+#ifdef FICLONE
+        if(ioctl(dst_fd, FICLONE, src_fd) == 0) {
+            close(dst_fd);
+            return true;
+        }
+#endif
+        close(dst_fd);
+        unlink(dst.c_str());
+        return false;
+    }
+
+    // copies a file, as a reflink if the filesystem supports it. returns whether it was one
+    inline bool copy_file(int src_fd, const std::string &dst, size_t bytes) {
+        if(reflink_file(src_fd, dst))
+            return true;
+        int dst_fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(dst_fd < 0) {
+            throw std::runtime_error("could not create " + dst);
+        }
+        loff_t in_off = 0, out_off = 0;
+        while(in_off < (loff_t)bytes) {
+            ssize_t copied = copy_file_range(src_fd, &in_off, dst_fd, &out_off, bytes - in_off, 0);
+            if(copied <= 0) {
+                close(dst_fd);
+                throw std::runtime_error("could not copy to " + dst);
+            }
+        }
+        close(dst_fd);
+        return false;
+    }
+
+    // READ_ONLY maps an existing file PROT_READ: nothing in it can be written, not even a lock byte, so the pages stay
+    // clean and a reflinked copy keeps sharing its blocks with the original
+    enum class Access { READ_WRITE, READ_ONLY };
+
+    // closes the file unless it was released, so the constructors below do not leak it when they throw
+    struct FileDescriptor {
+        int fd;
+
+        explicit FileDescriptor(int fd): fd(fd) {}
+        FileDescriptor(const FileDescriptor &) = delete;
+        FileDescriptor& operator=(const FileDescriptor &) = delete;
+
+        ~FileDescriptor() {
+            if(fd >= 0)
+                close(fd);
+        }
+
+        int release() {
+            int result = fd;
+            fd = -1;
+            return result;
+        }
+    };
+
+    template<typename T>
+    class Array {
+        T *data_ = nullptr;
+        size_t size_ = 0;
+        size_t bytes_ = 0;
+        bool explicit_huge_pages = false;
+
+        // file backed mode only
+        int fd = -1;
+        void *mapping = nullptr;
+        FileHeader *header_ = nullptr;
+        bool reopened_ = false;
+        bool read_only_ = false;
+
+    public:
+        // no elements, for a table that is not held in memory (see block_cache)
+        Array() {}
+
+        explicit Array(size_t size): size_(size) {
+            bytes_ = round_up(size * sizeof(T), HUGE_PAGE_SIZE);
+            void *ptr = allocate_huge(bytes_, explicit_huge_pages);
+            if(ptr == nullptr) {
+                throw std::bad_alloc();
+            }
+            topology::interleave_memory(ptr, bytes_);
+            data_ = static_cast<T*>(ptr);
+
+            // the constructors run in parallel, each thread first-touches its own range
+            parallel::parallel_for(0, size_, [this](long long lo, long long hi) {
+                for(long long i = lo; i < hi; i++) {
+                    new (data_ + i) T();
+                }
+            });
+        }
+
+        // maps (and creates if needed) a file backed array. if the file exists its size and element size have to match.
+        // a READ_ONLY array is never created, the file has to exist
+        Array(size_t size, const std::string &path, Access access = Access::READ_WRITE): size_(size), read_only_(access == Access::READ_ONLY) {
+            static_assert(std::is_standard_layout<T>::value, "file backed elements need a fixed layout");
+            FileDescriptor file(read_only_ ? open(path.c_str(), O_RDONLY) : open(path.c_str(), O_RDWR | O_CREAT, 0644));
+            if(file.fd < 0) {
+                throw std::runtime_error("could not open " + path);
+            }
+            bytes_ = FILE_HEADER_BYTES + size * sizeof(T);
+            struct stat st;
+            if(fstat(file.fd, &st) != 0) {
+                throw std::runtime_error("could not stat " + path);
+            }
+            reopened_ = st.st_size != 0;
+            if(!reopened_ && read_only_) {
+                throw std::runtime_error(path + " is empty");
+            }
+            if(!reopened_ && ftruncate(file.fd, bytes_) != 0) {
+                throw std::runtime_error("could not resize " + path);
+            }
+            if(reopened_ && size_t(st.st_size) != bytes_) {
+                throw std::runtime_error(path + " has the wrong size for this table");
+            }
+            void *ptr = mmap(nullptr, bytes_, read_only_ ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+            if(ptr == MAP_FAILED) {
+                throw std::runtime_error("could not map " + path);
+            }
+            FileHeader *header = static_cast<FileHeader*>(ptr);
+            if(reopened_) {
+                if(memcmp(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header->version != FILE_VERSION
+                   || header->element_bytes != sizeof(T) || header->size != size) {
+                    munmap(ptr, bytes_);
+                    throw std::runtime_error(path + " is not a table of this type");
+                }
+                // start reading the whole file in the background instead of faulting it in one random page at a time
+                madvise(ptr, bytes_, MADV_WILLNEED);
+            } else {
+                memcpy(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+                header->version = FILE_VERSION;
+                header->element_bytes = sizeof(T);
+                header->size = size;
+                header->iterations = 0;
+                header->tag = 0;
+            }
+            mapping = ptr;
+            header_ = header;
+            data_ = reinterpret_cast<T*>(static_cast<char*>(mapping) + FILE_HEADER_BYTES);
+            fd = file.release();
+        }
+
+        Array(const Array &) = delete;
+        Array& operator=(const Array &) = delete;
+
+        ~Array() {
+            if(fd != -1) {
+                munmap(mapping, bytes_); // dirty pages are written back by the kernel
+                close(fd);
+                return;
+            }
+            if(data_ == nullptr)
+                return;
+            parallel::parallel_for(0, size_, [this](long long lo, long long hi) {
+                for(long long i = lo; i < hi; i++) {
+                    data_[i].~T();
+                }
+            });
+            munmap(data_, bytes_);
+        }
+
+        T& operator[](size_t idx) { return data_[idx]; }
+        const T& operator[](size_t idx) const { return data_[idx]; }
+
+        size_t size() const { return size_; }
+        T* data() { return data_; }
+        T* begin() { return data_; }
+        T* end() { return data_ + size_; }
+
+        bool uses_explicit_huge_pages() const { return explicit_huge_pages; }
+        size_t bytes() const { return bytes_; }
+
+        bool file_backed() const { return fd != -1; }
+        // true if the file already existed, i.e. we are resuming
+        bool reopened() const { return reopened_; }
+        bool read_only() const { return read_only_; }
+        FileHeader& header() { assert(file_backed()); return *header_; }
+
+        // flushes the mapping to disk
+        void sync() {
+            assert(file_backed());
+            msync(mapping, bytes_, MS_SYNC);
+        }
+
+        // flushes and copies the file (reflink if possible), the copy can be mapped again as a table.
+        // returns false if the filesystem could not reflink and the data was really copied
+        bool snapshot(const std::string &path) {
+            sync();
+            return copy_file(fd, path, bytes_);
+        }
+
+        // same, but only if it can be a reflink. returns false without writing anything otherwise
+        bool reflink(const std::string &path) {
+            sync();
+            return reflink_file(fd, path);
+        }
+    };
+} // namespace arena
+
+#endif
@@ -0,0 +1,228 @@
+// benchmarks for the training loop, meant to be run under `perf stat -e cache-misses,dTLB-load-misses ./bench ...`
+//
+//   bench episodes <canonical|dfs|depth> [seconds] [group]     single thread MCCFR episodes/sec on PTTT,
+//                                                              group > 0 uses iteration_interleaved(group)
+//   bench rollouts [games]                                     uniform random games/sec, PTTT vs PTTTBatch<16>
+//   bench io [rows] [path]                                     npy write / read GB/s and peak rss for a (rows x 9)
+//                                                              double table, PTTT sized by default
+//   bench strategy                                             Game::get_strategy (normalization of the whole average
+//                                                              policy table) seconds on PTTT
+//   bench ooc <canonical|dfs|depth> [seconds] [group] [store]  out-of-core MCCFR episodes/sec with the block cache
+//                                                              restricted to 100%..5% of the table, on one store
+
+#include "pttt.hpp"
+#include "mccfr_es.hpp"
+#include <chrono>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+
+using Game = pttt::PTTT;
+using MCCFR = mccfr_es::MCCFR<Game>;
+using namespace std;
+
+static void bench_episodes(pttt::InfosetLayout layout, double seconds, int group) {
+    Game::set_infoset_layout(layout);
+    Game::precompute_if_needed();
+    MCCFR mccfr;
+
+    cout << "layout=" << pttt::layout_name(layout) << " group=" << group << endl;
+    auto start = chrono::steady_clock::now();
+    long long episodes = 0;
+    double elapsed = 0;
+    while(elapsed < seconds) {
+        if(group > 0) {
+            for(int i = 0; i < 1000; i += group) {
+                mccfr.iteration_interleaved(group);
+            }
+        } else {
+            for(int i = 0; i < 1000; i++) {
+                mccfr.iteration();
+            }
+        }
+        episodes += (group > 0 ? (999 / group + 1) * group : 1000) * Game::NUM_PLAYERS;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    cout << "episodes=" << episodes << " seconds=" << elapsed << " episodes/sec=" << episodes / elapsed << endl;
+}
+
+template<int LANES>
+static void bench_rollouts_batch(int games, bool track_info_sets) {
+    mt19937 gen(0);
+    uniform_real_distribution<double> dis(0.0, 1.0);
+    auto start = chrono::steady_clock::now();
+    double sum = 0;
+    array<uint32_t, LANES> masks;
+    array<int, LANES> actions;
+    Game::ActionInts lane_actions;
+    array<bool, LANES> counted;
+    int started = min(LANES, games);
+    pttt::PTTTBatch<LANES> batch(track_info_sets, started);
+    for(int lane = 0; lane < LANES; lane++) {
+        counted[lane] = lane >= started;
+    }
+    while(!batch.all_terminal()) {
+        batch.valid_action_mask_many(masks.data());
+        for(int lane = 0; lane < LANES; lane++) {
+            if(masks[lane] == 0)
+                continue;
+            int num_actions = pttt::PTTTBatch<LANES>::actions_from_mask(masks[lane], lane_actions);
+            actions[lane] = lane_actions[int(dis(gen) * num_actions)];
+        }
+        batch.step_many(actions.data());
+        bool can_refill = batch.current_player() == Game::Player::P1;
+        for(int lane = 0; lane < LANES; lane++) {
+            if(!batch.is_terminal(lane))
+                continue;
+            if(!counted[lane]) {
+                sum += batch.utility(lane, Game::Player::P1);
+                counted[lane] = true;
+            }
+            if(can_refill && started < games) {
+                batch.reset_lane(lane);
+                counted[lane] = false;
+                started++;
+            }
+        }
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "PTTTBatch<" << LANES << "> info_sets=" << track_info_sets << " games/sec=" << games / elapsed << " mean P1 utility=" << sum / games << endl;
+}
+
+static void bench_rollouts(int games) {
+    mt19937 gen(0);
+    uniform_real_distribution<double> dis(0.0, 1.0);
+    auto start = chrono::steady_clock::now();
+    double sum = 0;
+    Game::ActionInts actions;
+    for(int i = 0; i < games; i++) {
+        Game state;
+        while(!state.is_terminal()) {
+            int num_actions = state.num_actions();
+            state.actions(actions);
+            state.step(actions[int(dis(gen) * num_actions)]);
+        }
+        sum += state.utility(Game::Player::P1);
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "PTTT games/sec=" << games / elapsed << " mean P1 utility=" << sum / games << endl;
+
+    bench_rollouts_batch<16>(games, true);
+    bench_rollouts_batch<16>(games, false);
+}
+
+static long peak_rss_mb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024;
+}
+
+static void bench_io(long long rows, const string &path) {
+    using Row = array<double, Game::ACTION_MAX_DIM>;
+    vector<Row> table(rows);
+    for(long long i = 0; i < rows; i++) {
+        for(int j = 0; j < Game::ACTION_MAX_DIM; j++) {
+            table[i][j] = double(i * Game::ACTION_MAX_DIM + j);
+        }
+    }
+    double gb = double(rows) * sizeof(Row) / 1e9;
+    cout << "table " << gb << "GB, peak rss " << peak_rss_mb() << "MB" << endl;
+
+    auto start = chrono::steady_clock::now();
+    io::save_to_numpy<double, Game::ACTION_MAX_DIM>(path, table.begin(), table.end());
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "write " << gb / elapsed << "GB/s, peak rss " << peak_rss_mb() << "MB" << endl;
+
+    // the file is in the page cache at this point, drop it (echo 1 > /proc/sys/vm/drop_caches) for cold numbers
+    start = chrono::steady_clock::now();
+    io::load_from_numpy<double, Game::ACTION_MAX_DIM>(path, table.begin(), table.end());
+    elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "read " << gb / elapsed << "GB/s, peak rss " << peak_rss_mb() << "MB" << endl;
+
+    start = chrono::steady_clock::now();
+    io::MappedNpy<double> mapped(path);
+    double sum = 0;
+    for(long long i = 0; i < mapped.rows(); i++) {
+        sum += mapped.row(i)[Game::ACTION_MAX_DIM - 1];
+    }
+    elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "mmap scan " << gb / elapsed << "GB/s, peak rss " << peak_rss_mb() << "MB (checksum " << sum << ")" << endl;
+}
+
+static void bench_strategy() {
+    Game::precompute_if_needed();
+    mt19937 gen(0);
+    uniform_real_distribution<double> dis(0.0, 1.0);
+    vector<array<double, Game::ACTION_MAX_DIM>> average_policy(Game::NUM_INFO_SETS);
+    for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
+        for(int j = 0; j < Game::ACTION_MAX_DIM; j++) {
+            average_policy[i][j] = i % 3 == 0 ? 0.0 : dis(gen); // a third of the rows takes the uniform fallback
+        }
+    }
+    for(int run = 0; run < 3; run++) {
+        auto start = chrono::steady_clock::now();
+        auto strategy = Game::get_strategy(average_policy);
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "get_strategy " << elapsed << "s (" << strategy.size() << " rows)" << endl;
+    }
+}
+
+// the store keeps training from one cache size to the next, delete it for a run from scratch.
+// blocks are dropped from the page cache after every read and write, so the cache size is what really is in memory
+static void bench_ooc(pttt::InfosetLayout layout, double seconds, int group, const string &store) {
+    Game::set_infoset_layout(layout);
+    Game::precompute_if_needed();
+    double table_bytes = double(Game::NUM_INFO_SETS) * sizeof(mccfr_es::RegretMinimizer<Game::ACTION_MAX_DIM>);
+    cout << "layout=" << pttt::layout_name(layout) << " group=" << group << " table " << table_bytes / 1e9 << "GB" << endl;
+    for(double fraction: {1.0, 0.5, 0.25, 0.1, 0.05}) {
+        MCCFR mccfr(store, size_t(fraction * table_bytes));
+        auto start = chrono::steady_clock::now();
+        long long episodes = 0;
+        double elapsed = 0;
+        while(elapsed < seconds) {
+            for(int i = 0; i < 1000; i += group) {
+                mccfr.iteration_interleaved(group);
+            }
+            episodes += (999 / group + 1) * group * Game::NUM_PLAYERS;
+            elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+        auto stats = mccfr.cache_stats();
+        double acquires = double(stats.hits + stats.waits + stats.misses);
+        cout << "cache " << fraction * 100 << "% (" << mccfr.cache().cache_bytes() / 1e9 << "GB, " << mccfr.cache().block_rows() << " rows/block)"
+             << " episodes/sec=" << episodes / elapsed
+             << " hit rate=" << stats.hits / acquires
+             << " waited on read-ahead=" << stats.waits / acquires
+             << " demand reads/sec=" << stats.misses / elapsed
+             << " read-ahead reads/sec=" << stats.prefetch_reads / elapsed
+             << " write backs/sec=" << stats.write_backs / elapsed
+             << " pinned blocks=" << stats.permanent_frames << endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    string what = argc > 1 ? argv[1] : "";
+    if(what == "episodes") {
+        auto layout = pttt::layout_from_name(argc > 2 ? argv[2] : "canonical");
+        double seconds = argc > 3 ? stod(argv[3]) : 60;
+        int group = argc > 4 ? stoi(argv[4]) : 0;
+        bench_episodes(layout, seconds, group);
+    } else if(what == "rollouts") {
+        bench_rollouts(argc > 2 ? stoi(argv[2]) : 1000000);
+    } else if(what == "io") {
+        bench_io(argc > 2 ? stoll(argv[2]) : Game::NUM_INFO_SETS, argc > 3 ? argv[3] : "/tmp/bench_io.npy");
+    } else if(what == "strategy") {
+        bench_strategy();
+    } else if(what == "ooc") {
+        auto layout = pttt::layout_from_name(argc > 2 ? argv[2] : "dfs");
+        double seconds = argc > 3 ? stod(argv[3]) : 60;
+        int group = argc > 4 ? stoi(argv[4]) : 64;
+        bench_ooc(layout, seconds, group, argc > 5 ? argv[5] : "/tmp/bench_ooc.store");
+    } else {
+        cout << "usage: bench episodes <canonical|dfs|depth> [seconds] [group]" << endl;
+        cout << "       bench rollouts [games]" << endl;
+        cout << "       bench io [rows] [path]" << endl;
+        cout << "       bench strategy" << endl;
+        cout << "       bench ooc <canonical|dfs|depth> [seconds] [group] [store]" << endl;
+        return 1;
+    }
+}
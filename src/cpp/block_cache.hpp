@@ -0,0 +1,447 @@
+#ifndef BLOCK_CACHE_HPP
+#define BLOCK_CACHE_HPP
+
+// out-of-core table for games whose regret tables do not fit in memory.
+// the rows stay in a store file (same layout as a file backed arena::Array, so the two are interchangeable) and are
+// grouped in blocks of block_rows consecutive rows. only a fixed number of blocks (frames) are in memory:
+//   - acquire(idx) pins the block of a row, reading it from the file if needed, release(idx) unpins it.
+//     pinned blocks are never evicted, so a row reference stays valid from acquire to release
+//   - eviction is CLOCK over the unpinned frames, a dirty victim is written back before its frame is reused
+//   - make_permanent(idx) keeps a block in memory for good, for the hot rows near the root
+//   - prefetch(idx) queues an asynchronous read on the io threads, the trainer calls it with the rows its running
+//     episodes are about to visit
+// blocks are read and written with pread/pwrite and then dropped from the page cache, so the memory used is the
+// frames and not the page cache. a frame whose row is acquired is marked dirty, even if it is only read.
+//
+// a resident block is pinned without the lock: pin count first, then check that the frame still holds the block.
+// the evictor does the opposite (clears the block, then checks the pin count), so one of the two always backs off
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "arena.hpp"
+
+namespace block_cache {
+    constexpr size_t DEFAULT_BLOCK_BYTES = 64 << 10;
+    constexpr int DEFAULT_IO_THREADS = 4;
+
+    struct Stats {
+        uint64_t hits = 0; // acquires of a resident block
+        uint64_t waits = 0; // acquires of a block that was still being read (usually by a prefetch)
+        uint64_t misses = 0; // acquires that had to read the block themselves
+        uint64_t prefetch_reads = 0;
+        uint64_t write_backs = 0;
+        uint64_t permanent_frames = 0;
+    };
+
+    template<typename T>
+    class BlockCache {
+        static constexpr int32_t NOT_RESIDENT = -1;
+        static constexpr int32_t WRITING_BACK = -2; // evicted but not on disk yet, loads of the block have to wait
+        static constexpr int MAX_FULL_WAITS = 1000; // ms
+
+        struct Frame {
+            std::atomic<int64_t> block{-1};
+            std::atomic<int> pins{0};
+            std::atomic<bool> loading{false};
+            std::atomic<bool> referenced{false};
+            std::atomic<bool> dirty{false};
+            std::atomic<bool> permanent{false};
+        };
+
+        size_t size_;
+        size_t block_rows_;
+        size_t num_blocks;
+        size_t num_frames_;
+        size_t max_permanent;
+        std::string path;
+        int fd = -1;
+        arena::FileHeader header_;
+        bool reopened_ = false;
+        std::function<void(T*, size_t)> on_load; // e.g. to reset the locks a crash left in the rows
+
+        T *frame_data = nullptr;
+        size_t frame_bytes = 0;
+        std::unique_ptr<Frame[]> frames;
+        std::unique_ptr<std::atomic<int32_t>[]> block_to_frame;
+
+        std::mutex mtx; // frame assignment, the clock hand and the permanent count
+        std::condition_variable loaded;
+        size_t hand = 0;
+        size_t permanent_count = 0;
+
+        std::atomic<uint64_t> hits{0}, waits{0}, misses{0}, prefetch_reads{0}, write_backs{0};
+
+        std::mutex queue_mtx;
+        std::condition_variable queue_cv;
+        std::deque<size_t> queue;
+        std::vector<std::thread> io_threads;
+        bool stopping = false;
+
+        T* block_ptr(int32_t frame) {
+            return frame_data + size_t(frame) * block_rows_;
+        }
+
+        size_t rows_in(size_t block) const {
+            return std::min(block_rows_, size_ - block * block_rows_);
+        }
+
+        off_t block_offset(size_t block) const {
+            return arena::FILE_HEADER_BYTES + block * block_rows_ * sizeof(T);
+        }
+
+        void read_block(size_t block, int32_t frame) {
+            char *ptr = reinterpret_cast<char*>(block_ptr(frame));
+            size_t bytes = rows_in(block) * sizeof(T);
+            off_t offset = block_offset(block);
+            for(size_t done = 0; done < bytes; ) {
+                ssize_t got = pread(fd, ptr + done, bytes - done, offset + done);
+                if(got <= 0)
+                    throw std::runtime_error(path + " is truncated");
+                done += got;
+            }
+            posix_fadvise(fd, offset, bytes, POSIX_FADV_DONTNEED);
+            if(on_load)
+                on_load(block_ptr(frame), rows_in(block));
+        }
+
+        void write_block(size_t block, int32_t frame) {
+            const char *ptr = reinterpret_cast<const char*>(block_ptr(frame));
+            size_t bytes = rows_in(block) * sizeof(T);
+            off_t offset = block_offset(block);
+            for(size_t done = 0; done < bytes; ) {
+                ssize_t written = pwrite(fd, ptr + done, bytes - done, offset + done);
+                if(written <= 0)
+                    throw std::runtime_error("could not write " + path);
+                done += written;
+            }
+            posix_fadvise(fd, offset, bytes, POSIX_FADV_DONTNEED); // starts the writeback, the pages go once clean
+            write_backs++;
+        }
+
+        // pins a resident block without taking the lock, -1 if it is not resident (or not loaded yet)
+        int32_t pin_fast(size_t block) {
+            int32_t f = block_to_frame[block].load();
+            if(f < 0)
+                return -1;
+            Frame &frame = frames[f];
+            frame.pins.fetch_add(1);
+            if(frame.block.load() == int64_t(block) && !frame.loading.load()) {
+                if(!frame.referenced.load(std::memory_order_relaxed))
+                    frame.referenced.store(true, std::memory_order_relaxed);
+                return f;
+            }
+            frame.pins.fetch_sub(1);
+            return -1;
+        }
+
+        // CLOCK: skips pinned, permanent and loading frames, clears the reference bit of the others on the way.
+        // called with the lock held, returns the frame with its old block already detached from it, -1 if all are pinned
+        int32_t take_victim(int64_t &old_block) {
+            for(size_t scanned = 0; scanned < 2 * num_frames_ + 1; scanned++) {
+                int32_t f = int32_t(hand);
+                hand = (hand + 1) % num_frames_;
+                Frame &frame = frames[f];
+                if(frame.permanent.load() || frame.loading.load() || frame.pins.load() > 0)
+                    continue;
+                if(frame.referenced.exchange(false))
+                    continue;
+                old_block = frame.block.load();
+                frame.block.store(-1);
+                if(frame.pins.load() > 0) { // lost against pin_fast
+                    frame.block.store(old_block);
+                    continue;
+                }
+                return f;
+            }
+            return -1;
+        }
+
+        // pins a block, reading it if needed. prefetch only changes what is counted
+        int32_t pin_slow(size_t block, bool prefetch) {
+            std::unique_lock<std::mutex> lock(mtx);
+            int64_t old_block;
+            int32_t f;
+            for(int attempt = 0; ; attempt++) {
+                int32_t resident = block_to_frame[block].load();
+                if(resident == WRITING_BACK) {
+                    loaded.wait(lock);
+                    continue;
+                }
+                if(resident >= 0) {
+                    Frame &frame = frames[resident];
+                    frame.pins.fetch_add(1);
+                    if(frame.loading.load()) {
+                        if(!prefetch)
+                            waits++;
+                        loaded.wait(lock, [&frame]() { return !frame.loading.load(); });
+                    } else if(!prefetch) {
+                        hits++;
+                    }
+                    frame.referenced.store(true);
+                    return resident;
+                }
+                f = take_victim(old_block);
+                if(f >= 0)
+                    break;
+                // every frame is pinned. other threads may release theirs, a single thread never will
+                if(prefetch || attempt == MAX_FULL_WAITS)
+                    throw std::runtime_error("block cache: all " + std::to_string(num_frames_) + " frames are pinned, the cache is too small");
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                lock.lock();
+            }
+            (prefetch ? prefetch_reads : misses)++;
+            Frame &frame = frames[f];
+            bool write_back = old_block >= 0 && frame.dirty.load();
+            if(old_block >= 0)
+                block_to_frame[old_block].store(write_back ? WRITING_BACK : NOT_RESIDENT);
+            frame.loading.store(true);
+            frame.dirty.store(false);
+            frame.referenced.store(true);
+            frame.pins.fetch_add(1);
+            frame.block.store(block);
+            block_to_frame[block].store(f);
+            lock.unlock();
+
+            if(write_back)
+                write_block(old_block, f);
+            read_block(block, f);
+
+            lock.lock();
+            if(write_back)
+                block_to_frame[old_block].store(NOT_RESIDENT);
+            frame.loading.store(false);
+            loaded.notify_all();
+            return f;
+        }
+
+        int32_t pin(size_t block, bool prefetch) {
+            int32_t f = pin_fast(block);
+            if(f >= 0) {
+                if(!prefetch)
+                    hits.fetch_add(1, std::memory_order_relaxed);
+                return f;
+            }
+            return pin_slow(block, prefetch);
+        }
+
+        void io_loop() {
+            while(true) {
+                size_t block;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mtx);
+                    queue_cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+                    if(stopping)
+                        return;
+                    block = queue.front();
+                    queue.pop_front();
+                }
+                if(block_to_frame[block].load() != NOT_RESIDENT)
+                    continue;
+                try {
+                    int32_t f = pin(block, true);
+                    frames[f].pins.fetch_sub(1);
+                } catch(const std::runtime_error &) {
+                    // everything is pinned right now, a read-ahead is only a hint
+                }
+            }
+        }
+
+    public:
+        // opens (or creates) the store file of a size-row table. cache_bytes is the memory for the frames,
+        // block_rows = 0 picks blocks of about DEFAULT_BLOCK_BYTES
+        BlockCache(size_t size, const std::string &path, size_t cache_bytes, size_t block_rows = 0,
+                   int num_io_threads = DEFAULT_IO_THREADS, std::function<void(T*, size_t)> on_load = {}):
+            size_(size), path(path), on_load(std::move(on_load)) {
+            static_assert(std::is_standard_layout<T>::value, "rows are stored as raw bytes");
+            block_rows_ = block_rows > 0 ? block_rows : std::max<size_t>(1, DEFAULT_BLOCK_BYTES / sizeof(T));
+            num_blocks = (size_ + block_rows_ - 1) / block_rows_;
+            num_frames_ = std::max<size_t>(1, std::min(num_blocks, cache_bytes / (block_rows_ * sizeof(T))));
+            max_permanent = num_frames_ / 4;
+
+            fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if(fd < 0) {
+                throw std::runtime_error("could not open " + path);
+            }
+            size_t file_bytes = arena::FILE_HEADER_BYTES + size_ * sizeof(T);
+            struct stat st;
+            if(fstat(fd, &st) != 0) {
+                close(fd);
+                throw std::runtime_error("could not stat " + path);
+            }
+            reopened_ = st.st_size != 0;
+            if(reopened_) {
+                if(size_t(st.st_size) != file_bytes || pread(fd, &header_, sizeof(header_), 0) != ssize_t(sizeof(header_))
+                   || memcmp(header_.magic, arena::FILE_MAGIC, sizeof(arena::FILE_MAGIC)) != 0 || header_.version != arena::FILE_VERSION
+                   || header_.element_bytes != sizeof(T) || header_.size != size_) {
+                    close(fd);
+                    throw std::runtime_error(path + " is not a table of this type");
+                }
+            } else {
+                if(ftruncate(fd, file_bytes) != 0) {
+                    close(fd);
+                    throw std::runtime_error("could not resize " + path);
+                }
+                memset(&header_, 0, sizeof(header_));
+                memcpy(header_.magic, arena::FILE_MAGIC, sizeof(arena::FILE_MAGIC));
+                header_.version = arena::FILE_VERSION;
+                header_.element_bytes = sizeof(T);
+                header_.size = size_;
+                write_header();
+            }
+            posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+            bool explicit_huge_pages;
+            frame_bytes = arena::round_up(num_frames_ * block_rows_ * sizeof(T), arena::HUGE_PAGE_SIZE);
+            frame_data = static_cast<T*>(arena::allocate_huge(frame_bytes, explicit_huge_pages));
+            if(frame_data == nullptr) {
+                close(fd);
+                throw std::bad_alloc();
+            }
+            frames.reset(new Frame[num_frames_]);
+            block_to_frame.reset(new std::atomic<int32_t>[num_blocks]);
+            for(size_t b = 0; b < num_blocks; b++) {
+                block_to_frame[b].store(NOT_RESIDENT, std::memory_order_relaxed);
+            }
+            for(int i = 0; i < num_io_threads; i++) {
+                io_threads.emplace_back(&BlockCache::io_loop, this);
+            }
+        }
+
+        BlockCache(const BlockCache &) = delete;
+        BlockCache& operator=(const BlockCache &) = delete;
+
+        ~BlockCache() {
+            {
+                std::lock_guard<std::mutex> lock(queue_mtx);
+                stopping = true;
+            }
+            queue_cv.notify_all();
+            for(auto &thread: io_threads) {
+                thread.join();
+            }
+            try {
+                flush();
+            } catch(const std::runtime_error &e) {
+                std::cerr << e.what() << std::endl;
+            }
+            munmap(frame_data, frame_bytes);
+            close(fd);
+        }
+
+        // the row stays valid until the matching release(idx)
+        T& acquire(size_t idx) {
+            size_t block = idx / block_rows_;
+            int32_t f = pin(block, false);
+            Frame &frame = frames[f];
+            if(!frame.dirty.load(std::memory_order_relaxed))
+                frame.dirty.store(true, std::memory_order_relaxed);
+            return block_ptr(f)[idx - block * block_rows_];
+        }
+
+        // a row that the caller has already acquired
+        T& pinned(size_t idx) {
+            size_t block = idx / block_rows_;
+            int32_t f = block_to_frame[block].load(std::memory_order_relaxed);
+            assert(f >= 0 && frames[f].pins.load() > 0);
+            return block_ptr(f)[idx - block * block_rows_];
+        }
+
+        void release(size_t idx) {
+            int32_t f = block_to_frame[idx / block_rows_].load(std::memory_order_relaxed);
+            assert(f >= 0);
+            frames[f].pins.fetch_sub(1);
+        }
+
+        // queues a read of the row's block if it is not in memory. dropped if the queue is already long
+        void prefetch(size_t idx) {
+            size_t block = idx / block_rows_;
+            if(block_to_frame[block].load(std::memory_order_relaxed) != NOT_RESIDENT)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(queue_mtx);
+                if(queue.size() >= num_frames_ / 2)
+                    return;
+                queue.push_back(block);
+            }
+            queue_cv.notify_one();
+        }
+
+        // the block of an acquired row is never evicted again, up to a quarter of the frames. returns whether it is
+        bool make_permanent(size_t idx) {
+            int32_t f = block_to_frame[idx / block_rows_].load(std::memory_order_relaxed);
+            assert(f >= 0);
+            if(frames[f].permanent.load(std::memory_order_relaxed))
+                return true;
+            std::lock_guard<std::mutex> lock(mtx);
+            if(permanent_count >= max_permanent)
+                return false;
+            frames[f].permanent.store(true);
+            permanent_count++;
+            return true;
+        }
+
+        // writes the dirty blocks and the header. the rows must not be written meanwhile (workers paused or done)
+        void flush() {
+            std::lock_guard<std::mutex> lock(mtx);
+            for(size_t f = 0; f < num_frames_; f++) {
+                int64_t block = frames[f].block.load();
+                if(block >= 0 && !frames[f].loading.load() && frames[f].dirty.exchange(false)) {
+                    write_block(block, int32_t(f));
+                }
+            }
+            write_header();
+            fdatasync(fd);
+        }
+
+        void write_header() {
+            if(pwrite(fd, &header_, sizeof(header_), 0) != ssize_t(sizeof(header_)))
+                throw std::runtime_error("could not write " + path);
+        }
+
+        // in memory copy, written by flush()
+        arena::FileHeader& header() { return header_; }
+        bool reopened() const { return reopened_; }
+
+        size_t size() const { return size_; }
+        size_t block_rows() const { return block_rows_; }
+        size_t num_frames() const { return num_frames_; }
+        // frames a pinned row always gets: all but the permanent quarter and the one each io thread may hold
+        size_t pinnable_frames() const {
+            size_t reserved = max_permanent + io_threads.size();
+            return num_frames_ > reserved ? num_frames_ - reserved : 0;
+        }
+        size_t cache_bytes() const { return num_frames_ * block_rows_ * sizeof(T); }
+
+        Stats stats() {
+            Stats result;
+            result.hits = hits.load();
+            result.waits = waits.load();
+            result.misses = misses.load();
+            result.prefetch_reads = prefetch_reads.load();
+            result.write_backs = write_backs.load();
+            std::lock_guard<std::mutex> lock(mtx);
+            result.permanent_frames = permanent_count;
+            return result;
+        }
+    };
+} // namespace block_cache
+
+#endif
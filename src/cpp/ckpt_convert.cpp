@@ -0,0 +1,82 @@
+// converts npy checkpoints (Game::save_strategy_to_file / save_state_from_file) to the sparse format and back.
+// works on any (rows x cols) double npy files, the game does not have to be loaded
+//
+//   ckpt_convert to-sparse <name>    checkpoints/<name>_{p0,p1,state}.npy -> checkpoints/<name>_{p0,p1,state}.sckpt
+//   ckpt_convert to-npy <name>       the other way around
+//   ckpt_convert to-f32 <name>       checkpoints/<name>_{p0,p1,state}.npy -> checkpoints/<name>_{p0,p1,state}.f32.npy,
+//                                    single precision copies for analysis, half the size
+
+#include "io.hpp"
+#include "kernels.hpp"
+#include "paths.hpp"
+#include "sparse_ckpt.hpp"
+#include <chrono>
+#include <filesystem>
+
+using namespace std;
+
+static const vector<string> PARTS = {"_p0", "_p1", "_state"};
+
+static void to_sparse(const string &npy_path, const string &sparse_path) {
+    auto start = chrono::steady_clock::now();
+    io::MappedNpy<double> table(npy_path);
+    sparse_ckpt::Stats stats = sparse_ckpt::save(sparse_path, table.data(), table.rows(), table.cols());
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t npy_bytes = filesystem::file_size(npy_path);
+    cout << sparse_path << ": zero=" << stats.zero_rows << " uniform=" << stats.uniform_rows << " dense=" << stats.dense_rows
+         << " size=" << stats.file_bytes << " (" << 100.0 * stats.file_bytes / npy_bytes << "% of npy) in " << elapsed << "s" << endl;
+}
+
+static void to_npy(const string &sparse_path, const string &npy_path) {
+    auto start = chrono::steady_clock::now();
+    sparse_ckpt::Header header = sparse_ckpt::info(sparse_path);
+    vector<double> table(header.rows * header.cols);
+    sparse_ckpt::load(sparse_path, table.data(), header.rows, header.cols);
+    io::NpyWriter<double> writer(npy_path, header.cols);
+    writer.write(table.data(), table.size());
+    writer.close();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << npy_path << ": (" << header.rows << ", " << header.cols << ") in " << elapsed << "s" << endl;
+}
+
+static void to_f32(const string &npy_path, const string &f32_path) {
+    auto start = chrono::steady_clock::now();
+    io::MappedNpy<double> table(npy_path);
+    long long cols = table.cols();
+    io::NpyWriter<float> writer(f32_path, table.shape().size() == 1 ? -1 : cols);
+    constexpr long long BLOCK_ROWS = 1 << 18;
+    vector<float> block(min<long long>(table.rows(), BLOCK_ROWS) * cols);
+    for(long long lo = 0; lo < table.rows(); lo += BLOCK_ROWS) {
+        long long n = min(BLOCK_ROWS, table.rows() - lo);
+        kernels::convert(table.data() + lo * cols, block.data(), n * cols);
+        writer.write(block.data(), n * cols);
+    }
+    writer.close();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << f32_path << ": (" << table.rows() << ", " << cols << ") in " << elapsed << "s" << endl;
+}
+
+int main(int argc, char **argv) {
+    string what = argc > 1 ? argv[1] : "";
+    if(argc != 3 || (what != "to-sparse" && what != "to-npy" && what != "to-f32")) {
+        cout << "usage: ckpt_convert <to-sparse|to-npy|to-f32> <name>" << endl;
+        return 1;
+    }
+    string name = argv[2];
+    for(auto &part: PARTS) {
+        string npy_path = paths::get_checkpoints_dir() / (name + part + ".npy");
+        string sparse_path = paths::get_checkpoints_dir() / (name + part + ".sckpt");
+        string from = what == "to-npy" ? sparse_path : npy_path;
+        if(!filesystem::exists(from)) {
+            cout << "skipping " << from << ", not found" << endl;
+            continue;
+        }
+        if(what == "to-sparse") {
+            to_sparse(npy_path, sparse_path);
+        } else if(what == "to-f32") {
+            to_f32(npy_path, paths::get_checkpoints_dir() / (name + part + ".f32.npy"));
+        } else {
+            to_npy(sparse_path, npy_path);
+        }
+    }
+}
@@ -0,0 +1,272 @@
+// compares two npy policy checkpoints (Game::save_strategy_to_file) to decide whether training still moves them.
+// both are mmapped and scanned in parallel chunks, nothing is loaded as a whole
+//
+//   ckpt_diff <old_name> <new_name> [top] [out]
+//
+// reads checkpoints/<name>_{p0,p1}.npy and reports per player and per depth: the mean and max L1 change of the
+// rows, the max L∞ change and the fraction of rows whose L1 change is above CHANGED_EPS, plus the top movers by L1.
+// the depth of a row is its number of own moves, read from the PTTT infoset files when they match the checkpoint
+// (all rows are depth 0 otherwise). writes <out>.json and <out>.npy, one (player, depth, rows, changed, l1_sum,
+// l1_max, linf_max) row per bucket. out defaults to checkpoints/diff__<old_name>__<new_name>
+
+#include "io.hpp"
+#include "parallel.hpp"
+#include "paths.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <queue>
+
+using namespace std;
+
+static constexpr double CHANGED_EPS = 1e-6;
+static constexpr long long CHUNK_ROWS = 1 << 20;
+
+struct Bucket {
+    long long rows = 0;
+    long long changed = 0;
+    double l1_sum = 0;
+    double l1_max = 0;
+    double linf_max = 0;
+
+    void add(const Bucket &other) {
+        rows += other.rows;
+        changed += other.changed;
+        l1_sum += other.l1_sum;
+        l1_max = max(l1_max, other.l1_max);
+        linf_max = max(linf_max, other.linf_max);
+    }
+};
+
+struct Mover {
+    double l1;
+    double linf;
+    long long row;
+
+    bool operator>(const Mover &other) const {
+        return l1 > other.l1 || (l1 == other.l1 && row < other.row);
+    }
+};
+
+using TopHeap = priority_queue<Mover, vector<Mover>, greater<Mover>>; // smallest of the kept movers on top
+
+static void keep_top(TopHeap &heap, const Mover &mover, size_t top) {
+    if(heap.size() < top) {
+        heap.push(mover);
+    } else if(top > 0 && mover > heap.top()) {
+        heap.pop();
+        heap.push(mover);
+    }
+}
+
+// the infoset lines of a player, one per row: "|" followed by (move, observation) pairs
+static vector<uint8_t> read_depths(const string &path, long long rows) {
+    ifstream file(path);
+    if(!file.is_open())
+        return {};
+    vector<uint8_t> depths;
+    depths.reserve(rows);
+    string line;
+    while(getline(file, line)) {
+        depths.push_back(uint8_t(line.size() / 2));
+    }
+    if((long long)depths.size() != rows) {
+        cout << path << " has " << depths.size() << " infosets, the checkpoint " << rows << " rows, ignoring depths" << endl;
+        return {};
+    }
+    return depths;
+}
+
+static vector<string> read_lines(const string &path, vector<long long> wanted) {
+    sort(wanted.begin(), wanted.end());
+    vector<string> lines;
+    ifstream file(path);
+    string line;
+    long long idx = 0;
+    for(long long target: wanted) {
+        while(idx <= target && getline(file, line)) {
+            idx++;
+        }
+        lines.push_back(idx == target + 1 ? line : "");
+    }
+    return lines;
+}
+
+struct PlayerDiff {
+    vector<Bucket> depths;
+    Bucket total;
+    vector<Mover> top;
+    vector<string> top_infosets; // in the order of top, empty without the infoset files
+    vector<uint8_t> depth_of;
+};
+
+static PlayerDiff diff_player(const string &old_path, const string &new_path, const string &infoset_path, size_t top) {
+    io::MappedNpy<double> before(old_path);
+    io::MappedNpy<double> after(new_path);
+    if(before.rows() != after.rows() || before.cols() != after.cols()) {
+        throw runtime_error(old_path + " and " + new_path + " have different shapes");
+    }
+    long long rows = before.rows();
+    size_t cols = before.cols();
+
+    PlayerDiff diff;
+    diff.depth_of = read_depths(infoset_path, rows);
+    int num_depths = diff.depth_of.empty() ? 1 : *max_element(diff.depth_of.begin(), diff.depth_of.end()) + 1;
+
+    // one partial result per chunk, merged in chunk order so the sums do not depend on the thread count
+    long long num_chunks = (rows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    vector<vector<Bucket>> partial(num_chunks, vector<Bucket>(num_depths));
+    vector<TopHeap> partial_top(num_chunks);
+    parallel::parallel_for(0, num_chunks, [&](long long lo, long long hi) {
+        for(long long chunk = lo; chunk < hi; chunk++) {
+            long long end = min(rows, (chunk + 1) * CHUNK_ROWS);
+            for(long long i = chunk * CHUNK_ROWS; i < end; i++) {
+                const double *a = before.row(i);
+                const double *b = after.row(i);
+                double l1 = 0, linf = 0;
+                for(size_t j = 0; j < cols; j++) {
+                    double d = fabs(a[j] - b[j]);
+                    l1 += d;
+                    linf = max(linf, d);
+                }
+                Bucket &bucket = partial[chunk][diff.depth_of.empty() ? 0 : diff.depth_of[i]];
+                bucket.rows++;
+                bucket.changed += l1 > CHANGED_EPS;
+                bucket.l1_sum += l1;
+                bucket.l1_max = max(bucket.l1_max, l1);
+                bucket.linf_max = max(bucket.linf_max, linf);
+                keep_top(partial_top[chunk], {l1, linf, i}, top);
+            }
+        }
+    });
+
+    diff.depths.resize(num_depths);
+    TopHeap heap;
+    for(long long chunk = 0; chunk < num_chunks; chunk++) {
+        for(int d = 0; d < num_depths; d++) {
+            diff.depths[d].add(partial[chunk][d]);
+        }
+        for(; !partial_top[chunk].empty(); partial_top[chunk].pop()) {
+            keep_top(heap, partial_top[chunk].top(), top);
+        }
+    }
+    for(auto &bucket: diff.depths) {
+        diff.total.add(bucket);
+    }
+    for(; !heap.empty(); heap.pop()) {
+        diff.top.push_back(heap.top());
+    }
+    reverse(diff.top.begin(), diff.top.end());
+
+    if(!diff.depth_of.empty()) {
+        vector<long long> wanted;
+        for(auto &mover: diff.top) {
+            wanted.push_back(mover.row);
+        }
+        vector<string> lines = read_lines(infoset_path, wanted);
+        vector<long long> sorted_rows = wanted;
+        sort(sorted_rows.begin(), sorted_rows.end());
+        for(long long row: wanted) {
+            diff.top_infosets.push_back(lines[lower_bound(sorted_rows.begin(), sorted_rows.end(), row) - sorted_rows.begin()]);
+        }
+    }
+    return diff;
+}
+
+static string json_string(const string &s) {
+    string result = "\"";
+    for(char c: s) {
+        if(c == '"' || c == '\\')
+            result += '\\';
+        result += c;
+    }
+    return result + "\"";
+}
+
+static void write_bucket(ostream &out, const Bucket &bucket) {
+    out << "\"rows\": " << bucket.rows << ", \"changed\": " << bucket.changed
+        << ", \"changed_fraction\": " << (bucket.rows ? double(bucket.changed) / bucket.rows : 0)
+        << ", \"l1_mean\": " << (bucket.rows ? bucket.l1_sum / bucket.rows : 0)
+        << ", \"l1_max\": " << bucket.l1_max << ", \"linf_max\": " << bucket.linf_max;
+}
+
+static void write_json(const string &path, const string &old_name, const string &new_name, const vector<PlayerDiff> &players) {
+    ofstream out(path);
+    out << setprecision(9);
+    out << "{\n  \"old\": " << json_string(old_name) << ",\n  \"new\": " << json_string(new_name)
+        << ",\n  \"changed_eps\": " << CHANGED_EPS << ",\n  \"players\": [\n";
+    for(size_t p = 0; p < players.size(); p++) {
+        const PlayerDiff &diff = players[p];
+        out << "    {\"player\": " << p << ", ";
+        write_bucket(out, diff.total);
+        out << ",\n     \"depths\": [\n";
+        for(size_t d = 0; d < diff.depths.size(); d++) {
+            out << "       {\"depth\": " << d << ", ";
+            write_bucket(out, diff.depths[d]);
+            out << "}" << (d + 1 < diff.depths.size() ? "," : "") << "\n";
+        }
+        out << "     ],\n     \"top_movers\": [\n";
+        for(size_t k = 0; k < diff.top.size(); k++) {
+            const Mover &mover = diff.top[k];
+            out << "       {\"row\": " << mover.row << ", \"depth\": " << (diff.depth_of.empty() ? 0 : int(diff.depth_of[mover.row]))
+                << ", \"l1\": " << mover.l1 << ", \"linf\": " << mover.linf;
+            if(!diff.top_infosets.empty())
+                out << ", \"infoset\": " << json_string(diff.top_infosets[k]);
+            out << "}" << (k + 1 < diff.top.size() ? "," : "") << "\n";
+        }
+        out << "     ]}" << (p + 1 < players.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    if(!out) {
+        throw runtime_error("could not write " + path);
+    }
+}
+
+static void write_npy(const string &path, const vector<PlayerDiff> &players) {
+    io::NpyWriter<double> writer(path, 7);
+    for(size_t p = 0; p < players.size(); p++) {
+        for(size_t d = 0; d < players[p].depths.size(); d++) {
+            const Bucket &bucket = players[p].depths[d];
+            double row[7] = {double(p), double(d), double(bucket.rows), double(bucket.changed), bucket.l1_sum, bucket.l1_max, bucket.linf_max};
+            writer.write(row, 7);
+        }
+    }
+    writer.close();
+}
+
+int main(int argc, char **argv) {
+    if(argc < 3) {
+        cout << "usage: ckpt_diff <old_name> <new_name> [top] [out]" << endl;
+        return 1;
+    }
+    string old_name = argv[1], new_name = argv[2];
+    size_t top = argc > 3 ? stoul(argv[3]) : 20;
+    string out = argc > 4 ? string(argv[4]) : string(paths::get_checkpoints_dir() / ("diff__" + old_name + "__" + new_name));
+
+    auto start = chrono::steady_clock::now();
+    vector<PlayerDiff> players;
+    const string infoset_paths[2] = {pttt::get_player0_infoset_path(), pttt::get_player1_infoset_path()};
+    for(int p = 0; p < 2; p++) {
+        string part = "_p" + to_string(p) + ".npy";
+        players.push_back(diff_player(paths::get_checkpoints_dir() / (old_name + part), paths::get_checkpoints_dir() / (new_name + part),
+                                      infoset_paths[p], top));
+        const Bucket &total = players.back().total;
+        cout << "p" << p << ": rows=" << total.rows << " changed=" << double(total.changed) / max(1LL, total.rows)
+             << " mean L1=" << total.l1_sum / max(1LL, total.rows) << " max L1=" << total.l1_max << " max Linf=" << total.linf_max << endl;
+        for(size_t d = 0; d < players.back().depths.size(); d++) {
+            const Bucket &bucket = players.back().depths[d];
+            if(bucket.rows == 0)
+                continue;
+            cout << "  depth " << d << ": rows=" << bucket.rows << " changed=" << double(bucket.changed) / bucket.rows
+                 << " mean L1=" << bucket.l1_sum / bucket.rows << " max Linf=" << bucket.linf_max << endl;
+        }
+    }
+    write_json(out + ".json", old_name, new_name, players);
+    write_npy(out + ".npy", players);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "wrote " << out << ".json and " << out << ".npy in " << elapsed << "s" << endl;
+}
@@ -0,0 +1,103 @@
+// merges independently trained runs (same game, different seeds, no communication) into one checkpoint.
+// regrets and average policies are plain sums over iterations, so the merged run is what one run with all the
+// iterations would have accumulated. weights default to 1
+//
+//   ckpt_merge <pttt|leduc|kuhn> <output.store> <input.store>[:weight] ...
+//       merges regret stores (MCCFR(store_path)), the result can be trained further: pttt [layout] [group] <output.store>
+//   ckpt_merge npy <output_name> <name>[:weight] ...
+//       merges checkpoints/<name>_{p0,p1,state}.npy. the state (regrets) is summed, the policies are saved normalized
+//       so they can only be averaged with the weights, which is exact only if the runs reach the infosets equally often.
+//       prefer merging stores
+
+#include "io.hpp"
+#include "kernels.hpp"
+#include "loaded_game.hpp"
+#include "mccfr_es.hpp"
+#include "pttt.hpp"
+#include <chrono>
+
+using namespace std;
+
+static void parse_inputs(int argc, char **argv, vector<string> &inputs, vector<double> &weights) {
+    for(int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        size_t colon = arg.rfind(':');
+        if(colon != string::npos) {
+            inputs.push_back(arg.substr(0, colon));
+            weights.push_back(stod(arg.substr(colon + 1)));
+        } else {
+            inputs.push_back(arg);
+            weights.push_back(1.0);
+        }
+    }
+}
+
+template<typename Game>
+static void merge_stores(const string &output, const vector<string> &inputs, const vector<double> &weights) {
+    auto start = chrono::steady_clock::now();
+    uint64_t iterations = mccfr_es::MCCFR<Game>::merge_stores(inputs, weights, output);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "merged " << inputs.size() << " stores into " << output << ", iterations=" << iterations << " in " << elapsed << "s" << endl;
+}
+
+// out = sum_k scale_k * in_k, streamed in blocks of rows
+static void merge_npy(const string &output, const vector<string> &inputs, const vector<double> &scales) {
+    vector<unique_ptr<io::MappedNpy<double>>> tables;
+    for(auto &input: inputs) {
+        tables.emplace_back(new io::MappedNpy<double>(input));
+        if(tables.back()->shape() != tables.front()->shape()) {
+            throw runtime_error(input + " does not have the shape of " + inputs.front());
+        }
+    }
+    long long rows = tables.front()->rows(), cols = tables.front()->cols();
+    io::NpyWriter<double> writer(output, tables.front()->shape().size() == 1 ? -1 : cols);
+    constexpr long long BLOCK_ROWS = 1 << 18;
+    vector<double> block(min(rows, BLOCK_ROWS) * cols);
+    for(long long lo = 0; lo < rows; lo += BLOCK_ROWS) {
+        long long n = min(BLOCK_ROWS, rows - lo);
+        fill(block.begin(), block.begin() + n * cols, 0.0);
+        for(size_t k = 0; k < tables.size(); k++) {
+            kernels::scale_add(block.data(), tables[k]->data() + lo * cols, n * cols, scales[k]);
+        }
+        writer.write(block.data(), n * cols);
+    }
+    writer.close();
+    cout << "merged " << inputs.size() << " files into " << output << endl;
+}
+
+int main(int argc, char **argv) {
+    string what = argc > 1 ? argv[1] : "";
+    if(argc < 4 || (what != "pttt" && what != "leduc" && what != "kuhn" && what != "npy")) {
+        cout << "usage: ckpt_merge <pttt|leduc|kuhn> <output.store> <input.store>[:weight] ..." << endl;
+        cout << "       ckpt_merge npy <output_name> <name>[:weight] ..." << endl;
+        return 1;
+    }
+    string output = argv[2];
+    vector<string> inputs;
+    vector<double> weights;
+    parse_inputs(argc, argv, inputs, weights);
+
+    if(what == "pttt") {
+        merge_stores<pttt::PTTT>(output, inputs, weights);
+    } else if(what == "leduc") {
+        merge_stores<loaded_game::Leduc>(output, inputs, weights);
+    } else if(what == "kuhn") {
+        merge_stores<loaded_game::Kuhn>(output, inputs, weights);
+    } else {
+        double total_weight = 0;
+        for(double weight: weights) {
+            total_weight += weight;
+        }
+        vector<double> averaged;
+        for(double weight: weights) {
+            averaged.push_back(weight / total_weight);
+        }
+        for(string part: {"_p0", "_p1", "_state"}) {
+            vector<string> files;
+            for(auto &input: inputs) {
+                files.push_back(paths::get_checkpoints_dir() / (input + part + ".npy"));
+            }
+            merge_npy(paths::get_checkpoints_dir() / (output + part + ".npy"), files, part == "_state" ? weights : averaged);
+        }
+    }
+}
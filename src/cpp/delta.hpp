@@ -0,0 +1,239 @@
+#ifndef DELTA_HPP
+#define DELTA_HPP
+
+// incremental checkpoints: a base store (an arena::Array file, see arena.hpp) plus a chain of sparse deltas that only
+// hold the rows touched since the previous checkpoint.
+//   <base>            full table
+//   <base>.<n>.delta  DeltaHeader, num_rows int64 row indices (ascending), num_rows raw rows
+// deltas are applied in order of n, rows are whole rows so applying a delta twice is harmless.
+// compact() folds the chain into the base, load_checkpoint_chain in MCCFR replays it into the tables
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "arena.hpp"
+#include "parallel.hpp"
+
+namespace delta {
+    constexpr char DELTA_MAGIC[8] = {'M', 'C', 'C', 'F', 'R', 'D', 'L', 'T'};
+    constexpr uint32_t DELTA_VERSION = 1;
+
+    struct DeltaHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t element_bytes;
+        uint64_t table_size;
+        uint64_t num_rows;
+        uint64_t iterations; // iteration count of the tables when the delta was taken
+        uint64_t tag; // copied from the store header
+    };
+
+    // one bit per row, set by the training threads whenever they write a row.
+    // the bit is only written if it is not set yet, so hot rows don't keep bouncing the cache line between cores
+    class DirtyRows {
+        size_t size_;
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+    public:
+        explicit DirtyRows(size_t size): size_(size), words(new std::atomic<uint64_t>[(size + 63) / 64]) {
+            for(size_t w = 0; w < (size + 63) / 64; w++) {
+                words[w].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void mark(size_t idx) {
+            std::atomic<uint64_t> &word = words[idx >> 6];
+            uint64_t bit = uint64_t(1) << (idx & 63);
+            if(!(word.load(std::memory_order_relaxed) & bit)) {
+                word.fetch_or(bit, std::memory_order_relaxed);
+            }
+        }
+
+        // dirty rows in ascending order, clears the bits
+        std::vector<int64_t> take() {
+            std::vector<int64_t> rows;
+            for(size_t w = 0; w < (size_ + 63) / 64; w++) {
+                uint64_t bits = words[w].exchange(0, std::memory_order_relaxed);
+                while(bits) {
+                    rows.push_back(int64_t(w * 64 + __builtin_ctzll(bits)));
+                    bits &= bits - 1;
+                }
+            }
+            return rows;
+        }
+
+        size_t size() const { return size_; }
+    };
+
+    // writes to a temporary file and renames it, a crash never leaves a half written delta in the chain
+    inline void write_delta(const std::string &path, const DeltaHeader &header_in, const std::vector<int64_t> &rows, const std::vector<char> &bytes) {
+        DeltaHeader header = header_in;
+        memcpy(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC));
+        header.version = DELTA_VERSION;
+        header.num_rows = rows.size();
+        if(bytes.size() != rows.size() * header.element_bytes) {
+            throw std::runtime_error("delta rows and indices do not match");
+        }
+        std::string tmp_path = path + ".tmp";
+        FILE *file = fopen(tmp_path.c_str(), "wb");
+        if(file == nullptr) {
+            throw std::runtime_error("could not create " + tmp_path);
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(rows.data(), sizeof(int64_t), rows.size(), file) == rows.size()
+            && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+        ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+        fclose(file);
+        if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+            throw std::runtime_error("could not write " + path);
+        }
+    }
+
+    // calls fn(row_idx, row_bytes) for every row of the delta, reading the rows in chunks
+    template<typename Fn>
+    static DeltaHeader read_delta(const std::string &path, uint32_t element_bytes, uint64_t table_size, Fn fn) {
+        FILE *file = fopen(path.c_str(), "rb");
+        if(file == nullptr) {
+            throw std::runtime_error("could not open " + path);
+        }
+        DeltaHeader header;
+        if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0
+           || header.version != DELTA_VERSION) {
+            fclose(file);
+            throw std::runtime_error(path + " is not a delta checkpoint");
+        }
+        if(header.element_bytes != element_bytes || header.table_size != table_size) {
+            fclose(file);
+            throw std::runtime_error(path + " is a delta of a different table");
+        }
+        std::vector<int64_t> rows(header.num_rows);
+        if(fread(rows.data(), sizeof(int64_t), rows.size(), file) != rows.size()) {
+            fclose(file);
+            throw std::runtime_error(path + " is truncated");
+        }
+        constexpr size_t CHUNK_ROWS = 1 << 16;
+        std::vector<char> chunk(CHUNK_ROWS * element_bytes);
+        for(size_t lo = 0; lo < rows.size(); lo += CHUNK_ROWS) {
+            size_t n = std::min(CHUNK_ROWS, rows.size() - lo);
+            if(fread(chunk.data(), element_bytes, n, file) != n) {
+                fclose(file);
+                throw std::runtime_error(path + " is truncated");
+            }
+            for(size_t i = 0; i < n; i++) {
+                if(rows[lo + i] < 0 || uint64_t(rows[lo + i]) >= table_size) {
+                    fclose(file);
+                    throw std::runtime_error(path + " has a row out of range");
+                }
+                fn(rows[lo + i], chunk.data() + i * element_bytes);
+            }
+        }
+        fclose(file);
+        return header;
+    }
+
+    // existing deltas of a base in the order they have to be applied
+    inline std::vector<std::string> chain(const std::string &base_path) {
+        std::filesystem::path base(base_path);
+        std::string prefix = base.filename().string() + ".";
+        std::vector<std::pair<long long, std::string>> found;
+        std::filesystem::path dir = base.has_parent_path() ? base.parent_path() : std::filesystem::path(".");
+        if(!std::filesystem::exists(dir))
+            return {};
+        for(auto &entry: std::filesystem::directory_iterator(dir)) {
+            std::string name = entry.path().filename().string();
+            const std::string suffix = ".delta";
+            if(name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0
+               || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+                continue;
+            std::string number = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+            if(number.empty() || !std::all_of(number.begin(), number.end(), ::isdigit))
+                continue;
+            found.emplace_back(std::stoll(number), entry.path().string());
+        }
+        std::sort(found.begin(), found.end());
+        std::vector<std::string> res;
+        for(auto &f: found) {
+            res.push_back(f.second);
+        }
+        return res;
+    }
+
+    inline std::string next_delta_path(const std::string &base_path) {
+        long long next = 1;
+        for(auto &path: chain(base_path)) {
+            std::string name = std::filesystem::path(path).stem().string(); // <base>.<n>
+            next = std::max(next, std::stoll(name.substr(name.rfind('.') + 1)) + 1);
+        }
+        return base_path + "." + std::to_string(next) + ".delta";
+    }
+
+    inline size_t chain_bytes(const std::string &base_path) {
+        size_t bytes = 0;
+        for(auto &path: chain(base_path)) {
+            bytes += std::filesystem::file_size(path);
+        }
+        return bytes;
+    }
+
+    // folds the deltas into the base store in place and removes them, returns how many were merged.
+    // every delta is flushed into the base before it is deleted, so an interrupted compaction can simply be run again
+    inline size_t compact(const std::string &base_path) {
+        std::vector<std::string> deltas = chain(base_path);
+        if(deltas.empty())
+            return 0;
+        arena::FileDescriptor file(open(base_path.c_str(), O_RDWR));
+        if(file.fd < 0) {
+            throw std::runtime_error("could not open " + base_path);
+        }
+        arena::FileHeader file_header;
+        if(pread(file.fd, &file_header, sizeof(file_header), 0) != sizeof(file_header)
+           || memcmp(file_header.magic, arena::FILE_MAGIC, sizeof(arena::FILE_MAGIC)) != 0 || file_header.element_bytes == 0) {
+            throw std::runtime_error(base_path + " is not a table");
+        }
+        // mapping rows the file does not have would be a SIGBUS on the first write to them
+        struct stat st;
+        if(fstat(file.fd, &st) != 0) {
+            throw std::runtime_error("could not stat " + base_path);
+        }
+        if(size_t(st.st_size) < arena::FILE_HEADER_BYTES
+           || file_header.size > (size_t(st.st_size) - arena::FILE_HEADER_BYTES) / file_header.element_bytes) {
+            throw std::runtime_error(base_path + " is truncated");
+        }
+        size_t bytes = arena::FILE_HEADER_BYTES + file_header.size * file_header.element_bytes;
+        void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+        if(mapping == MAP_FAILED) {
+            throw std::runtime_error("could not map " + base_path);
+        }
+        auto *header = static_cast<arena::FileHeader*>(mapping);
+        char *rows = static_cast<char*>(mapping) + arena::FILE_HEADER_BYTES;
+        try {
+            for(auto &path: deltas) {
+                DeltaHeader delta_header = read_delta(path, file_header.element_bytes, file_header.size, [&](int64_t idx, const char *row) {
+                    memcpy(rows + idx * file_header.element_bytes, row, file_header.element_bytes);
+                });
+                header->iterations = delta_header.iterations;
+                msync(mapping, bytes, MS_SYNC);
+                std::filesystem::remove(path);
+            }
+        } catch(...) {
+            munmap(mapping, bytes);
+            throw;
+        }
+        munmap(mapping, bytes);
+        return deltas.size();
+    }
+} // namespace delta
+
+#endif
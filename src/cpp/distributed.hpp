@@ -0,0 +1,915 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+// MCCFR over several processes / machines.
+// the infoset ids are split in contiguous ranges, one per ShardServer, which owns the regret minimizers of its range.
+// Workers sample outcome sampling episodes locally (same math as mccfr_es::MCCFR::iteration_interleaved):
+//   - a group of episodes is advanced in lockstep, every round the policies the group needs and does not have cached
+//     are fetched with one GET_POLICY request per shard, sent to all shards before waiting on any of them
+//   - the updates of the backward pass are summed per infoset and pushed (PUSH_DELTAS) by a sender thread every
+//     push_every groups or push_batch_rows rows, the worker never waits for them
+// policies are cached for cache_ttl groups, so a worker trains on slightly stale policies. the shards measure
+// staleness as the number of delta records they applied between the fetch of a policy and the push of its delta.
+// a shard can keep its rows in a store file, so that a run survives the server processes (see ShardServer).
+// the protocol is raw structs over TCP, all processes have to be the same build on the same architecture
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "arena.hpp"
+#include "mccfr_es.hpp"
+
+namespace distributed {
+    using T = double;
+
+    enum MessageType: uint32_t {GET_POLICY = 1, PUSH_DELTAS = 2, GET_AVERAGE = 3, GET_STATS = 4, SYNC = 5};
+
+    struct MessageHeader {
+        uint32_t type;
+        uint32_t count; // number of records that follow
+    };
+
+    // more records in one message are rejected, the buffers for them are allocated before anything is checked
+    constexpr uint32_t MAX_RECORDS = 1 << 22;
+
+    // first thing of every reply. a request the shard rejects (infoset outside its range, bad dim, too many records)
+    // gets ok = 0 followed by error_bytes of message, then the shard closes the connection. PUSH_DELTAS has no
+    // reply, its rejection is what the next request on that connection (e.g. SYNC) reads
+    struct ReplyHeader {
+        uint32_t ok;
+        uint32_t error_bytes;
+    };
+
+    ////////////////////////////////////////
+    // sockets
+
+    inline void send_all(int fd, const void *data, size_t bytes) {
+        const char *ptr = static_cast<const char*>(data);
+        while(bytes > 0) {
+            ssize_t sent = send(fd, ptr, bytes, MSG_NOSIGNAL);
+            if(sent <= 0)
+                throw std::runtime_error("connection lost");
+            ptr += sent;
+            bytes -= sent;
+        }
+    }
+
+    inline void recv_all(int fd, void *data, size_t bytes) {
+        char *ptr = static_cast<char*>(data);
+        while(bytes > 0) {
+            ssize_t got = recv(fd, ptr, bytes, 0);
+            if(got <= 0)
+                throw std::runtime_error("connection lost");
+            ptr += got;
+            bytes -= got;
+        }
+    }
+
+    // reads the ReplyHeader of a reply, throws the shard's message if the request was rejected
+    inline void recv_reply_header(int fd) {
+        ReplyHeader reply;
+        recv_all(fd, &reply, sizeof(reply));
+        if(!reply.ok) {
+            std::string message(reply.error_bytes, '\0');
+            recv_all(fd, &message[0], message.size());
+            throw std::runtime_error("shard rejected the request: " + message);
+        }
+    }
+
+    inline void send_reply_header(int fd) {
+        ReplyHeader reply{1, 0};
+        send_all(fd, &reply, sizeof(reply));
+    }
+
+    inline void set_no_delay(int fd) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    inline int listen_on(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0) {
+            throw std::runtime_error("could not create a socket for port " + std::to_string(port));
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        if(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            throw std::runtime_error("could not listen on port " + std::to_string(port));
+        }
+        return fd;
+    }
+
+    // "host:port", retries for a while so that workers can be started before the servers are up
+    inline int connect_to(const std::string &address) {
+        size_t colon = address.rfind(':');
+        std::string host = address.substr(0, colon);
+        std::string port = address.substr(colon + 1);
+        for(int attempt = 0; attempt < 100; attempt++) {
+            addrinfo hints{}, *res = nullptr;
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            if(getaddrinfo(host.c_str(), port.c_str(), &hints, &res) == 0) {
+                int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+                bool ok = fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+                freeaddrinfo(res);
+                if(ok) {
+                    set_no_delay(fd);
+                    return fd;
+                }
+                if(fd >= 0)
+                    close(fd);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        throw std::runtime_error("could not connect to " + address);
+    }
+
+    ////////////////////////////////////////
+    // messages
+
+    // contiguous infoset ranges, shard s owns [begin(s), end(s))
+    struct ShardMap {
+        int num_shards;
+        long long num_info_sets;
+
+        long long begin(int shard) const { return num_info_sets * shard / num_shards; }
+        long long end(int shard) const { return num_info_sets * (shard + 1) / num_shards; }
+
+        int shard_of(long long info_set_idx) const {
+            int shard = int(info_set_idx * num_shards / num_info_sets);
+            while(info_set_idx < begin(shard)) shard--;
+            while(info_set_idx >= end(shard)) shard++;
+            return shard;
+        }
+    };
+
+    struct PolicyRequest {
+        int32_t info_set_idx;
+        int32_t dim;
+    };
+
+    template<int MAX_DIM>
+    struct PolicyReply {
+        T policy[MAX_DIM];
+        T baselines[MAX_DIM];
+    };
+
+    // everything one worker accumulated for one infoset since its last push
+    template<int MAX_DIM>
+    struct DeltaRecord {
+        int32_t info_set_idx;
+        int32_t dim;
+        int32_t baseline_samples;
+        int32_t padding;
+        uint64_t fetch_version; // shard version the policy used for these updates was fetched at
+        T regret[MAX_DIM];
+        T average_policy[MAX_DIM]; // action space, like increment_avg_policy
+        T baseline_sum[MAX_DIM];
+    };
+
+    struct AverageRequest {
+        int64_t begin, end;
+    };
+
+    struct ShardStats {
+        int64_t begin, end;
+        uint64_t version; // delta records applied so far
+        uint64_t policy_requests, policy_rows;
+        uint64_t push_batches, push_rows;
+        uint64_t staleness_sum; // over all applied records
+    };
+
+    ////////////////////////////////////////
+
+    template<class Game>
+    class ShardServer {
+        using Row = mccfr_es::RegretMinimizer<Game::ACTION_MAX_DIM>;
+        using Reply = PolicyReply<Game::ACTION_MAX_DIM>;
+        using Record = DeltaRecord<Game::ACTION_MAX_DIM>;
+        using Buffer = std::array<T, Game::ACTION_MAX_DIM>;
+
+        long long begin, end;
+        arena::Array<Row> rows;
+        std::mutex dims_mtx; // the first dim a message gives an unvisited row is checked and set under it
+
+        std::atomic<uint64_t> version{0};
+        std::atomic<uint64_t> policy_requests{0}, policy_rows{0}, push_batches{0}, push_rows{0}, staleness_sum{0};
+
+    public:
+        // with a store_path the rows of the shard live in that file (see arena::Array), which is updated in place and
+        // outlives the server: starting it again with the same shard, shard count and file resumes the shard.
+        // the kernel writes the pages back, so only a crash of the machine loses updates
+        ShardServer(int shard, const ShardMap &map, const std::string &store_path = ""):
+            begin(map.begin(shard)), end(map.end(shard)),
+            rows(store_path.empty() ? arena::Array<Row>(map.end(shard) - map.begin(shard))
+                                    : arena::Array<Row>(map.end(shard) - map.begin(shard), store_path)) {
+            if(!rows.file_backed())
+                return;
+            // the tag is the first infoset of the shard, the size check alone does not tell equally sized shards apart
+            if(!rows.reopened()) {
+                rows.header().tag = uint64_t(begin);
+            } else if(rows.header().tag != uint64_t(begin)) {
+                throw std::runtime_error(store_path + " is the store of another shard");
+            }
+            // a killed server may have left rows locked
+            parallel::parallel_for(0, rows.size(), [this](long long lo, long long hi) {
+                for(long long i = lo; i < hi; i++) {
+                    rows[i].reset_locks();
+                }
+            });
+        }
+
+        ShardStats stats() {
+            return {begin, end, version.load(), policy_requests.load(), policy_rows.load(), push_batches.load(), push_rows.load(), staleness_sum.load()};
+        }
+
+        // one thread per connection, prints its throughput every report_seconds
+        void serve(int port, int report_seconds = 10) {
+            int listen_fd = listen_on(port);
+            std::cout << "shard [" << begin << ", " << end << ") listening on " << port << std::endl;
+            std::thread([this, report_seconds]() {
+                ShardStats prev = stats();
+                while(true) {
+                    std::this_thread::sleep_for(std::chrono::seconds(report_seconds));
+                    ShardStats now = stats();
+                    uint64_t pushed = now.push_rows - prev.push_rows;
+                    uint64_t fetched = now.policy_rows - prev.policy_rows;
+                    std::cout << "shard [" << begin << ", " << end << ")"
+                              << " fetched rows/sec=" << double(fetched) / report_seconds
+                              << " rows/request=" << double(fetched) / std::max<uint64_t>(1, now.policy_requests - prev.policy_requests)
+                              << " pushed rows/sec=" << double(pushed) / report_seconds
+                              << " rows/push=" << double(pushed) / std::max<uint64_t>(1, now.push_batches - prev.push_batches)
+                              << " staleness=" << double(now.staleness_sum - prev.staleness_sum) / std::max<uint64_t>(1, pushed)
+                              << std::endl;
+                    prev = now;
+                }
+            }).detach();
+            while(true) {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if(fd < 0)
+                    continue;
+                set_no_delay(fd);
+                std::thread([this, fd]() {
+                    try {
+                        handle(fd);
+                    } catch(const std::runtime_error &) {
+                        // the peer went away
+                    }
+                    close(fd);
+                }).detach();
+            }
+        }
+
+    private:
+        // what the shard rejects, the message goes back to the client
+        struct Rejected: std::runtime_error {
+            using std::runtime_error::runtime_error;
+        };
+
+        void handle(int fd) {
+            std::vector<PolicyRequest> requests;
+            std::vector<Reply> replies;
+            std::vector<Record> records;
+            while(true) {
+                MessageHeader header;
+                recv_all(fd, &header, sizeof(header));
+                try {
+                    handle(fd, header, requests, replies, records);
+                } catch(const Rejected &e) {
+                    std::string message = e.what();
+                    ReplyHeader reply{0, uint32_t(message.size())};
+                    send_all(fd, &reply, sizeof(reply));
+                    send_all(fd, message.data(), message.size());
+                    return;
+                }
+            }
+        }
+
+        void handle(int fd, const MessageHeader &header, std::vector<PolicyRequest> &requests, std::vector<Reply> &replies, std::vector<Record> &records) {
+            if(header.count > MAX_RECORDS) {
+                throw Rejected(std::to_string(header.count) + " records in one message");
+            }
+            if(header.type == GET_POLICY) {
+                requests.resize(header.count);
+                replies.resize(header.count);
+                recv_all(fd, requests.data(), requests.size() * sizeof(PolicyRequest));
+                check_rows(requests);
+                for(size_t i = 0; i < requests.size(); i++) {
+                    Row &row = local_row(requests[i].info_set_idx);
+                    Buffer policy, baselines;
+                    row.set_dim(requests[i].dim);
+                    row.next_policy(policy);
+                    row.get_baselines(baselines);
+                    std::copy(policy.begin(), policy.end(), replies[i].policy);
+                    std::copy(baselines.begin(), baselines.end(), replies[i].baselines);
+                }
+                uint64_t current_version = version.load();
+                send_reply_header(fd);
+                send_all(fd, &current_version, sizeof(current_version));
+                send_all(fd, replies.data(), replies.size() * sizeof(Reply));
+                policy_requests++;
+                policy_rows += header.count;
+            } else if(header.type == PUSH_DELTAS) {
+                records.resize(header.count);
+                recv_all(fd, records.data(), records.size() * sizeof(Record));
+                // all or nothing, a rejected batch leaves the rows untouched
+                for(auto &record: records) {
+                    if(record.baseline_samples < 0) {
+                        throw Rejected("negative baseline sample count");
+                    }
+                }
+                check_rows(records);
+                uint64_t staleness = 0;
+                for(auto &record: records) {
+                    apply(record);
+                    uint64_t now = version.fetch_add(1);
+                    staleness += now - std::min(record.fetch_version, now);
+                }
+                push_batches++;
+                push_rows += header.count;
+                staleness_sum += staleness;
+            } else if(header.type == GET_AVERAGE) {
+                AverageRequest request;
+                recv_all(fd, &request, sizeof(request));
+                if(request.begin < begin || request.end > end || request.begin > request.end) {
+                    throw Rejected("[" + std::to_string(request.begin) + ", " + std::to_string(request.end) + ") is not in this shard");
+                }
+                std::vector<Buffer> average(request.end - request.begin);
+                for(int64_t i = request.begin; i < request.end; i++) {
+                    local_row(i).get_average_policy(average[i - request.begin]);
+                }
+                send_reply_header(fd);
+                send_all(fd, average.data(), average.size() * sizeof(Buffer));
+            } else if(header.type == GET_STATS) {
+                ShardStats current = stats();
+                send_reply_header(fd);
+                send_all(fd, &current, sizeof(current));
+            } else if(header.type == SYNC) {
+                // everything sent before on this connection has been applied
+                char ack = 1;
+                send_reply_header(fd);
+                send_all(fd, &ack, 1);
+            } else {
+                throw Rejected("unknown message " + std::to_string(header.type));
+            }
+        }
+
+        // every item (PolicyRequest or Record) has to be in the shard and agree with the dim of its row, set_dim
+        // asserts on a mismatch. rows that were never visited get their dim here, once the whole message passed.
+        // a dim is never changed once set, so only those rows need dims_mtx
+        template<class Item>
+        void check_rows(const std::vector<Item> &items) {
+            std::vector<const Item*> unvisited;
+            for(auto &item: items) {
+                check_row(item.info_set_idx, item.dim);
+                if(local_row(item.info_set_idx).get_dim() == 0)
+                    unvisited.push_back(&item);
+            }
+            if(unvisited.empty())
+                return;
+            std::lock_guard<std::mutex> lock(dims_mtx);
+            std::unordered_map<long long, int> fresh; // dims the message gives the rows that are still unvisited
+            for(auto *item: unvisited) {
+                check_dim(item->info_set_idx, item->dim, fresh);
+            }
+            for(auto &[idx, dim]: fresh) {
+                local_row(idx).set_dim(dim);
+            }
+        }
+
+        void check_row(long long info_set_idx, int dim) {
+            if(info_set_idx < begin || info_set_idx >= end) {
+                throw Rejected("infoset " + std::to_string(info_set_idx) + " is not in this shard");
+            }
+            if(dim < 1 || dim > Game::ACTION_MAX_DIM) {
+                throw Rejected("infoset " + std::to_string(info_set_idx) + " has dim " + std::to_string(dim));
+            }
+            check_dim(info_set_idx, dim, local_row(info_set_idx).get_dim());
+        }
+
+        void check_dim(long long info_set_idx, int dim, std::unordered_map<long long, int> &fresh) {
+            int stored = local_row(info_set_idx).get_dim();
+            if(stored == 0) {
+                stored = fresh.emplace(info_set_idx, dim).first->second;
+            }
+            check_dim(info_set_idx, dim, stored);
+        }
+
+        static void check_dim(long long info_set_idx, int dim, int stored) {
+            if(stored != 0 && stored != dim) {
+                throw Rejected("infoset " + std::to_string(info_set_idx) + " has dim " + std::to_string(stored) + ", not " + std::to_string(dim));
+            }
+        }
+
+        Row& local_row(long long info_set_idx) {
+            assert(info_set_idx >= begin && info_set_idx < end);
+            return rows[info_set_idx - begin];
+        }
+
+        void apply(const Record &record) {
+            Row &row = local_row(record.info_set_idx);
+            Buffer regret, average, baseline_mean;
+            std::copy(record.regret, record.regret + Game::ACTION_MAX_DIM, regret.begin());
+            std::copy(record.average_policy, record.average_policy + Game::ACTION_MAX_DIM, average.begin());
+            for(int i = 0; i < Game::ACTION_MAX_DIM; i++) {
+                baseline_mean[i] = record.baseline_samples > 0 ? record.baseline_sum[i] / record.baseline_samples : 0;
+            }
+            row.set_dim(record.dim);
+            row.add_regret(regret);
+            row.add_average_policy(average);
+            if(record.baseline_samples > 0)
+                row.update_baselines(baseline_mean, record.baseline_samples);
+        }
+    };
+
+    ////////////////////////////////////////
+
+    // counters of one worker, summed over all workers by the caller
+    struct WorkerStats {
+        uint64_t episodes = 0;
+        uint64_t fetch_rounds = 0, fetched_rows = 0, cache_hits = 0;
+        uint64_t push_batches = 0, pushed_rows = 0;
+        uint64_t cache_age_sum = 0; // groups since the fetch, summed over cache hits
+
+        WorkerStats& operator+=(const WorkerStats &other) {
+            episodes += other.episodes;
+            fetch_rounds += other.fetch_rounds;
+            fetched_rows += other.fetched_rows;
+            cache_hits += other.cache_hits;
+            push_batches += other.push_batches;
+            pushed_rows += other.pushed_rows;
+            cache_age_sum += other.cache_age_sum;
+            return *this;
+        }
+    };
+
+    // one per training thread
+    template<class Game>
+    class Worker {
+        using Player = typename Game::Player;
+        using Buffer = std::array<T, Game::ACTION_MAX_DIM>;
+        using BufferInt = std::array<int, Game::ACTION_MAX_DIM>;
+        using Reply = PolicyReply<Game::ACTION_MAX_DIM>;
+        using Record = DeltaRecord<Game::ACTION_MAX_DIM>;
+        static constexpr T EXPLORATION = mccfr_es::MCCFR<Game>::EXPLORATION;
+
+        ShardMap map;
+        std::vector<int> fetch_fds; // request / reply, only used by the training thread
+        std::vector<int> push_fds; // one way, only used by the sender thread
+
+        struct CacheEntry {
+            Buffer policy;
+            Buffer baselines;
+            uint64_t version;
+            uint64_t generation;
+        };
+        std::unordered_map<int, CacheEntry> cache;
+        uint64_t generation = 0; // groups run so far
+        int cache_ttl;
+
+        std::vector<std::unordered_map<int, Record>> pending; // per shard
+        size_t pending_rows = 0;
+        size_t push_batch_rows;
+        int push_every; // groups, pushes even if fewer than push_batch_rows rows are pending
+        uint64_t last_push_generation = 0;
+
+        // sender thread
+        std::deque<std::pair<int, std::vector<Record>>> outbox; // (shard, records), shard -1 = sync marker
+        std::mutex outbox_mtx;
+        std::condition_variable outbox_cv;
+        std::thread sender;
+        bool stopping = false;
+        bool synced = false;
+        std::exception_ptr send_error; // what stopped the sender thread, rethrown by the next iteration_group / flush
+
+        std::mt19937 gen;
+        std::uniform_real_distribution<T> dis;
+
+        std::mutex stats_mtx;
+        WorkerStats stats_;
+
+        struct Frame {
+            int info_set_idx;
+            Player cur_player;
+            int num_actions;
+            int action_idx;
+            Buffer policy;
+            Buffer sample_policy;
+            BufferInt actions;
+            Buffer baseline_values;
+            uint64_t version;
+            T reach_me, reach_other, reach_sample;
+        };
+
+        struct InFlightEpisode {
+            Game state;
+            Player player;
+            T reach_me, reach_other, reach_sample;
+            std::vector<Frame> path;
+
+            InFlightEpisode(Player player): player(player), reach_me(1.0), reach_other(1.0), reach_sample(1.0) {}
+        };
+
+    public:
+        Worker(const std::vector<std::string> &shard_addresses, int cache_ttl = 1, size_t push_batch_rows = 1 << 14, int push_every = 16):
+            map{int(shard_addresses.size()), Game::NUM_INFO_SETS}, cache_ttl(cache_ttl), pending(shard_addresses.size()),
+            push_batch_rows(push_batch_rows), push_every(push_every), gen(std::random_device()()), dis(0.0, 1.0) {
+            for(auto &address: shard_addresses) {
+                fetch_fds.push_back(connect_to(address));
+                push_fds.push_back(connect_to(address));
+            }
+            sender = std::thread([this]() { send_loop(); });
+        }
+
+        Worker(const Worker &) = delete;
+        Worker& operator=(const Worker &) = delete;
+
+        // pushes what is still pending. an error can not be thrown from here, it is printed
+        ~Worker() {
+            try {
+                flush();
+            } catch(const std::runtime_error &e) {
+                std::cerr << "deltas not pushed: " << e.what() << std::endl;
+            }
+            {
+                std::lock_guard<std::mutex> lock(outbox_mtx);
+                stopping = true;
+            }
+            outbox_cv.notify_all();
+            sender.join();
+            for(int fd: fetch_fds) close(fd);
+            for(int fd: push_fds) close(fd);
+        }
+
+        // group_size episodes per player, like MCCFR::iteration_interleaved
+        void iteration_group(int group_size) {
+            {
+                std::lock_guard<std::mutex> lock(outbox_mtx);
+                rethrow_send_error();
+            }
+            std::vector<InFlightEpisode> group;
+            group.reserve(group_size * Game::NUM_PLAYERS);
+            for(int i = 0; i < group_size * Game::NUM_PLAYERS; i++) {
+                group.emplace_back(Game::players[i % Game::NUM_PLAYERS]);
+            }
+
+            std::vector<InFlightEpisode*> running;
+            for(auto &ep: group) {
+                if(!ep.state.is_terminal())
+                    running.push_back(&ep);
+            }
+            while(!running.empty()) {
+                fetch_missing(running);
+                int still_running = 0;
+                for(auto *ep: running) {
+                    forward_step(*ep);
+                    if(!ep->state.is_terminal())
+                        running[still_running++] = ep;
+                }
+                running.resize(still_running);
+            }
+            for(auto &ep: group) {
+                backward(ep);
+            }
+
+            generation++;
+            if(cache_ttl <= 1 || generation % cache_ttl == 0) {
+                cache.clear();
+            }
+            {
+                std::lock_guard<std::mutex> lock(stats_mtx);
+                stats_.episodes += group.size();
+            }
+            if(pending_rows >= push_batch_rows || generation - last_push_generation >= uint64_t(push_every)) {
+                push_pending();
+            }
+        }
+
+        // pushes everything pending and waits until the shards applied it. throws what the sender ran into
+        // (lost connection, a batch the shard rejected), also if that happened to an earlier push
+        void flush() {
+            push_pending();
+            std::unique_lock<std::mutex> lock(outbox_mtx);
+            synced = false;
+            outbox.emplace_back(-1, std::vector<Record>());
+            outbox_cv.notify_all();
+            outbox_cv.wait(lock, [this]() { return synced || send_error; });
+            rethrow_send_error();
+        }
+
+        WorkerStats stats() {
+            std::lock_guard<std::mutex> lock(stats_mtx);
+            return stats_;
+        }
+
+    private:
+        // one GET_POLICY per shard for all the infosets the running episodes need next and that are not cached.
+        // the requests go out to every shard before any reply is read, so the shards work on them in parallel
+        void fetch_missing(const std::vector<InFlightEpisode*> &running) {
+            std::vector<std::vector<PolicyRequest>> requests(map.num_shards);
+            std::unordered_set<int> requested; // several episodes of the group can be at the same infoset
+            uint64_t hits = 0, age = 0;
+            for(auto *ep: running) {
+                if(ep->state.is_chance())
+                    continue;
+                int info_set_idx = ep->state.info_set_idx();
+                auto it = cache.find(info_set_idx);
+                if(it != cache.end()) {
+                    hits++;
+                    age += generation - it->second.generation;
+                    continue;
+                }
+                if(requested.insert(info_set_idx).second) {
+                    requests[map.shard_of(info_set_idx)].push_back({info_set_idx, ep->state.num_actions()});
+                } else {
+                    hits++; // fetched once for the whole group
+                }
+            }
+            uint64_t rows = 0;
+            for(int shard = 0; shard < map.num_shards; shard++) {
+                if(requests[shard].empty())
+                    continue;
+                MessageHeader header{GET_POLICY, uint32_t(requests[shard].size())};
+                send_all(fetch_fds[shard], &header, sizeof(header));
+                send_all(fetch_fds[shard], requests[shard].data(), requests[shard].size() * sizeof(PolicyRequest));
+            }
+            std::vector<Reply> replies;
+            for(int shard = 0; shard < map.num_shards; shard++) {
+                if(requests[shard].empty())
+                    continue;
+                uint64_t version;
+                replies.resize(requests[shard].size());
+                recv_reply_header(fetch_fds[shard]);
+                recv_all(fetch_fds[shard], &version, sizeof(version));
+                recv_all(fetch_fds[shard], replies.data(), replies.size() * sizeof(Reply));
+                for(size_t i = 0; i < replies.size(); i++) {
+                    CacheEntry &entry = cache[requests[shard][i].info_set_idx];
+                    std::copy(replies[i].policy, replies[i].policy + Game::ACTION_MAX_DIM, entry.policy.begin());
+                    std::copy(replies[i].baselines, replies[i].baselines + Game::ACTION_MAX_DIM, entry.baselines.begin());
+                    entry.version = version;
+                    entry.generation = generation;
+                }
+                rows += replies.size();
+            }
+            std::lock_guard<std::mutex> lock(stats_mtx);
+            stats_.cache_hits += hits;
+            stats_.cache_age_sum += age;
+            if(rows > 0) {
+                stats_.fetch_rounds++;
+                stats_.fetched_rows += rows;
+            }
+        }
+
+        int sample_index(const Buffer &probs, int size) {
+            T sum = 0;
+            for(int i = 0; i < size; i++) {
+                sum += probs[i];
+            }
+            if(sum <= 1e-9) { // epsilon error
+                return int(dis(gen) * size);
+            }
+            T r = dis(gen) * sum;
+            T cumulative = 0.0;
+            for(int i = 0; i < size; i++) {
+                cumulative += probs[i];
+                if(r < cumulative) {
+                    return i;
+                }
+            }
+            return size - 1;
+        }
+
+        // MCCFR::forward_step with the row read from the cache
+        void forward_step(InFlightEpisode &ep) {
+            const Game &state = ep.state;
+            int num_actions = state.num_actions();
+
+            if(state.is_chance()) {
+                Buffer probs;
+                BufferInt actions;
+                state.actions(actions);
+                state.action_probs(probs);
+                int action_idx = sample_index(probs, num_actions);
+                ep.reach_other *= probs[action_idx];
+                ep.reach_sample *= probs[action_idx];
+                ep.state.step(actions[action_idx]);
+                return;
+            }
+
+            ep.path.emplace_back();
+            Frame &frame = ep.path.back();
+            frame.info_set_idx = state.info_set_idx();
+            frame.cur_player = state.current_player();
+            frame.num_actions = num_actions;
+            frame.reach_me = ep.reach_me;
+            frame.reach_other = ep.reach_other;
+            frame.reach_sample = ep.reach_sample;
+            state.actions(frame.actions);
+
+            const CacheEntry &entry = cache.at(frame.info_set_idx);
+            frame.policy = entry.policy;
+            frame.baseline_values = entry.baselines;
+            frame.version = entry.version;
+
+            for(int i = 0; i < num_actions; i++) {
+                frame.sample_policy[i] = frame.cur_player == ep.player
+                    ? EXPLORATION / num_actions + (1.0 - EXPLORATION) * frame.policy[i]
+                    : frame.policy[i];
+            }
+            frame.action_idx = sample_index(frame.sample_policy, num_actions);
+
+            ep.reach_sample *= frame.sample_policy[frame.action_idx];
+            if(frame.cur_player == ep.player) {
+                ep.reach_me *= frame.policy[frame.action_idx];
+            } else {
+                ep.reach_other *= frame.policy[frame.action_idx];
+            }
+            ep.state.step(frame.actions[frame.action_idx]);
+        }
+
+        // MCCFR::backward_step for the whole path, the updates go to the pending deltas
+        void backward(InFlightEpisode &ep) {
+            const Player player = ep.player;
+            T value = ep.state.utility(player);
+            while(!ep.path.empty()) {
+                const Frame &frame = ep.path.back();
+                Record &record = pending_record(frame.info_set_idx, frame.num_actions, frame.version);
+
+                Buffer utility;
+                T value_estimate = 0;
+                for(int i = 0; i < frame.num_actions; i++) {
+                    // Zero-sum game hack
+                    const T baseline = frame.cur_player == player ? frame.baseline_values[i] : -frame.baseline_values[i];
+                    T child_value = (
+                        (frame.action_idx == i)
+                        ? (baseline + (value - baseline) / frame.sample_policy[frame.action_idx])
+                        : (baseline)
+                    );
+                    utility[i] = child_value * frame.reach_other / frame.reach_sample;
+                    record.baseline_sum[i] += frame.cur_player == player ? child_value : -child_value;
+                    value_estimate += child_value * frame.policy[i];
+                }
+                record.baseline_samples++;
+
+                if(frame.cur_player == player) {
+                    T avg = 0;
+                    for(int i = 0; i < frame.num_actions; i++) {
+                        avg += frame.policy[i] * utility[i];
+                    }
+                    for(int i = 0; i < frame.num_actions; i++) {
+                        record.regret[i] += utility[i] - avg;
+                        record.average_policy[frame.actions[i]] += frame.reach_me * frame.policy[i] / frame.reach_sample;
+                    }
+                }
+                value = value_estimate;
+                ep.path.pop_back();
+            }
+        }
+
+        Record& pending_record(int info_set_idx, int dim, uint64_t version) {
+            auto &shard_pending = pending[map.shard_of(info_set_idx)];
+            auto it = shard_pending.find(info_set_idx);
+            if(it != shard_pending.end()) {
+                it->second.fetch_version = std::min(it->second.fetch_version, version);
+                return it->second;
+            }
+            Record &record = shard_pending[info_set_idx];
+            memset(&record, 0, sizeof(record));
+            record.info_set_idx = info_set_idx;
+            record.dim = dim;
+            record.fetch_version = version;
+            pending_rows++;
+            return record;
+        }
+
+        void push_pending() {
+            last_push_generation = generation;
+            uint64_t batches = 0, rows = 0;
+            {
+                std::lock_guard<std::mutex> lock(outbox_mtx);
+                rethrow_send_error();
+                for(int shard = 0; shard < map.num_shards; shard++) {
+                    if(pending[shard].empty())
+                        continue;
+                    std::vector<Record> records;
+                    records.reserve(pending[shard].size());
+                    for(auto &[idx, record]: pending[shard]) {
+                        records.push_back(record);
+                    }
+                    pending[shard].clear();
+                    rows += records.size();
+                    batches++;
+                    outbox.emplace_back(shard, std::move(records));
+                }
+                pending_rows = 0;
+            }
+            outbox_cv.notify_all();
+            std::lock_guard<std::mutex> lock(stats_mtx);
+            stats_.push_batches += batches;
+            stats_.pushed_rows += rows;
+        }
+
+        // outbox_mtx held
+        void rethrow_send_error() {
+            if(send_error)
+                std::rethrow_exception(send_error);
+        }
+
+        // stops at the first error: it is kept for the training thread and what is still queued is dropped
+        void send_loop() {
+            try {
+                while(true) {
+                    std::pair<int, std::vector<Record>> item;
+                    {
+                        std::unique_lock<std::mutex> lock(outbox_mtx);
+                        outbox_cv.wait(lock, [this]() { return stopping || !outbox.empty(); });
+                        if(outbox.empty())
+                            return;
+                        item = std::move(outbox.front());
+                        outbox.pop_front();
+                    }
+                    if(item.first == -1) {
+                        for(int fd: push_fds) {
+                            MessageHeader header{SYNC, 0};
+                            char ack;
+                            send_all(fd, &header, sizeof(header));
+                            recv_reply_header(fd);
+                            recv_all(fd, &ack, 1);
+                        }
+                        std::lock_guard<std::mutex> lock(outbox_mtx);
+                        synced = true;
+                        outbox_cv.notify_all();
+                        continue;
+                    }
+                    MessageHeader header{PUSH_DELTAS, uint32_t(item.second.size())};
+                    send_all(push_fds[item.first], &header, sizeof(header));
+                    send_all(push_fds[item.first], item.second.data(), item.second.size() * sizeof(Record));
+                }
+            } catch(const std::runtime_error &) {
+                std::lock_guard<std::mutex> lock(outbox_mtx);
+                send_error = std::current_exception();
+                outbox.clear();
+                outbox_cv.notify_all();
+            }
+        }
+    };
+
+    ////////////////////////////////////////
+
+    // the average policy of all shards, e.g. to evaluate it
+    template<class Game>
+    static std::vector<std::array<T, Game::ACTION_MAX_DIM>> fetch_average_policy(const std::vector<std::string> &shard_addresses) {
+        ShardMap map{int(shard_addresses.size()), Game::NUM_INFO_SETS};
+        std::vector<std::array<T, Game::ACTION_MAX_DIM>> average(Game::NUM_INFO_SETS);
+        for(int shard = 0; shard < map.num_shards; shard++) {
+            int fd = connect_to(shard_addresses[shard]);
+            MessageHeader header{GET_AVERAGE, 0};
+            AverageRequest request{map.begin(shard), map.end(shard)};
+            send_all(fd, &header, sizeof(header));
+            send_all(fd, &request, sizeof(request));
+            recv_reply_header(fd);
+            recv_all(fd, average.data() + map.begin(shard), (map.end(shard) - map.begin(shard)) * sizeof(average[0]));
+            close(fd);
+        }
+        return average;
+    }
+
+    inline ShardStats fetch_stats(const std::string &shard_address) {
+        int fd = connect_to(shard_address);
+        MessageHeader header{GET_STATS, 0};
+        ShardStats stats;
+        send_all(fd, &header, sizeof(header));
+        recv_reply_header(fd);
+        recv_all(fd, &stats, sizeof(stats));
+        close(fd);
+        return stats;
+    }
+} // namespace distributed
+
+#endif
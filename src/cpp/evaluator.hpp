@@ -1,8 +1,20 @@
 #ifndef EVALUATOR_HPP
 #define EVALUATOR_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "parallel.hpp"
 #include "pttt.hpp"
 #include "strategy.hpp"
+#include "tree_cache.hpp"
 
 namespace eval {
     template<typename Game>
@@ -192,137 +204,970 @@ namespace eval {
         }
     };
 
-    // hopefully fast
     template<typename Game>
-    class Treeplex {
-        enum NodeType {
-            DECISION, OBSERVATION
-        };
+    class EvalIncremental;
+
+    // same results as Eval, but the tree is built once into flat arrays (no Game copies, no per node vectors) and
+    // best_response / eval_for are loops over node indices instead of recursions over History objects.
+    // the children of a node are contiguous and every node has a larger index than its parent, so a forward loop
+    // is top down and a backward loop is bottom up.
+    // a best response has to pick the action of an infoset from all of its histories at once, which can be at
+    // different depths of the tree (e.g. PTTT retries after a failed move). the nodes are therefore also ordered by
+    // the number of own decisions of the responding player above them: all nodes below the decisions of a level are
+    // valued before the infosets of that level are decided
+    template<typename Game>
+    class EvalFlat {
+        friend class EvalIncremental<Game>;
+
         using T = double;
-        using Strategy = typename strategy::Strategy<Game>;
+        using Strategy = strategy::Strategy<Game>;
+        using Player = typename Game::Player;
 
-        struct Node {
-            std::map<int, Node*> children;
-            NodeType type;
-            int info_set_idx;
-            int num_actions;
-            std::array<int, Game::ACTION_MAX_DIM> actions;
+        enum Kind: uint8_t {TERMINAL, CHANCE, DECISION};
+        static_assert(Game::ACTION_MAX_DIM <= 255, "actions are stored in a byte");
 
-            double value;
+        // one entry per node
+        tree_cache::Array<uint8_t> kind;
+        tree_cache::Array<uint8_t> player; // index in Game::players, decision nodes only
+        tree_cache::Array<uint8_t> num_children;
+        tree_cache::Array<uint8_t> action; // action (strategy column) that leads from the parent to the node
+        tree_cache::Array<int32_t> infoset; // -1 if not a decision node
+        tree_cache::Array<uint32_t> first_child; // terminals: index in utilities instead
+        tree_cache::Array<T> chance_prob; // probability of the node given its parent if the parent is a chance node, else 1
+        tree_cache::Array<T> utilities; // NUM_PLAYERS per terminal
 
-            Node* get_or_create_child(int idx) {
-                if(children.find(idx) == children.end()) {
-                    children[idx] = new Node();
+        // histories of every infoset
+        tree_cache::Array<uint32_t> infoset_begin; // size NUM_INFO_SETS + 1
+        tree_cache::Array<uint32_t> infoset_nodes;
+
+        // per responding player: nodes by decreasing level then decreasing index, where the levels start, and the
+        // infosets of the player per level (level l is level_infosets[level_infosets_begin[l]..level_infosets_begin[l + 1]])
+        tree_cache::Array<uint32_t> level_order[Game::NUM_PLAYERS];
+        tree_cache::Array<uint64_t> level_begin[Game::NUM_PLAYERS];
+        tree_cache::Array<uint64_t> level_infosets_begin[Game::NUM_PLAYERS];
+        tree_cache::Array<int32_t> level_infosets[Game::NUM_PLAYERS];
+
+        std::vector<T> reach, value; // scratch
+
+        static constexpr uint32_t CACHE_SECTIONS = 10 + 4 * Game::NUM_PLAYERS;
+
+        static int player_index(Player p) {
+            for(int i = 0; i < Game::NUM_PLAYERS; i++) {
+                if(Game::players[i] == p)
+                    return i;
+            }
+            assert(false);
+            return -1;
+        }
+
+        void build() {
+            std::vector<uint8_t> kind, player, num_children, action;
+            std::vector<int32_t> infoset;
+            std::vector<uint32_t> first_child;
+            std::vector<T> chance_prob, utilities;
+            struct Pending {
+                Game state;
+                uint32_t node;
+            };
+            std::vector<Pending> stack;
+            auto add_node = [&](int action_, T prob) {
+                if(kind.size() >= std::numeric_limits<uint32_t>::max())
+                    throw std::runtime_error("game tree too large for EvalFlat");
+                kind.push_back(TERMINAL);
+                player.push_back(0);
+                num_children.push_back(0);
+                action.push_back(uint8_t(action_));
+                infoset.push_back(-1);
+                first_child.push_back(0);
+                chance_prob.push_back(prob);
+            };
+            add_node(0, 1);
+            stack.push_back({Game(), 0});
+            while(!stack.empty()) {
+                Pending pending = std::move(stack.back());
+                stack.pop_back();
+                const Game &state = pending.state;
+                uint32_t node = pending.node;
+                if(state.is_terminal()) {
+                    first_child[node] = utilities.size() / Game::NUM_PLAYERS;
+                    for(auto p: Game::players) {
+                        utilities.push_back(state.utility(p));
+                    }
+                    continue;
+                }
+                int n = state.num_actions();
+                std::array<int, Game::ACTION_MAX_DIM> actions;
+                std::array<T, Game::ACTION_MAX_DIM> probs;
+                state.actions(actions);
+                if(state.is_chance()) {
+                    kind[node] = CHANCE;
+                    state.action_probs(probs);
+                } else {
+                    kind[node] = DECISION;
+                    player[node] = player_index(state.current_player());
+                    infoset[node] = state.info_set_idx();
+                    probs.fill(1);
+                }
+                num_children[node] = n;
+                first_child[node] = kind.size();
+                for(int i = 0; i < n; i++) {
+                    add_node(actions[i], probs[i]);
+                }
+                for(int i = n - 1; i >= 0; i--) {
+                    Game child = state;
+                    child.step(actions[i]);
+                    stack.push_back({std::move(child), uint32_t(first_child[node] + i)});
+                }
+            }
+            size_t num_nodes = kind.size();
+
+            std::vector<uint32_t> infoset_begin(Game::NUM_INFO_SETS + 1, 0);
+            for(size_t i = 0; i < num_nodes; i++) {
+                if(kind[i] == DECISION)
+                    infoset_begin[infoset[i] + 1]++;
+            }
+            for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
+                infoset_begin[i + 1] += infoset_begin[i];
+            }
+            std::vector<uint32_t> infoset_nodes(infoset_begin.back());
+            std::vector<uint32_t> fill(infoset_begin.begin(), infoset_begin.end() - 1);
+            for(size_t i = 0; i < num_nodes; i++) {
+                if(kind[i] == DECISION)
+                    infoset_nodes[fill[infoset[i]]++] = i;
+            }
+
+            std::vector<uint8_t> level(num_nodes);
+            for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                level[0] = 0;
+                int max_level = 0;
+                for(size_t i = 0; i < num_nodes; i++) {
+                    if(kind[i] == TERMINAL)
+                        continue;
+                    uint8_t child_level = level[i] + (kind[i] == DECISION && player[i] == p);
+                    max_level = std::max<int>(max_level, child_level);
+                    for(uint32_t c = first_child[i]; c < first_child[i] + num_children[i]; c++) {
+                        level[c] = child_level;
+                    }
+                }
+                // counting sort by decreasing level, decreasing index inside a level
+                std::vector<size_t> count(max_level + 2, 0);
+                for(size_t i = 0; i < num_nodes; i++) {
+                    count[max_level - level[i] + 1]++;
+                }
+                for(int l = 0; l <= max_level; l++) {
+                    count[l + 1] += count[l];
+                }
+                level_begin[p] = std::vector<uint64_t>(count.begin(), count.end());
+                std::vector<uint32_t> order(num_nodes);
+                for(size_t i = num_nodes; i-- > 0; ) {
+                    order[count[max_level - level[i]]++] = i;
+                }
+                level_order[p] = std::move(order);
+
+                // the same counting sort for the infosets of p, by index inside a level
+                std::vector<uint64_t> infosets_begin(max_level + 2, 0);
+                for(int pass = 0; pass < 2; pass++) {
+                    std::vector<int32_t> infosets(pass ? infosets_begin.back() : 0);
+                    std::vector<uint64_t> fill_level(infosets_begin.begin(), infosets_begin.end() - 1);
+                    for(int idx = 0; idx < Game::NUM_INFO_SETS; idx++) {
+                        if(infoset_begin[idx] == infoset_begin[idx + 1])
+                            continue;
+                        uint32_t node = infoset_nodes[infoset_begin[idx]];
+                        if(player[node] != p)
+                            continue;
+                        int l = max_level - level[node];
+                        if(pass)
+                            infosets[fill_level[l]++] = idx;
+                        else
+                            infosets_begin[l + 1]++;
+                    }
+                    if(pass) {
+                        level_infosets[p] = std::move(infosets);
+                    } else {
+                        for(int l = 0; l <= max_level; l++) {
+                            infosets_begin[l + 1] += infosets_begin[l];
+                        }
+                    }
+                }
+                level_infosets_begin[p] = std::move(infosets_begin);
+            }
+
+            this->kind = std::move(kind);
+            this->player = std::move(player);
+            this->num_children = std::move(num_children);
+            this->action = std::move(action);
+            this->infoset = std::move(infoset);
+            this->first_child = std::move(first_child);
+            this->chance_prob = std::move(chance_prob);
+            this->utilities = std::move(utilities);
+            this->infoset_begin = std::move(infoset_begin);
+            this->infoset_nodes = std::move(infoset_nodes);
+        }
+
+        bool load(const std::string &path, uint64_t key) {
+            tree_cache::Reader reader;
+            if(!reader.open(path, key, CACHE_SECTIONS))
+                return false;
+            kind = reader.next<uint8_t>();
+            player = reader.next<uint8_t>();
+            num_children = reader.next<uint8_t>();
+            action = reader.next<uint8_t>();
+            infoset = reader.next<int32_t>();
+            first_child = reader.next<uint32_t>();
+            chance_prob = reader.next<T>();
+            utilities = reader.next<T>();
+            infoset_begin = reader.next<uint32_t>();
+            infoset_nodes = reader.next<uint32_t>();
+            for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                level_order[p] = reader.next<uint32_t>();
+                level_begin[p] = reader.next<uint64_t>();
+                level_infosets_begin[p] = reader.next<uint64_t>();
+                level_infosets[p] = reader.next<int32_t>();
+            }
+            return !reader.stale() && infoset_begin.size() == size_t(Game::NUM_INFO_SETS) + 1;
+        }
+
+        void save(const std::string &path, uint64_t key) const {
+            tree_cache::Writer writer;
+            writer.add(kind);
+            writer.add(player);
+            writer.add(num_children);
+            writer.add(action);
+            writer.add(infoset);
+            writer.add(first_child);
+            writer.add(chance_prob);
+            writer.add(utilities);
+            writer.add(infoset_begin);
+            writer.add(infoset_nodes);
+            for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                writer.add(level_order[p]);
+                writer.add(level_begin[p]);
+                writer.add(level_infosets_begin[p]);
+                writer.add(level_infosets[p]);
+            }
+            writer.write(path, key);
+        }
+
+    public:
+        // with a cache_path the tree is mapped from that file if it was written with the same key, and built and
+        // written to it otherwise (key: e.g. the infoset layout of the game)
+        EvalFlat(const std::string &cache_path = "", uint64_t key = 0) {
+            if(cache_path.empty() || !load(cache_path, key)) {
+                build();
+                if(!cache_path.empty())
+                    save(cache_path, key);
+            }
+            reach.resize(num_nodes());
+            value.resize(num_nodes());
+        }
+
+        size_t num_nodes() const {
+            return kind.size();
+        }
+
+        size_t memory_bytes() const {
+            size_t bytes = kind.size() * (4 * sizeof(uint8_t) + sizeof(int32_t) + sizeof(uint32_t) + sizeof(T))
+                           + utilities.size() * sizeof(T) + (infoset_begin.size() + infoset_nodes.size()) * sizeof(uint32_t)
+                           + (reach.size() + value.size()) * sizeof(T);
+            for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                bytes += level_order[p].size() * sizeof(uint32_t) + level_infosets[p].size() * sizeof(int32_t);
+            }
+            return bytes;
+        }
+
+        template<typename S>
+        Strategy best_response(const S &strategy, Player br_player) {
+            Strategy result(strategy::to_table<Game>(strategy));
+            int p = player_index(br_player);
+            size_t n = num_nodes();
+
+            // top down: probability of the chance and opponent actions on the path
+            reach[0] = 1;
+            for(size_t i = 0; i < n; i++) {
+                if(kind[i] == DECISION && player[i] != p) {
+                    const auto &row = strategy.row(infoset[i]);
+                    for(uint32_t c = first_child[i]; c < first_child[i] + num_children[i]; c++) {
+                        reach[c] = reach[i] * row[action[c]];
+                    }
+                    continue;
+                }
+                for(uint32_t c = first_child[i]; kind[i] != TERMINAL && c < first_child[i] + num_children[i]; c++) {
+                    T prob = kind[i] == CHANCE ? chance_prob[c] : 1;
+                    reach[c] = reach[i] * prob;
                 }
-                return children[idx];
             }
-        };
 
+            // bottom up, one level of own decisions at a time
+            const auto &order = level_order[p];
+            for(size_t l = 0; l + 1 < level_begin[p].size(); l++) {
+                for(uint64_t k = level_infosets_begin[p][l]; k < level_infosets_begin[p][l + 1]; k++) {
+                    int32_t idx = level_infosets[p][k];
+                    uint32_t first = infoset_nodes[infoset_begin[idx]];
+                    int actions = num_children[first];
+                    std::array<T, Game::ACTION_MAX_DIM> vals;
+                    vals.fill(0);
+                    for(uint32_t h = infoset_begin[idx]; h < infoset_begin[idx + 1]; h++) {
+                        uint32_t node = infoset_nodes[h];
+                        for(int a = 0; a < actions; a++) {
+                            vals[a] += value[first_child[node] + a];
+                        }
+                    }
+                    int best = 0;
+                    for(int a = 0; a < actions; a++) {
+                        if(vals[a] > vals[best])
+                            best = a;
+                    }
+                    for(int a = 0; a < actions; a++) {
+                        result.strat[idx][action[first_child[first] + a]] = a == best ? 1 : 0;
+                    }
+                }
+                for(size_t k = level_begin[p][l]; k < level_begin[p][l + 1]; k++) {
+                    uint32_t i = order[k];
+                    if(kind[i] == TERMINAL) {
+                        value[i] = utilities[first_child[i] * Game::NUM_PLAYERS + p] * reach[i];
+                    } else if(kind[i] == DECISION && player[i] == p) {
+                        T v = 0;
+                        for(int a = 0; a < num_children[i]; a++) { // the best response is pure
+                            v += result.strat[infoset[i]][action[first_child[i] + a]] * value[first_child[i] + a];
+                        }
+                        value[i] = v;
+                    } else {
+                        T v = 0;
+                        for(uint32_t c = first_child[i]; c < first_child[i] + num_children[i]; c++) {
+                            v += value[c];
+                        }
+                        value[i] = v;
+                    }
+                }
+            }
+            return result;
+        }
+
+        template<typename S>
+        T eval_for(const S &strategy, Player eval_player) {
+            int p = player_index(eval_player);
+            for(size_t i = num_nodes(); i-- > 0; ) {
+                if(kind[i] == TERMINAL) {
+                    value[i] = utilities[first_child[i] * Game::NUM_PLAYERS + p];
+                    continue;
+                }
+                T v = 0;
+                if(kind[i] == CHANCE) {
+                    for(uint32_t c = first_child[i]; c < first_child[i] + num_children[i]; c++) {
+                        v += chance_prob[c] * value[c];
+                    }
+                } else {
+                    const auto &row = strategy.row(infoset[i]);
+                    for(uint32_t c = first_child[i]; c < first_child[i] + num_children[i]; c++) {
+                        v += row[action[c]] * value[c];
+                    }
+                }
+                value[i] = v;
+            }
+            return value[0];
+        }
+
+        template<typename S>
+        T nash_gap(const S &strategy) {
+            // only for two player games...
+            assert(Game::NUM_PLAYERS == 2);
+            auto p1 = Game::players[0];
+            auto p2 = Game::players[1];
+            Strategy strategy_p1 = best_response(strategy, p1);
+            Strategy strategy_p2 = best_response(strategy, p2);
+            return eval_for(strategy_p1, p1) - eval_for(strategy_p2, p1);
+        }
+    };
+
+    // nash gap for a strategy that changes a little between calls (a few sampled trajectories per MCCFR iteration).
+    // keeps, per responding player, the chance and opponent reach of every node of an EvalFlat tree and the sum of
+    // reach * utility of the terminals that end in each of the player's sequences. a call compares the rows with the
+    // ones of the previous call and only redoes the subtrees below the histories of the changed opponent infosets
+    // and the sequences they end in. the best response itself is then a pass over the sequences, which is a lot
+    // smaller than the tree. recomputed values use the same operations in the same order as the first (full) call,
+    // so there is no drift: the result is exactly the one a fresh evaluator would give.
+    // needs perfect recall (the sequence of a player is the same in all histories of an infoset)
+    template<typename Game>
+    class EvalIncremental {
+        using T = double;
+        using Strategy = strategy::Strategy<Game>;
+        using Strat = typename Strategy::Strat;
         using Player = typename Game::Player;
+        using Tree = EvalFlat<Game>;
 
-        Node root;
-        Player player;
+        Tree tree;
+        std::vector<uint32_t> range_end; // descendants of a node are [first_child, range_end)
+        std::vector<uint8_t> owner; // per infoset, index of the player
+
+        struct Responder {
+            std::vector<int32_t> decision_infosets; // decision points in the order of their first history
+            std::vector<int32_t> first_sequence; // per infoset, -1 if not the responder's
+            std::vector<int32_t> parent_sequence; // per infoset
+            std::vector<uint8_t> sequence_action; // per sequence
+            std::vector<uint32_t> terminals_begin; // per sequence + 1
+            std::vector<uint32_t> terminals; // terminal nodes by sequence, in index order
+            std::vector<int32_t> sequence_of; // per node
+
+            std::vector<T> reach; // per node, chance * opponent reach (cached)
+            std::vector<T> terminal_value; // per sequence (cached)
+            std::vector<T> value; // per sequence, scratch of the best response
+            std::vector<uint8_t> dirty; // per sequence
+            std::vector<int32_t> dirty_sequences;
+            std::vector<uint32_t> dirty_nodes; // histories of the changed opponent infosets
+        };
+        Responder responders[Game::NUM_PLAYERS];
+
+        Strat rows; // of the last call
+        bool initialized = false;
+        std::vector<uint32_t> visited; // per node, stamp of the last call that recomputed its children
+        uint32_t stamp = 0;
+        size_t recomputed_nodes = 0;
+
+        T edge_prob(const Strat &strat, int p, uint32_t i, uint32_t c) const {
+            if(tree.kind[i] == Tree::CHANCE)
+                return tree.chance_prob[c];
+            return tree.player[i] == p ? T(1) : strat[tree.infoset[i]][tree.action[c]];
+        }
+
+        T terminal_utility(int p, uint32_t node) const {
+            return tree.utilities[tree.first_child[node] * Game::NUM_PLAYERS + p];
+        }
+
+        void build_responder(int p) {
+            Responder &r = responders[p];
+            size_t n = tree.num_nodes();
+            r.first_sequence.assign(Game::NUM_INFO_SETS, -1);
+            r.parent_sequence.assign(Game::NUM_INFO_SETS, -1);
+            r.sequence_action.assign(1, 0);
+            r.sequence_of.assign(n, 0);
+            for(uint32_t i = 0; i < n; i++) {
+                if(tree.kind[i] == Tree::TERMINAL)
+                    continue;
+                int32_t first = -1;
+                if(tree.kind[i] == Tree::DECISION && tree.player[i] == p) {
+                    int32_t idx = tree.infoset[i];
+                    if(r.first_sequence[idx] == -1) {
+                        r.first_sequence[idx] = r.sequence_action.size();
+                        r.parent_sequence[idx] = r.sequence_of[i];
+                        r.decision_infosets.push_back(idx);
+                        for(int a = 0; a < tree.num_children[i]; a++) {
+                            r.sequence_action.push_back(tree.action[tree.first_child[i] + a]);
+                        }
+                    } else if(r.parent_sequence[idx] != r.sequence_of[i]) {
+                        throw std::runtime_error("EvalIncremental needs a game with perfect recall");
+                    }
+                    first = r.first_sequence[idx];
+                }
+                for(int a = 0; a < tree.num_children[i]; a++) {
+                    r.sequence_of[tree.first_child[i] + a] = first == -1 ? r.sequence_of[i] : first + a;
+                }
+            }
+
+            size_t num_sequences = r.sequence_action.size();
+            r.terminals_begin.assign(num_sequences + 1, 0);
+            for(uint32_t i = 0; i < n; i++) {
+                if(tree.kind[i] == Tree::TERMINAL)
+                    r.terminals_begin[r.sequence_of[i] + 1]++;
+            }
+            for(size_t s = 0; s < num_sequences; s++) {
+                r.terminals_begin[s + 1] += r.terminals_begin[s];
+            }
+            r.terminals.resize(r.terminals_begin.back());
+            std::vector<uint32_t> fill(r.terminals_begin.begin(), r.terminals_begin.end() - 1);
+            for(uint32_t i = 0; i < n; i++) {
+                if(tree.kind[i] == Tree::TERMINAL)
+                    r.terminals[fill[r.sequence_of[i]]++] = i;
+            }
+
+            r.reach.assign(n, 0);
+            r.terminal_value.assign(num_sequences, 0);
+            r.value.assign(num_sequences, 0);
+            r.dirty.assign(num_sequences, 0);
+        }
+
+        void sum_sequence(Responder &r, int p, int32_t s) {
+            T v = 0;
+            for(uint32_t k = r.terminals_begin[s]; k < r.terminals_begin[s + 1]; k++) {
+                v += r.reach[r.terminals[k]] * terminal_utility(p, r.terminals[k]);
+            }
+            r.terminal_value[s] = v;
+        }
+
+        void full_update(const Strat &strat) {
+            for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                Responder &r = responders[p];
+                r.reach[0] = 1;
+                for(uint32_t i = 0; i < tree.num_nodes(); i++) {
+                    for(uint32_t c = tree.first_child[i]; tree.kind[i] != Tree::TERMINAL && c < tree.first_child[i] + tree.num_children[i]; c++) {
+                        r.reach[c] = r.reach[i] * edge_prob(strat, p, i, c);
+                    }
+                }
+                for(int32_t s = 0; s < int32_t(r.terminal_value.size()); s++) {
+                    sum_sequence(r, p, s);
+                }
+            }
+            recomputed_nodes = Game::NUM_PLAYERS * tree.num_nodes();
+        }
+
+        void incremental_update(const Strat &strat) {
+            for(int idx = 0; idx < Game::NUM_INFO_SETS; idx++) {
+                if(strat[idx] == rows[idx] || owner[idx] == uint8_t(-1))
+                    continue;
+                for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                    if(p == owner[idx])
+                        continue; // the own rows do not change the reach of a best response
+                    for(uint32_t h = tree.infoset_begin[idx]; h < tree.infoset_begin[idx + 1]; h++) {
+                        responders[p].dirty_nodes.push_back(tree.infoset_nodes[h]);
+                    }
+                }
+            }
+            recomputed_nodes = 0;
+            for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                Responder &r = responders[p];
+                std::sort(r.dirty_nodes.begin(), r.dirty_nodes.end());
+                stamp++;
+                // top down over the subtree of every changed history, once for nested ones
+                for(uint32_t h: r.dirty_nodes) {
+                    if(visited[h] == stamp)
+                        continue;
+                    visited[h] = stamp;
+                    for(uint32_t i = h; i < range_end[h]; i = i == h ? tree.first_child[h] : i + 1) {
+                        visited[i] = stamp;
+                        recomputed_nodes++;
+                        if(tree.kind[i] == Tree::TERMINAL) {
+                            int32_t s = r.sequence_of[i];
+                            if(!r.dirty[s]) {
+                                r.dirty[s] = 1;
+                                r.dirty_sequences.push_back(s);
+                            }
+                            continue;
+                        }
+                        for(uint32_t c = tree.first_child[i]; c < tree.first_child[i] + tree.num_children[i]; c++) {
+                            r.reach[c] = r.reach[i] * edge_prob(strat, p, i, c);
+                        }
+                    }
+                }
+                for(int32_t s: r.dirty_sequences) {
+                    sum_sequence(r, p, s);
+                    r.dirty[s] = 0;
+                }
+                r.dirty_sequences.clear();
+                r.dirty_nodes.clear();
+            }
+        }
+
+        void update(const Strat &strat) {
+            assert(strat.size() == Game::NUM_INFO_SETS);
+            if(!initialized) {
+                full_update(strat);
+                rows = strat;
+                initialized = true;
+                return;
+            }
+            incremental_update(strat);
+            for(int idx = 0; idx < Game::NUM_INFO_SETS; idx++) {
+                rows[idx] = strat[idx];
+            }
+        }
+
+        // bottom up over the decision points of p (the first one on ties), writes the chosen actions to best if given
+        T best_response_value(int p, Strat *best) {
+            Responder &r = responders[p];
+            std::copy(r.terminal_value.begin(), r.terminal_value.end(), r.value.begin());
+            for(size_t k = r.decision_infosets.size(); k-- > 0; ) {
+                int32_t idx = r.decision_infosets[k];
+                int32_t first = r.first_sequence[idx];
+                int actions = tree.num_children[tree.infoset_nodes[tree.infoset_begin[idx]]];
+                int best_action = 0;
+                for(int a = 1; a < actions; a++) {
+                    if(r.value[first + best_action] < r.value[first + a])
+                        best_action = a;
+                }
+                r.value[r.parent_sequence[idx]] += r.value[first + best_action];
+                if(best) {
+                    auto &row = (*best)[idx];
+                    row.fill(0);
+                    row[r.sequence_action[first + best_action]] = 1;
+                }
+            }
+            return r.value[0];
+        }
 
     public:
-        Treeplex(Player player): player(player) {}
+        EvalIncremental() {
+            size_t n = tree.num_nodes();
+            range_end.resize(n);
+            for(size_t i = n; i-- > 0; ) {
+                // the children are built together and then their subtrees one after the other (depth first)
+                range_end[i] = i + 1;
+                for(uint32_t c = tree.first_child[i]; tree.kind[i] != Tree::TERMINAL && c < tree.first_child[i] + tree.num_children[i]; c++) {
+                    range_end[i] = std::max(range_end[i], range_end[c]);
+                }
+            }
+            owner.assign(Game::NUM_INFO_SETS, uint8_t(-1));
+            for(size_t i = 0; i < n; i++) {
+                if(tree.kind[i] == Tree::DECISION)
+                    owner[tree.infoset[i]] = tree.player[i];
+            }
+            for(int p = 0; p < Game::NUM_PLAYERS; p++) {
+                build_responder(p);
+            }
+            visited.assign(n, 0);
+        }
+
+        T nash_gap(const Strat &strat) {
+            // only for two player zero sum games: the two best response values add up to the gap
+            assert(Game::NUM_PLAYERS == 2);
+            update(strat);
+            return best_response_value(0, nullptr) + best_response_value(1, nullptr);
+        }
+
+        T nash_gap(const Strategy &strategy) {
+            return nash_gap(strategy.strat);
+        }
 
-        void update_from_root(const Strategy &strategy) {
-            reset(root);
-            update(Game(), root, strategy, 1.0);
+        Strategy best_response(const Strategy &strategy, Player br_player) {
+            update(strategy.strat);
+            Strategy result(strategy.strat);
+            best_response_value(Tree::player_index(br_player), &result.strat);
+            return result;
         }
 
-        void reset(Node &node) {
-            node.value = 0;
-            node.info_set_idx = -1;
-            for(auto [_, child]: node.children) {
-                reset(*child);
+        // nodes visited by the last call (all of them on the first one)
+        size_t last_recomputed_nodes() const {
+            return recomputed_nodes;
+        }
+
+        size_t num_nodes() const {
+            return tree.num_nodes();
+        }
+    };
+
+    // sequence form view of the game for one player, compiled into flat arrays by a first (single threaded) walk.
+    // sequences are indexed from 0 (the empty sequence). a decision point is an infoset of the player, its actions
+    // lead to the contiguous sequences first_sequence[d] .. first_sequence[d] + num_actions[d] - 1 and it sits below
+    // the sequence parent_sequence[d]. decision points are numbered in the order the walk finds them, so the decision
+    // points below a sequence have larger indices than the one it belongs to and a backward loop is bottom up.
+    // every call still walks the game tree for the reach of chance and of the opponent (the tree of PTTT does not fit
+    // in memory, EvalFlat stores it for the games where it does). the sequence form side of the walk only adds terminal
+    // values to its sequence, the treeplex itself needs no maps or allocations once compiled. stepping the game does
+    // not get cheaper though: a PTTT child copies the two infoset strings (on the heap after a few moves) and
+    // info_set_idx() is a map lookup, that part of a call is unchanged.
+    //
+    // the walk is split over threads: the first plies are expanded into many subtrees that the threads take one at a
+    // time. the terminal values are summed as 64 bit fixed point numbers (scaled to the largest utility of the game),
+    // integer sums do not depend on the order so the result is the same for any number of threads.
+    //
+    // the compiled arrays can be kept in a file (tree_cache), later runs and other processes map it instead of
+    // walking the tree once more
+    template<typename Game>
+    class Treeplex {
+        using T = double;
+        using Strategy = typename strategy::Strategy<Game>;
+        using Player = typename Game::Player;
+        using Actions = std::array<int, Game::ACTION_MAX_DIM>;
+
+        static constexpr int SPLIT_PLIES = 8; // at most, stops earlier once there are enough subtrees
+        static constexpr size_t SUBTREES_PER_THREAD = 32;
+        static constexpr uint32_t CACHE_SECTIONS = 7;
+
+        Player player;
+        bool compiled = false;
+        T scale = 1; // fixed point units per utility unit
+        std::string cache_path; // of the compiled arrays, empty for none
+        uint64_t cache_key = 0;
+
+        // per decision point
+        tree_cache::Array<int32_t> infoset;
+        tree_cache::Array<int32_t> parent_sequence;
+        tree_cache::Array<int32_t> first_sequence;
+        tree_cache::Array<uint8_t> num_actions;
+
+        // per sequence
+        tree_cache::Array<uint8_t> action; // strategy column of the last action of the sequence
+        std::vector<std::atomic<int64_t>> fixed_value; // terminal values that end in the sequence, fixed point
+        std::vector<T> value; // utility of the player below the sequence, weighted by chance and opponent reach
+
+        tree_cache::Array<int32_t> decision_of_infoset; // -1 for infosets of other players
+
+        // the arrays above while the walk of compile fills them
+        struct Layout {
+            std::vector<int32_t> infoset, parent_sequence, first_sequence;
+            std::vector<uint8_t> num_actions, action;
+            std::vector<int32_t> decision_of_infoset;
+        };
+
+        struct Subtree {
+            Game state;
+            int32_t sequence;
+            T reach;
+        };
+
+        // sums consecutive terminal values of the same sequence before touching the shared counter
+        struct Accumulator {
+            std::vector<std::atomic<int64_t>> &fixed_value;
+            int32_t sequence = -1;
+            int64_t sum = 0;
+
+            void add(int32_t s, int64_t v) {
+                if(s != sequence) {
+                    flush();
+                    sequence = s;
+                }
+                sum += v;
+            }
+
+            void flush() {
+                if(sequence != -1 && sum != 0)
+                    fixed_value[sequence].fetch_add(sum, std::memory_order_relaxed);
+                sum = 0;
+            }
+        };
+
+        static int32_t add_decision_point(Layout &l, int info_set_idx, int32_t sequence, int n, const Actions &actions) {
+            int32_t &decision = l.decision_of_infoset[info_set_idx];
+            if(decision != -1) {
+                if(l.parent_sequence[decision] != sequence)
+                    throw std::runtime_error("Treeplex needs a game with perfect recall");
+                return decision;
             }
+            if(l.action.size() + n >= size_t(std::numeric_limits<int32_t>::max()))
+                throw std::runtime_error("too many sequences for Treeplex");
+            decision = l.infoset.size();
+            l.infoset.push_back(info_set_idx);
+            l.parent_sequence.push_back(sequence);
+            l.first_sequence.push_back(l.action.size());
+            l.num_actions.push_back(n);
+            for(int i = 0; i < n; i++) {
+                l.action.push_back(actions[i]);
+            }
+            return decision;
         }
 
-        void update(const Game& state, Node& node, const Strategy &strategy, double p_reach) {
+        // finds the decision points in the order of a depth first walk, and the largest utility
+        void compile_walk(Layout &l, const Game &state, int32_t sequence, T &max_utility) const {
             if(state.is_terminal()) {
-                node.type = OBSERVATION;
-                node.value += state.utility(player) * p_reach;
+                max_utility = std::max(max_utility, std::abs(T(state.utility(player))));
                 return;
             }
+            Actions actions;
+            state.actions(actions);
+            int n = state.num_actions();
+            int32_t first = -1; // sequences of the children if it is a decision of the player
+            if(!state.is_chance() && state.current_player() == player) {
+                first = l.first_sequence[add_decision_point(l, state.info_set_idx(), sequence, n, actions)];
+            }
+            for(int i = 0; i < n; i++) {
+                Game child = state;
+                child.step(actions[i]);
+                compile_walk(l, child, first == -1 ? sequence : first + i, max_utility);
+            }
+        }
 
-            std::array<double, Game::ACTION_MAX_DIM> probs;
-            std::array<int, Game::ACTION_MAX_DIM> actions;
+        int player_index() const {
+            for(int i = 0; i < Game::NUM_PLAYERS; i++) {
+                if(Game::players[i] == player)
+                    return i;
+            }
+            return 0;
+        }
+
+        // the player, the shape of the game and the scale, checked when a cache is mapped
+        tree_cache::Array<T> cache_meta() const {
+            return std::vector<T>{T(player_index()), T(Game::NUM_INFO_SETS), T(Game::ACTION_MAX_DIM), scale};
+        }
+
+        bool load() {
+            tree_cache::Reader reader;
+            if(!reader.open(cache_path, cache_key, CACHE_SECTIONS))
+                return false;
+            tree_cache::Array<T> meta = reader.next<T>();
+            if(reader.stale() || meta.size() != 4 || meta[0] != T(player_index()) || meta[1] != T(Game::NUM_INFO_SETS) || meta[2] != T(Game::ACTION_MAX_DIM))
+                return false;
+            scale = meta[3];
+            infoset = reader.next<int32_t>();
+            parent_sequence = reader.next<int32_t>();
+            first_sequence = reader.next<int32_t>();
+            num_actions = reader.next<uint8_t>();
+            action = reader.next<uint8_t>();
+            decision_of_infoset = reader.next<int32_t>();
+            return !reader.stale() && decision_of_infoset.size() == size_t(Game::NUM_INFO_SETS);
+        }
+
+        void save() const {
+            tree_cache::Array<T> meta = cache_meta();
+            tree_cache::Writer writer;
+            writer.add(meta);
+            writer.add(infoset);
+            writer.add(parent_sequence);
+            writer.add(first_sequence);
+            writer.add(num_actions);
+            writer.add(action);
+            writer.add(decision_of_infoset);
+            writer.write(cache_path, cache_key);
+        }
+
+        void compile() {
+            if(cache_path.empty() || !load()) {
+                Layout l;
+                l.decision_of_infoset.assign(Game::NUM_INFO_SETS, -1);
+                l.action.assign(1, 0);
+                T max_utility = 0;
+                compile_walk(l, Game(), 0, max_utility);
+                infoset = std::move(l.infoset);
+                parent_sequence = std::move(l.parent_sequence);
+                first_sequence = std::move(l.first_sequence);
+                num_actions = std::move(l.num_actions);
+                action = std::move(l.action);
+                decision_of_infoset = std::move(l.decision_of_infoset);
+                // the terminal values ending in one sequence have chance * opponent reach summing to at most 1, so a
+                // sequence stays below max_utility. 2^60 leaves room for rounding and strategies that sum a bit above 1
+                scale = max_utility > 0 ? std::ldexp(T(1), 60) / max_utility : T(1);
+                if(!cache_path.empty())
+                    save();
+            }
+            fixed_value = std::vector<std::atomic<int64_t>>(action.size());
+            value.assign(action.size(), 0);
+            compiled = true;
+        }
+
+
+        // calls visit(child, sequence of the child, reach of the child) for every child that can be reached
+        template<typename S, typename Visit>
+        void for_each_child(const Game &state, int32_t sequence, T p_reach, const S &strategy, Visit visit) const {
+            Actions actions;
             state.actions(actions);
-            int num_actions = state.num_actions();
-            int info_set_idx = state.info_set_idx();
+            int n = state.num_actions();
+            if(!state.is_chance() && state.current_player() == player) {
+                int32_t first = first_sequence[decision_of_infoset[state.info_set_idx()]];
+                for(int i = 0; i < n; i++) {
+                    Game child = state;
+                    child.step(actions[i]);
+                    visit(child, first + i, p_reach);
+                }
+                return;
+            }
+            std::array<T, Game::ACTION_MAX_DIM> probs;
             if(state.is_chance()) {
                 state.action_probs(probs);
             } else {
-                for(int i = 0; i < num_actions; i++) {
-                    probs[i] = strategy.strat[info_set_idx][actions[i]];
+                const auto &row = strategy.row(state.info_set_idx());
+                for(int i = 0; i < n; i++) {
+                    probs[i] = row[actions[i]];
                 }
             }
-            
-            if(state.is_chance() || state.current_player() != player) {
-                node.type = OBSERVATION;
+            for(int i = 0; i < n; i++) {
+                T p = p_reach * probs[i];
+                if(p == 0)
+                    continue; // adds nothing
+                Game child = state;
+                child.step(actions[i]);
+                visit(child, sequence, p);
+            }
+        }
 
-                for(int i = 0; i < num_actions; i++) {
-                    Game new_state = state;
-                    new_state.step(actions[i]);
-                    if(new_state.is_terminal() || new_state.is_chance() || new_state.current_player() != player) {
-                        update(new_state, node, strategy, p_reach * probs[i]);
-                    } else {
-                        update(new_state, *node.get_or_create_child(new_state.info_set_idx()), strategy, p_reach * probs[i]);
+        template<typename S>
+        void walk(const Game &state, int32_t sequence, T p_reach, const S &strategy, Accumulator &acc) const {
+            if(state.is_terminal()) {
+                acc.add(sequence, std::llround(state.utility(player) * p_reach * scale));
+                return;
+            }
+            for_each_child(state, sequence, p_reach, strategy, [&](const Game &child, int32_t s, T p) {
+                walk(child, s, p, strategy, acc);
+            });
+        }
+
+        template<typename S>
+        void update_from_root(const S &strategy, int num_threads) {
+            if(!compiled)
+                compile();
+            if(num_threads <= 0)
+                num_threads = parallel::default_num_threads();
+            for(auto &v: fixed_value) {
+                v.store(0, std::memory_order_relaxed);
+            }
+
+            // breadth first over the first plies until there are enough subtrees to balance the threads
+            Accumulator top{fixed_value};
+            std::vector<Subtree> subtrees{{Game(), 0, 1}};
+            size_t wanted = num_threads > 1 ? SUBTREES_PER_THREAD * num_threads : 1;
+            for(int ply = 0; ply < SPLIT_PLIES && subtrees.size() < wanted; ply++) {
+                std::vector<Subtree> next;
+                for(auto &subtree: subtrees) {
+                    if(subtree.state.is_terminal()) {
+                        walk(subtree.state, subtree.sequence, subtree.reach, strategy, top);
+                        continue;
                     }
+                    for_each_child(subtree.state, subtree.sequence, subtree.reach, strategy, [&](const Game &child, int32_t s, T p) {
+                        next.push_back({child, s, p});
+                    });
                 }
-            } else {
-                assert(state.current_player() == player);
+                subtrees.swap(next);
+            }
+            top.flush();
 
-                node.type = DECISION;
-                node.info_set_idx = state.info_set_idx();
-                node.num_actions = num_actions;
-                node.actions = actions;
-                // put some assert that the order of actions are the same: TODO :D                
-                for(int i = 0; i < num_actions; i++) {
-                    Game new_state = state;
-                    new_state.step(actions[i]);
-                    update(new_state, *node.get_or_create_child(i), strategy, p_reach);
+            std::atomic<size_t> next_subtree{0};
+            parallel::parallel_for(0, num_threads, [&](long long, long long) {
+                Accumulator acc{fixed_value};
+                for(size_t i; (i = next_subtree.fetch_add(1)) < subtrees.size();) {
+                    walk(subtrees[i].state, subtrees[i].sequence, subtrees[i].reach, strategy, acc);
                 }
-            }
-        }
+                acc.flush();
+            }, num_threads);
 
-        Strategy best_response(const Strategy &strategy) {
-            update_from_root(strategy);
-            Strategy new_strategy(strategy.strat);
-            best_response_rec(root, new_strategy);
-            return new_strategy;
+            for(size_t s = 0; s < value.size(); s++) {
+                value[s] = T(fixed_value[s].load(std::memory_order_relaxed)) / scale;
+            }
         }
 
-        void best_response_rec(Node& node, Strategy &strategy) {
-            if(node.type == OBSERVATION) {
-                for(auto [_, child]: node.children) {
-                    best_response_rec(*child, strategy);
-                    node.value += child->value;
-                }
-            } else {
-                int best_action = -1;
-                T prev_best = 0;
-                for(auto [action_idx, child]: node.children) {
-                    best_response_rec(*child, strategy);
-                    if(best_action == -1 || prev_best < (child->value)) {
-                        best_action = action_idx;
-                        prev_best = child->value;
-                    }
+        // bottom up over the decision points: each takes its best sequence (the first one on ties) and adds its value
+        // to the sequence it sits below. writes the chosen actions to best if given, returns the value of the root
+        T propagate(Strategy *best) {
+            for(int32_t d = int32_t(infoset.size()) - 1; d >= 0; d--) {
+                int32_t first = first_sequence[d];
+                int best_action = 0;
+                for(int i = 1; i < num_actions[d]; i++) {
+                    if(value[first + best_action] < value[first + i])
+                        best_action = i;
                 }
-                node.value = prev_best;
-                for(int i = 0; i < Game::ACTION_MAX_DIM; i++) {
-                    strategy.strat[node.info_set_idx][i] = 0;
-                }
-                for(int i = 0; i < node.num_actions; i++) {
-                    strategy.strat[node.info_set_idx][node.actions[i]] = (i == best_action);
+                value[parent_sequence[d]] += value[first + best_action];
+                if(best) {
+                    auto &row = best->strat[infoset[d]];
+                    row.fill(0);
+                    row[action[first + best_action]] = 1;
                 }
             }
+            return value[0];
+        }
+
+    public:
+        // with a cache_path the compiled arrays are mapped from that file if it was written with the same key, and
+        // compiled and written to it otherwise (at the first call)
+        Treeplex(Player player, std::string cache_path = "", uint64_t cache_key = 0):
+            player(player), cache_path(std::move(cache_path)), cache_key(cache_key) {}
+
+        // num_threads <= 0 uses all usable cpus
+        template<typename S>
+        Strategy best_response(const S &strategy, int num_threads = -1) {
+            update_from_root(strategy, num_threads);
+            Strategy new_strategy(strategy::to_table<Game>(strategy));
+            propagate(&new_strategy);
+            return new_strategy;
         }
 
-        T get_last_eval() {
-            return root.value;
+        // value of the best response without building it
+        template<typename S>
+        T best_response_value(const S &strategy, int num_threads = -1) {
+            update_from_root(strategy, num_threads);
+            return propagate(nullptr);
         }
+
+        T get_last_eval() const {
+            return value.empty() ? 0 : value[0];
+        }
+
+        size_t num_decision_points() const { return infoset.size(); }
+        size_t num_sequences() const { return value.size(); }
     };
 
     template<typename Game>
@@ -331,31 +1176,54 @@ namespace eval {
         using Strategy = typename strategy::Strategy<Game>;
         using T = double;
 
-        std::map<Player, Treeplex<Game>*> treeplexes;
+        std::vector<Treeplex<Game>> treeplexes; // in the order of Game::players
+        int num_threads;
+
+        Treeplex<Game>& treeplex(Player player) {
+            for(int i = 0; i < Game::NUM_PLAYERS; i++) {
+                if(Game::players[i] == player)
+                    return treeplexes[i];
+            }
+            assert(false);
+            return treeplexes[0];
+        }
+
+        int threads() const {
+            return num_threads > 0 ? num_threads : parallel::default_num_threads();
+        }
 
     public:
 
-        EvalFast() {
-            for(auto player: Game::players) {
-                treeplexes[player] = new Treeplex<Game>(player);
+        // num_threads <= 0 uses all cpus the calling thread may run on (at the time of each call).
+        // with a cache_prefix the treeplex of player i is cached in cache_prefix_p<i>.treeplex (see Treeplex)
+        EvalFast(int num_threads = -1, const std::string &cache_prefix = "", uint64_t cache_key = 0): num_threads(num_threads) {
+            for(int i = 0; i < Game::NUM_PLAYERS; i++) {
+                std::string path = cache_prefix.empty() ? "" : cache_prefix + "_p" + std::to_string(i) + ".treeplex";
+                treeplexes.emplace_back(Game::players[i], path, cache_key);
             }
         }
 
-        Strategy best_response(const Strategy &strategy, Player player) {
-            return treeplexes[player]->best_response(strategy);
+        template<typename S>
+        Strategy best_response(const S &strategy, Player player) {
+            return treeplex(player).best_response(strategy, threads());
         }
 
-        T nash_gap(const Strategy &strategy) {
+        // any strategy with row(idx), a strategy::View evaluates the tables it reads without copying them
+        template<typename S>
+        T nash_gap(const S &strategy) {
             // only for two player games...
             assert(Game::NUM_PLAYERS == 2);
-            auto p1 = Game::players[0];
-            auto p2 = Game::players[1];
-            Strategy strategy_p1 = best_response(strategy, p1);
-            Strategy strategy_p2 = best_response(strategy, p2);
-            return treeplexes[p1]->get_last_eval() + treeplexes[p2]->get_last_eval();
-            // return eval_for(strategy_p1, p1) - eval_for(strategy_p2, p1);
+            // both best responses at once, on half of the threads each
+            int per_player = std::max(1, threads() / 2);
+            T values[2];
+            parallel::parallel_for(0, 2, [&](long long lo, long long hi) {
+                for(long long p = lo; p < hi; p++) {
+                    values[p] = treeplexes[p].best_response_value(strategy, per_player);
+                }
+            }, 2);
+            return values[0] + values[1];
         }
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,58 +1,350 @@
 #ifndef IO_HPP
 #define IO_HPP
 
+// .npy files without going through an xtensor copy of the whole table.
+// writing streams straight from the caller's memory (contiguous rows are handed to fwrite as they are, anything else
+// goes through a small staging buffer), reading goes straight into the destination or maps the file.
+// format: https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html, we always write version 1.0
+// with a fixed 128 byte header so that the shape can be patched in after streaming
+
+#include <array>
 #include <vector>
 #include <string>
 #include <map>
 #include <fstream>
 #include <assert.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
-#include "xtensor/xarray.hpp"
-#include "xtensor-io/xnpz.hpp"
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace io {
+    constexpr size_t NPY_HEADER_BYTES = 128;
+    constexpr size_t NPY_CHUNK_BYTES = 64 << 20; // staging buffer for rows that are not contiguous
+
+    template<typename T>
+    static std::string npy_descr() {
+        static_assert(std::is_arithmetic<T>::value, "npy files hold plain numbers");
+        char kind = std::is_floating_point<T>::value ? 'f' : (std::is_same<T, bool>::value ? 'b' : (std::is_signed<T>::value ? 'i' : 'u'));
+        return std::string(sizeof(T) == 1 ? "|" : "<") + kind + std::to_string(sizeof(T));
+    }
+
+    // cols = -1 for 1 dim arrays
+    template<typename T>
+    static std::string npy_header(long long rows, long long cols) {
+        std::string shape = cols < 0 ? "(" + std::to_string(rows) + ",)" : "(" + std::to_string(rows) + ", " + std::to_string(cols) + ")";
+        std::string dict = "{'descr': '" + npy_descr<T>() + "', 'fortran_order': False, 'shape': " + shape + ", }";
+        std::string header = std::string("\x93NUMPY\x01\x00", 8);
+        header += char((NPY_HEADER_BYTES - 10) & 0xff);
+        header += char((NPY_HEADER_BYTES - 10) >> 8);
+        header += dict;
+        if(header.size() + 1 > NPY_HEADER_BYTES) {
+            throw std::runtime_error("npy header too long");
+        }
+        header += std::string(NPY_HEADER_BYTES - 1 - header.size(), ' ');
+        header += '\n';
+        return header;
+    }
+
+    struct NpyInfo {
+        std::string descr;
+        std::vector<long long> shape;
+        size_t data_offset;
+
+        long long rows() const { return shape.empty() ? 1 : shape[0]; }
+        long long cols() const { return shape.size() < 2 ? 1 : shape[1]; }
+        long long num_values() const { return rows() * cols(); }
+    };
+
+    // parses the header of an .npy file (any version) and leaves the file positioned at the data
+    inline NpyInfo read_npy_header(FILE *file, const std::string &filename) {
+        char prefix[10];
+        if(fread(prefix, 1, 10, file) != 10 || memcmp(prefix, "\x93NUMPY", 6) != 0) {
+            throw std::runtime_error(filename + " is not an npy file");
+        }
+        size_t header_len;
+        size_t prefix_len = 10;
+        if(prefix[6] == 1) {
+            header_len = uint8_t(prefix[8]) | (size_t(uint8_t(prefix[9])) << 8);
+        } else {
+            char extra[2];
+            if(fread(extra, 1, 2, file) != 2) {
+                throw std::runtime_error(filename + " has a truncated header");
+            }
+            header_len = uint8_t(prefix[8]) | (size_t(uint8_t(prefix[9])) << 8) | (size_t(uint8_t(extra[0])) << 16) | (size_t(uint8_t(extra[1])) << 24);
+            prefix_len = 12;
+        }
+        std::string dict(header_len, ' ');
+        if(fread(&dict[0], 1, header_len, file) != header_len) {
+            throw std::runtime_error(filename + " has a truncated header");
+        }
+
+        NpyInfo info;
+        info.data_offset = prefix_len + header_len;
+        size_t descr_pos = dict.find("'descr'");
+        size_t descr_start = dict.find('\'', dict.find(':', descr_pos)) + 1;
+        info.descr = dict.substr(descr_start, dict.find('\'', descr_start) - descr_start);
+        if(dict.find("'fortran_order': True") != std::string::npos) {
+            throw std::runtime_error(filename + " is in fortran order");
+        }
+        size_t shape_start = dict.find('(', dict.find("'shape'")) + 1;
+        std::string shape = dict.substr(shape_start, dict.find(')', shape_start) - shape_start);
+        size_t pos = 0;
+        while(pos < shape.size()) {
+            size_t next = shape.find(',', pos);
+            std::string dim = shape.substr(pos, next == std::string::npos ? std::string::npos : next - pos);
+            if(dim.find_first_of("0123456789") != std::string::npos)
+                info.shape.push_back(std::stoll(dim));
+            if(next == std::string::npos)
+                break;
+            pos = next + 1;
+        }
+        return info;
+    }
+
+    // streams a (rows x cols) or 1 dim array to disk. the row count does not have to be known up front,
+    // the header is rewritten with the final shape on close
+    template<typename T>
+    class NpyWriter {
+        FILE *file;
+        std::string filename;
+        long long cols;
+        size_t values_written = 0;
+
+    public:
+        // cols = -1 for a 1 dim array
+        NpyWriter(const std::string &filename, long long cols): filename(filename), cols(cols) {
+            file = fopen(filename.c_str(), "wb");
+            if(file == nullptr) {
+                throw std::runtime_error("could not create " + filename);
+            }
+            setvbuf(file, nullptr, _IONBF, 0); // we only hand it big chunks
+            std::string header = npy_header<T>(0, cols);
+            fwrite(header.data(), 1, header.size(), file);
+        }
+
+        NpyWriter(const NpyWriter &) = delete;
+        NpyWriter& operator=(const NpyWriter &) = delete;
+
+        // close() has to be called to get a valid file, this only cleans up after an exception
+        ~NpyWriter() {
+            if(file != nullptr)
+                fclose(file);
+        }
+
+        void write(const T *values, size_t count) {
+            if(fwrite(values, sizeof(T), count, file) != count) {
+                throw std::runtime_error("could not write " + filename);
+            }
+            values_written += count;
+        }
+
+        // rows of a strided view: row i starts at base + i * row_stride (in elements)
+        void write_strided(const T *base, size_t rows, size_t row_stride) {
+            assert(cols > 0);
+            if(row_stride == size_t(cols)) {
+                write(base, rows * cols);
+                return;
+            }
+            size_t chunk_rows = std::max<size_t>(1, NPY_CHUNK_BYTES / (sizeof(T) * cols));
+            std::vector<T> staging(std::min(rows, chunk_rows) * cols);
+            for(size_t lo = 0; lo < rows; lo += chunk_rows) {
+                size_t n = std::min(chunk_rows, rows - lo);
+                for(size_t i = 0; i < n; i++) {
+                    memcpy(staging.data() + i * cols, base + (lo + i) * row_stride, cols * sizeof(T));
+                }
+                write(staging.data(), n * cols);
+            }
+        }
+
+        void close() {
+            long long rows = cols < 0 ? values_written : values_written / cols;
+            assert(cols < 0 || values_written % cols == 0);
+            std::string header = npy_header<T>(rows, cols);
+            bool ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(header.data(), 1, header.size(), file) == header.size();
+            ok = fclose(file) == 0 && ok;
+            file = nullptr;
+            if(!ok) {
+                throw std::runtime_error("could not write " + filename);
+            }
+        }
+    };
+
+    // read only view of an .npy file mapped into memory, nothing is read before it is touched
+    template<typename T>
+    class MappedNpy {
+        void *mapping = nullptr;
+        size_t bytes = 0;
+        NpyInfo info;
+
+    public:
+        explicit MappedNpy(const std::string &filename) {
+            FILE *file = fopen(filename.c_str(), "rb");
+            if(file == nullptr) {
+                throw std::runtime_error("could not open " + filename);
+            }
+            info = read_npy_header(file, filename);
+            struct stat st;
+            fstat(fileno(file), &st);
+            bytes = st.st_size;
+            if(info.descr != npy_descr<T>()) {
+                fclose(file);
+                throw std::runtime_error(filename + " holds " + info.descr + ", expected " + npy_descr<T>());
+            }
+            if(info.data_offset + info.num_values() * sizeof(T) > bytes) {
+                fclose(file);
+                throw std::runtime_error(filename + " is truncated");
+            }
+            mapping = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            fclose(file);
+            if(mapping == MAP_FAILED) {
+                throw std::runtime_error("could not map " + filename);
+            }
+            madvise(mapping, bytes, MADV_SEQUENTIAL);
+        }
+
+        MappedNpy(const MappedNpy &) = delete;
+        MappedNpy& operator=(const MappedNpy &) = delete;
+
+        ~MappedNpy() {
+            munmap(mapping, bytes);
+        }
+
+        const T* data() const { return reinterpret_cast<const T*>(static_cast<const char*>(mapping) + info.data_offset); }
+        const T* row(long long i) const { return data() + i * info.cols(); }
+        long long rows() const { return info.rows(); }
+        long long cols() const { return info.cols(); }
+        const std::vector<long long>& shape() const { return info.shape; }
+    };
+
+    // reads a whole .npy file straight into dst, returns the header. expected_cols = -1 accepts any shape,
+    // max_values bounds what dst can take
+    template<typename T>
+    static NpyInfo read_npy_into(const std::string &filename, T *dst, size_t max_values, long long expected_cols = -1) {
+        FILE *file = fopen(filename.c_str(), "rb");
+        if(file == nullptr) {
+            throw std::runtime_error("could not open " + filename);
+        }
+        NpyInfo info = read_npy_header(file, filename);
+        if(info.descr != npy_descr<T>()) {
+            fclose(file);
+            throw std::runtime_error(filename + " holds " + info.descr + ", expected " + npy_descr<T>());
+        }
+        if(expected_cols != -1 && info.cols() != expected_cols) {
+            fclose(file);
+            throw std::runtime_error(filename + " has " + std::to_string(info.cols()) + " columns, expected " + std::to_string(expected_cols));
+        }
+        if(size_t(info.num_values()) > max_values) {
+            fclose(file);
+            throw std::runtime_error(filename + " does not fit in the destination");
+        }
+        setvbuf(file, nullptr, _IONBF, 0);
+        size_t count = info.num_values();
+        if(fread(dst, sizeof(T), count, file) != count) {
+            fclose(file);
+            throw std::runtime_error(filename + " is truncated");
+        }
+        fclose(file);
+        return info;
+    }
+
+    template<typename Iterator, typename Value>
+    using is_contiguous_iterator = std::integral_constant<bool,
+        std::is_same<Iterator, Value*>::value || std::is_same<Iterator, const Value*>::value
+        || std::is_same<Iterator, typename std::vector<Value>::iterator>::value
+        || std::is_same<Iterator, typename std::vector<Value>::const_iterator>::value>;
+
     // 1 dim case
     template <typename T, typename Iterator>
     static void save_to_numpy(const std::string &filename, Iterator itl, Iterator itr) {
         std::cout << "save " << filename << std::endl;
-        int N = itr - itl;
-        xt::xarray<T> arr = xt::zeros<T>({N});
-        for(int i = 0; i < N; i++) {
-            arr(i) = *(itl + i);
+        NpyWriter<T> writer(filename, -1);
+        if constexpr(is_contiguous_iterator<Iterator, T>::value) {
+            writer.write(&*itl, itr - itl);
+        } else {
+            std::vector<T> staging;
+            staging.reserve(std::min<size_t>(itr - itl, NPY_CHUNK_BYTES / sizeof(T)));
+            for(; itl != itr; ++itl) {
+                staging.push_back(T(*itl));
+                if(staging.size() == staging.capacity()) {
+                    writer.write(staging.data(), staging.size());
+                    staging.clear();
+                }
+            }
+            writer.write(staging.data(), staging.size());
         }
-        xt::dump_npy(filename, arr);
+        writer.close();
         std::cout << "done " << filename << std::endl;
     }
 
     template <typename T, int DIM, typename Iterator>
     static void save_to_numpy(const std::string &filename, Iterator itl, Iterator itr) {
         std::cout << "save " << filename << std::endl;
-        int N = itr - itl;
-        xt::xarray<T> arr = xt::zeros<T>({N, DIM});
-        for(int i = 0; i < N; i++) {
-            const auto& inner_arr = *(itl + i);
-            assert(DIM == inner_arr.size());
-            for (size_t j = 0; j < inner_arr.size(); ++j) {
-                arr(i, j) = inner_arr[j];
+        size_t N = itr - itl;
+        NpyWriter<T> writer(filename, DIM);
+        if constexpr(is_contiguous_iterator<Iterator, std::array<T, DIM>>::value) {
+            // std::array<T, DIM> has no padding, the rows are one (N x DIM) block
+            writer.write((*itl).data(), N * DIM);
+        } else {
+            size_t chunk_rows = std::max<size_t>(1, NPY_CHUNK_BYTES / (sizeof(T) * DIM));
+            std::vector<T> staging(std::min(N, chunk_rows) * DIM);
+            for(size_t lo = 0; lo < N; lo += chunk_rows) {
+                size_t n = std::min(chunk_rows, N - lo);
+                for(size_t i = 0; i < n; i++) {
+                    const auto& inner_arr = *(itl + lo + i);
+                    assert(DIM == inner_arr.size());
+                    std::copy(inner_arr.begin(), inner_arr.end(), staging.begin() + i * DIM);
+                }
+                writer.write(staging.data(), n * DIM);
             }
         }
-        xt::dump_npy(filename, arr);
+        writer.close();
         std::cout << "done " << filename << std::endl;
     }
 
+    // strided view: rows rows of DIM values, row i at base + i * row_stride
+    template <typename T>
+    static void save_to_numpy_strided(const std::string &filename, const T *base, size_t rows, size_t cols, size_t row_stride) {
+        NpyWriter<T> writer(filename, cols);
+        writer.write_strided(base, rows, row_stride);
+        writer.close();
+    }
+
+    // [itl, itr) receives the rows of the file, which has to have exactly that many
     template <typename T, int DIM, typename Iterator>
-    static void load_from_numpy(const std::string &filename, Iterator itl) {
+    static void load_from_numpy(const std::string &filename, Iterator itl, Iterator itr) {
         std::cout << "load " << filename << std::endl;
-        auto loaded_arr = xt::load_npy<T>(filename);
-        for(int i = 0; i < loaded_arr.shape()[0]; i++) {
-            auto& inner_arr = *(itl + i);
-            for(int j = 0; j < loaded_arr.shape()[1]; j++) {
-                inner_arr[j] = loaded_arr(i, j);
+        long long rows = itr - itl;
+        auto check_rows = [&filename, rows](long long file_rows) {
+            if(file_rows != rows) {
+                throw std::runtime_error(filename + " has " + std::to_string(file_rows) + " rows, expected " + std::to_string(rows));
+            }
+        };
+        if constexpr(is_contiguous_iterator<Iterator, std::array<T, DIM>>::value) {
+            NpyInfo info = read_npy_into<T>(filename, (*itl).data(), size_t(rows) * DIM, DIM);
+            check_rows(info.rows());
+        } else {
+            MappedNpy<T> loaded(filename);
+            if(loaded.cols() != DIM) {
+                throw std::runtime_error(filename + " has " + std::to_string(loaded.cols()) + " columns, expected " + std::to_string(DIM));
+            }
+            check_rows(loaded.rows());
+            for(long long i = 0; i < rows; i++) {
+                auto& inner_arr = *(itl + i);
+                std::copy(loaded.row(i), loaded.row(i) + DIM, inner_arr.begin());
             }
         }
         std::cout << "done " << filename << std::endl;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
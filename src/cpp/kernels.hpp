@@ -0,0 +1,121 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+// whole-table ops on the (rows x DIM) tables, split in contiguous chunks over all cores (parallel::parallel_for).
+// the per-row loops have a compile time trip count and no branches in the arithmetic, so the compiler can vectorize
+// them. the per-row arithmetic is the one of the scalar loops they replace (same operations in the same order), and
+// the reductions are summed per fixed size chunk and then in chunk order, so results do not depend on the number
+// of threads
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "parallel.hpp"
+
+namespace kernels {
+    using T = double;
+
+    constexpr T ZERO_SUM_EPS = 1e-9; // a row that sums to less is treated as all zero
+    constexpr size_t REDUCE_CHUNK = 1 << 16;
+
+    // one row of normalize, for the strategy views that normalize on access. valid_mask(idx) is only called for rows
+    // that sum to (almost) zero
+    template<size_t DIM, typename MaskFn>
+    static void normalize_row(const std::array<T, DIM> &in, std::array<T, DIM> &out, long long idx, MaskFn valid_mask) {
+        std::array<T, DIM> row = in;
+        T sum = 0;
+        for(size_t j = 0; j < DIM; j++) {
+            sum += row[j];
+        }
+        if(sum <= ZERO_SUM_EPS) {
+            uint32_t mask = valid_mask(idx);
+            sum = __builtin_popcount(mask);
+            for(size_t j = 0; j < DIM; j++) {
+                row[j] = (mask >> j) & 1 ? T(1) : T(0);
+            }
+        }
+        for(size_t j = 0; j < DIM; j++) {
+            out[j] = row[j] / sum;
+        }
+    }
+
+    // out[i] = in[i] / sum(in[i]), or uniform over the bits of valid_mask(i) if the row sums to (almost) zero
+    // (exactly 0 on the other actions). out can be in
+    template<size_t DIM, typename MaskFn>
+    static void normalize(const std::array<T, DIM> *in, std::array<T, DIM> *out, size_t rows, MaskFn valid_mask, int num_threads = -1) {
+        parallel::parallel_for(0, rows, [&](long long lo, long long hi) {
+            for(long long idx = lo; idx < hi; idx++) {
+                normalize_row(in[idx], out[idx], idx, valid_mask);
+            }
+        }, num_threads);
+    }
+
+    // the current policy of regret matching for every row (RegretMinimizer::next_policy): the positive part of the
+    // regrets normalized, uniform over the first num_actions(i) actions if no regret is positive
+    template<size_t DIM, typename DimFn>
+    static void regret_matching(const std::array<T, DIM> *regrets, std::array<T, DIM> *out, size_t rows, DimFn num_actions, int num_threads = -1) {
+        parallel::parallel_for(0, rows, [&](long long lo, long long hi) {
+            for(long long idx = lo; idx < hi; idx++) {
+                int dim = num_actions(idx);
+                std::array<T, DIM> row;
+                T sum = 0;
+                for(size_t j = 0; j < DIM; j++) {
+                    row[j] = int(j) < dim ? std::max(regrets[idx][j], T(0)) : T(0);
+                    sum += row[j];
+                }
+                if(sum <= ZERO_SUM_EPS) {
+                    for(size_t j = 0; j < DIM; j++) {
+                        row[j] = int(j) < dim ? T(1) : T(0);
+                    }
+                    sum = std::max(dim, 1); // rows never visited (dim 0) stay all zero
+                }
+                for(size_t j = 0; j < DIM; j++) {
+                    out[idx][j] = row[j] / sum;
+                }
+            }
+        }, num_threads);
+    }
+
+    // precision conversion, e.g. double tables to float for smaller checkpoints
+    template<typename Src, typename Dst>
+    static void convert(const Src *in, Dst *out, size_t n, int num_threads = -1) {
+        parallel::parallel_for(0, n, [&](long long lo, long long hi) {
+            for(long long i = lo; i < hi; i++) {
+                out[i] = Dst(in[i]);
+            }
+        }, num_threads);
+    }
+
+    // dst += weight * src, the building block of merges
+    inline void scale_add(T *dst, const T *src, size_t n, T weight, int num_threads = -1) {
+        parallel::parallel_for(0, n, [&](long long lo, long long hi) {
+            for(long long i = lo; i < hi; i++) {
+                dst[i] += weight * src[i];
+            }
+        }, num_threads);
+    }
+
+    inline T sum(const T *data, size_t n, int num_threads = -1) {
+        size_t num_chunks = (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+        std::vector<T> partial(num_chunks, 0);
+        parallel::parallel_for(0, num_chunks, [&](long long lo, long long hi) {
+            for(long long chunk = lo; chunk < hi; chunk++) {
+                size_t end = std::min(n, size_t(chunk + 1) * REDUCE_CHUNK);
+                T s = 0;
+                for(size_t i = size_t(chunk) * REDUCE_CHUNK; i < end; i++) {
+                    s += data[i];
+                }
+                partial[chunk] = s;
+            }
+        }, num_threads);
+        T total = 0;
+        for(T s: partial) {
+            total += s;
+        }
+        return total;
+    }
+} // namespace kernels
+
+#endif
@@ -9,6 +9,7 @@
 #include <iostream>
 #include <cassert>
 #include <map>
+#include "kernels.hpp"
 #include "paths.hpp"
 #include <array>
 
@@ -202,36 +203,18 @@ namespace loaded_game {
         }
 
         static std::vector<std::array<T, ACTION_MAX_DIM>> get_strategy(const LoadedGame& game, const std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
-            std::vector<std::array<T, ACTION_MAX_DIM>> result(game.infosets.size());
-
             assert(game.infosets.size() == average_policy.size());
-
-            for(int idx = 0; idx < game.infosets.size(); idx++) {
-                result[idx] = average_policy[idx];
-                T sm = 0;
-                for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                    sm += average_policy[idx][j];
-                }
-                if (sm <= 1e-9) {
-                    int sz = game.infosets[idx].actions.size();
-                    for(int j = 0; j < sz; j++) {
-                        result[idx][j] = 1.0;
-                    }
-                    sm = sz;
-                }
-                for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                    result[idx][j] /= sm;
-                }
-
-                double assert_sm = 0;
-                for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                    assert_sm += result[idx][j];
-                }
-                assert(abs(assert_sm - 1) <= 1e-5);
-            }
+            std::vector<std::array<T, ACTION_MAX_DIM>> result(game.infosets.size());
+            kernels::normalize(average_policy.data(), result.data(), result.size(), [&game](long long idx) {
+                return info_set_action_mask(game, idx);
+            });
             return result;
         }
 
+        static uint32_t info_set_action_mask(const LoadedGame& game, long long idx) {
+            return uint32_t(1 << game.infosets[idx].actions.size()) - 1;
+        }
+
     };
 
     enum Player2PG {
@@ -254,6 +237,7 @@ namespace loaded_game {
         static constexpr int ACTION_MAX_DIM = 6; // 6 because of the chance nodes... bad architecture...
         static constexpr int NUM_PLAYERS = 2;
         static constexpr int NUM_INFO_SETS = 68 - 56;
+        static constexpr int MAX_DECISIONS = 3; // on the longest path
         static const LoadedGame &my_game;
         static const std::array<Player, NUM_PLAYERS> players;
 
@@ -262,27 +246,36 @@ namespace loaded_game {
         static std::vector<std::array<T, ACTION_MAX_DIM>> get_strategy(const std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
             return LoadedState::get_strategy(Kuhn::my_game, average_policy);
         }
+
+        static uint32_t info_set_action_mask(long long idx) {
+            return LoadedState::info_set_action_mask(Kuhn::my_game, idx);
+        }
     };
     const LoadedGame& Kuhn::my_game = kuhn;
     const std::array<Kuhn::Player, Kuhn::NUM_PLAYERS> Kuhn::players = {Kuhn::Player::P1, Kuhn::Player::P2};
 
 
     static LoadedGame leduc(paths::get_leduc_descriptor());
-    class Leduc: public LoadedState<6, Player2PG> {
+    class Leduc: public LoadedState<9, Player2PG> {
     public:
         using Player = Player2PG;
 
-        static constexpr int ACTION_MAX_DIM = 6; // 6 because of the chance nodes... bad architecture...
+        static constexpr int ACTION_MAX_DIM = 9; // 9 because of the chance node dealing the two private cards...
         static constexpr int NUM_PLAYERS = 2;
         static constexpr int NUM_INFO_SETS = 2225 - 1937;
+        static constexpr int MAX_DECISIONS = 8; // on the longest path
         static const LoadedGame &my_game;
         static const std::array<Player, NUM_PLAYERS> players;
 
-        Leduc(): LoadedState<ACTION_MAX_DIM, Player2PG>(kuhn, loaded_game::player_to_name_2pg, loaded_game::name_to_player_2pg) {}
+        Leduc(): LoadedState<ACTION_MAX_DIM, Player2PG>(Leduc::my_game, loaded_game::player_to_name_2pg, loaded_game::name_to_player_2pg) {}
 
         static std::vector<std::array<T, ACTION_MAX_DIM>> get_strategy(const std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
             return LoadedState::get_strategy(Leduc::my_game, average_policy);
         }
+
+        static uint32_t info_set_action_mask(long long idx) {
+            return LoadedState::info_set_action_mask(Leduc::my_game, idx);
+        }
     };
     const LoadedGame& Leduc::my_game = leduc;
     const std::array<Leduc::Player, Leduc::NUM_PLAYERS> Leduc::players = {Leduc::Player::P1, Leduc::Player::P2};
@@ -0,0 +1,158 @@
+// MCCFR with the regret tables sharded over several server processes, see distributed.hpp.
+// everything can run on one host, e.g. two shards and one worker process:
+//   distributed leduc server 0 2 5000 shard0.store &
+//   distributed leduc server 1 2 5001 shard1.store &
+//   distributed leduc worker localhost:5000,localhost:5001 2 16 60
+//   distributed leduc eval localhost:5000,localhost:5001
+//
+//   distributed <pttt|leduc|kuhn> server <shard> <num_shards> <port> [store]
+//   distributed <pttt|leduc|kuhn> worker <host:port,...> [threads] [group] [seconds] [cache_ttl]
+//   distributed <pttt|leduc|kuhn> eval <host:port,...>
+
+#include "distributed.hpp"
+#include "evaluator.hpp"
+#include "loaded_game.hpp"
+#include "pttt.hpp"
+#include "topology.hpp"
+#include <sstream>
+
+using namespace std;
+
+static vector<string> split_addresses(const string &list) {
+    vector<string> res;
+    stringstream ss(list);
+    string address;
+    while(getline(ss, address, ',')) {
+        res.push_back(address);
+    }
+    return res;
+}
+
+// a server with a store keeps its rows in that file, starting it again with the same arguments resumes the shard.
+// without one they only live as long as the process
+
+// only PTTT has tables to build before the first state is created
+template<class Game>
+static void prepare_game() {}
+
+template<>
+void prepare_game<pttt::PTTT>() {
+    pttt::PTTT::precompute_if_needed();
+}
+
+template<class Game>
+static int run_worker(const vector<string> &shards, int num_threads, int group, double seconds, int cache_ttl) {
+    prepare_game<Game>();
+    vector<unique_ptr<distributed::Worker<Game>>> workers;
+    for(int i = 0; i < num_threads; i++) {
+        workers.emplace_back(new distributed::Worker<Game>(shards, cache_ttl));
+    }
+    cout << "workers=" << num_threads << " group=" << group << " shards=" << shards.size() << " cache_ttl=" << cache_ttl << endl;
+
+    atomic<bool> stop(false);
+    vector<thread> threads;
+    vector<string> errors(num_threads); // a lost shard connection or a rejected request stops all threads
+    vector<int> cpus = topology::usable_cpus();
+    for(int i = 0; i < num_threads; i++) {
+        threads.emplace_back([&, i]() {
+            topology::pin_current_thread(cpus[i % cpus.size()]);
+            try {
+                while(!stop) {
+                    workers[i]->iteration_group(group);
+                }
+                workers[i]->flush();
+            } catch(const runtime_error &e) {
+                errors[i] = e.what();
+                stop = true;
+            }
+        });
+    }
+
+    auto start = chrono::steady_clock::now();
+    distributed::WorkerStats prev;
+    while(!stop) {
+        this_thread::sleep_for(chrono::seconds(10));
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        distributed::WorkerStats now;
+        for(auto &worker: workers) {
+            now += worker->stats();
+        }
+        uint64_t lookups = (now.fetched_rows - prev.fetched_rows) + (now.cache_hits - prev.cache_hits);
+        cout << "episodes/sec=" << (now.episodes - prev.episodes) / 10.0
+             << " rows/fetch=" << double(now.fetched_rows - prev.fetched_rows) / max<uint64_t>(1, now.fetch_rounds - prev.fetch_rounds)
+             << " cache hit rate=" << double(now.cache_hits - prev.cache_hits) / max<uint64_t>(1, lookups)
+             << " cache age=" << double(now.cache_age_sum - prev.cache_age_sum) / max<uint64_t>(1, now.cache_hits - prev.cache_hits) << " groups"
+             << " rows/push=" << double(now.pushed_rows - prev.pushed_rows) / max<uint64_t>(1, now.push_batches - prev.push_batches) << endl;
+        for(auto &shard: shards) {
+            try {
+                distributed::ShardStats stats = distributed::fetch_stats(shard);
+                cout << "  shard " << shard << " [" << stats.begin << ", " << stats.end << ") applied=" << stats.version
+                     << " staleness=" << double(stats.staleness_sum) / max<uint64_t>(1, stats.version) << endl;
+            } catch(const runtime_error &e) {
+                cout << "  shard " << shard << ": " << e.what() << endl; // the training threads run into it as well
+            }
+        }
+        prev = now;
+        if(seconds > 0 && elapsed >= seconds)
+            break;
+    }
+    stop = true;
+    for(auto &t: threads) {
+        t.join();
+    }
+    int result = 0;
+    for(int i = 0; i < num_threads; i++) {
+        if(!errors[i].empty()) {
+            cerr << "worker " << i << ": " << errors[i] << endl;
+            result = 1;
+        }
+    }
+    return result;
+}
+
+template<class Game>
+static void run_eval(const vector<string> &shards) {
+    prepare_game<Game>();
+    strategy::Strategy<Game> strategy = Game::get_strategy(distributed::fetch_average_policy<Game>(shards));
+    eval::EvalFast<Game> evaluator;
+    cout << "nash gap " << evaluator.nash_gap(strategy) << endl;
+}
+
+template<class Game>
+static int run(int argc, char **argv) {
+    string mode = argc > 2 ? argv[2] : "";
+    if(mode == "server" && (argc == 6 || argc == 7)) {
+        int shard = stoi(argv[3]);
+        distributed::ShardMap map{stoi(argv[4]), Game::NUM_INFO_SETS};
+        distributed::ShardServer<Game> server(shard, map, argc == 7 ? argv[6] : "");
+        server.serve(stoi(argv[5]));
+    } else if(mode == "worker" && argc >= 4) {
+        int num_threads = argc > 4 ? stoi(argv[4]) : max(1, int(topology::usable_cpus().size()));
+        int group = argc > 5 ? stoi(argv[5]) : 16;
+        double seconds = argc > 6 ? stod(argv[6]) : 0;
+        int cache_ttl = argc > 7 ? stoi(argv[7]) : 1;
+        return run_worker<Game>(split_addresses(argv[3]), num_threads, group, seconds, cache_ttl);
+    } else if(mode == "eval" && argc == 4) {
+        run_eval<Game>(split_addresses(argv[3]));
+    } else {
+        cout << "usage: distributed <pttt|leduc|kuhn> server <shard> <num_shards> <port> [store]" << endl;
+        cout << "       distributed <pttt|leduc|kuhn> worker <host:port,...> [threads] [group] [seconds] [cache_ttl]" << endl;
+        cout << "       distributed <pttt|leduc|kuhn> eval <host:port,...>" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    ios_base::sync_with_stdio(0); cin.tie(0); cout.tie(0);
+    string game = argc > 1 ? argv[1] : "";
+    if(game == "leduc") {
+        return run<loaded_game::Leduc>(argc, argv);
+    } else if(game == "kuhn") {
+        return run<loaded_game::Kuhn>(argc, argv);
+    } else if(game == "pttt") {
+        return run<pttt::PTTT>(argc, argv);
+    }
+    cout << "usage: distributed <pttt|leduc|kuhn> <server|worker|eval> ..." << endl;
+    return 1;
+}
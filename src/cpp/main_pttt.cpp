@@ -4,13 +4,18 @@
 // #include "mccfr.hpp"
 #include "mccfr_es.hpp"
 #include "evaluator.hpp"
+#include "mc_eval.hpp"
+#include "sampled_br.hpp"
+#include "topology.hpp"
 #include <thread>
 #include <atomic>
+#include <functional>
+#include <memory>
 // #include "loaded_game.hpp"
 
 // using Game = loaded_game::Kuhn;
 using Game = pttt::PTTT;
-using MCCFR = mccfr_es:MCCFR<Game>;
+using MCCFR = mccfr_es::MCCFR<Game>;
 using Strategy = strategy::Strategy<Game>;
 using Eval = eval::EvalFast<Game>;
 using namespace std;
@@ -39,36 +44,82 @@ using namespace std;
 //     }
 // }
 
-int main() {
+// usage: pttt [canonical|dfs|depth] [group] [store]
+//   infoset layout of the regret tables (checkpoints are always canonical),
+//   group > 0 makes every worker run that many interleaved episodes at once (MCCFR::iteration_interleaved),
+//   store is the file the tables live in (default checkpoints/latest.store), e.g. the output of ckpt_merge to resume from merged runs
+int main(int argc, char **argv) {
     ios_base::sync_with_stdio(0); cin.tie(0); cout.tie(0);
 
+    if(argc > 1) {
+        Game::set_infoset_layout(pttt::layout_from_name(argv[1]));
+    }
+    cout << "infoset layout: " << pttt::layout_name(Game::get_infoset_layout()) << endl;
+    int group = argc > 2 ? stoi(argv[2]) : 0;
+    cout << "interleaved episodes per worker: " << group << endl;
+
     #ifdef NO_PRECOMPUTE
     cout << "NO_PRECOMPUTE MODE" << endl;
     #else
     cout << "PRECOMPUTE MODE" << endl;
     #endif
 
-    MCCFR mccfr;
+    auto program_start = chrono::steady_clock::now();
+    // the regret tables live in this file and are updated in place, if it exists we resume from it
+    string store_path = argc > 3 ? string(argv[3]) : string(paths::get_checkpoints_dir() / "latest.store");
+    MCCFR mccfr(store_path);
+    uint64_t layout_tag = uint64_t(Game::get_infoset_layout());
+    if(mccfr.resumed()) {
+        cout << "resuming from " << store_path << " at iteration " << mccfr.stored_iterations() << endl;
+        if(mccfr.store_tag() != layout_tag) {
+            throw runtime_error(store_path + " was trained with a different infoset layout");
+        }
+    } else {
+        mccfr.set_store_tag(layout_tag);
+    }
+    cout << "MCCFR tables ready in " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - program_start).count() << "ms" << endl;
     Game::precompute_if_needed(); // do this before starting the threads...
 
-    int num_threads = thread::hardware_concurrency();
-    cout << "Number of available cores: " << num_threads << endl; // I think this might not be the number of cores you have access to... maybe set this manually?
+    // size from the cpus we are actually allowed to use (affinity + cgroup quota), not hardware_concurrency()
+    vector<int> cpus = topology::usable_cpus();
+    topology::print_summary(cpus);
+    // the last cpu is kept for the logging thread so that it does not fight with the workers
+    int logger_cpu = cpus.back();
+    int num_threads = max(1, int(cpus.size()) - 1);
+    cout << "Number of worker threads: " << num_threads << endl;
+
+    // hourly checkpoints are deltas of the rows touched in the last hour on top of a base taken at the first one
+    mccfr.track_dirty_rows();
 
-    atomic<int> iters(0);
+    atomic<uint64_t> iters(mccfr.stored_iterations());
+    uint64_t start_iters = iters.load();
+    // lets the logger stop the workers between two iterations to take consistent snapshots
+    snapshot::PauseBarrier barrier(num_threads);
     vector<thread> threads;
     for (int i = 0; i < num_threads; ++i) {
-        threads.emplace_back([&mccfr, &iters]() {
+        int cpu = cpus[i % cpus.size()];
+        threads.emplace_back([&mccfr, &iters, &barrier, cpu, program_start, group, start_iters]() {
+            topology::pin_current_thread(cpu);
             while (true) {
-                mccfr.iteration();
-                iters++;
+                barrier.checkpoint();
+                if(group > 0) {
+                    mccfr.iteration_interleaved(group);
+                } else {
+                    mccfr.iteration();
+                }
+                if(iters.fetch_add(uint64_t(max(group, 1))) == start_iters) {
+                    cout << "time to first iteration: " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - program_start).count() << "ms" << endl;
+                }
             }
         });
     }
 
-    threads.emplace_back([&mccfr, &iters]() {
+    threads.emplace_back([&mccfr, &iters, &barrier, &cpus, logger_cpu]() {
+        topology::pin_current_thread(logger_cpu);
         std::cout << "Starting logging thread" << std::endl;
 
-        Eval eval;
+        // the compiled treeplexes are mapped from the data dir after the first run, until the infoset files change
+        Eval eval(-1, paths::get_data_dir() / ("treeplex-" + pttt::layout_name(Game::get_infoset_layout())), Game::layout_fingerprint());
 
         std::cout << "Evaluator Created" << std::endl;
         
@@ -78,10 +129,33 @@ int main() {
         
         struct Stat {
             int minutes;
-            int iters;
+            uint64_t iters;
             double nash_gap;
         };
         std::vector<Stat> stats;
+        // the exact gap walks the whole tree, in between the sampled lower bound is the convergence signal
+        const int EXACT_GAP_EVERY = 60; // minutes
+        auto last_exact_gap = start - chrono::minutes(EXACT_GAP_EVERY);
+        sampled_br::Options sampled_options;
+        sampled_options.seconds = 20;
+        // the games against the uniform bot stop once the value is known to +-0.01
+        mc_eval::Options uniform_options;
+        uniform_options.half_width = 0.01;
+        uniform_options.max_games = 1 << 18;
+        std::vector<std::array<double, 6>> sampled_stats; // minutes, iters, gap, std error, lower, upper
+        std::vector<std::array<double, 5>> regret_stats; // minutes, iters, bound, bound of player 0, of player 1
+
+        // one chain per run: rows written before a restart but after the last delta of the previous run were not tracked
+        char run_name[80];
+        time_t run_start = time(nullptr);
+        strftime(run_name, sizeof(run_name), "parallel_checkpoint__%m_%d_%Y_%H_%M_%S.store", localtime(&run_start));
+        string base_path = paths::get_checkpoints_dir() / run_name;
+        bool have_base = false;
+        const int COMPACT_EVERY = 24; // deltas
+
+        // evaluation reads a consistent snapshot instead of the live tables, as long as taking one is cheap (reflink)
+        string eval_snapshot_path = paths::get_checkpoints_dir() / "eval.store";
+        bool eval_from_snapshot = true;
 
         while (true) {
             auto now = chrono::steady_clock::now();
@@ -89,27 +163,100 @@ int main() {
             auto elapsed_since_check = chrono::duration_cast<chrono::minutes>(now - last_checkpoint).count();
 
             cout << "minute_count=" << elapsed_since_start << " iters=" << iters.load() << endl;
+            mccfr.set_stored_iterations(iters.load());
             if(elapsed_since_check > 60) { // every hour
                 last_checkpoint = now;
-                time_t t = time(nullptr);
-                tm* timePtr = localtime(&t);
-                char buffer[80];
-                strftime(buffer, sizeof(buffer), "parallel_checkpoint__%m_%d_%Y_%H_%M_%S", timePtr);
-                mccfr.save_checkpoint(buffer);
-                mccfr.save_checkpoint("latest");
+                uint64_t iters_before = iters.load();
+                auto checkpoint_start = chrono::steady_clock::now();
+                if(!have_base) {
+                    // the store is the checkpoint, the base of the chain is a consistent (reflinked) copy of it
+                    bool reflinked = mccfr.start_chain(base_path, barrier);
+                    have_base = true;
+                    cout << "checkpoint base " << base_path << (reflinked ? " (reflink)" : " (full copy)");
+                } else {
+                    string delta_path = delta::next_delta_path(base_path);
+                    size_t rows = mccfr.save_delta(delta_path, iters_before, barrier);
+                    cout << "checkpoint delta " << delta_path << " rows=" << rows << " (" << 100.0 * rows / Game::NUM_INFO_SETS << "%)";
+                }
+                cout << " workers paused for " << barrier.last_pause_duration_ms() << "ms" << endl;
+                if(delta::chain(base_path).size() >= COMPACT_EVERY) {
+                    delta::compact(base_path);
+                    MCCFR(base_path, arena::Access::READ_ONLY).save_checkpoint("latest"); // npy export for the python side, only once per compaction
+                }
+                double checkpoint_seconds = chrono::duration<double>(chrono::steady_clock::now() - checkpoint_start).count();
+                cout << "checkpoint took " << checkpoint_seconds << "s, iters/sec during checkpoint: "
+                     << (iters.load() - iters_before) / checkpoint_seconds << endl;
             }
             if(true) { // define the frequency later...
                 auto start_stat = chrono::steady_clock::now();
 
-                Strategy strategy = mccfr.get_strategy(); // loads a huge data structure. try to avoid :D 
-                std::cout << "P1 against unifrom: " << strategy.evaluate_against_uniform(Game::Player::P1, 5000) << std::endl;
-                std::cout << "P2 against uniform: " << strategy.evaluate_against_uniform(Game::Player::P2, 5000) << std::endl;
-                auto nash_gap = eval.nash_gap(strategy);
-                stats.push_back({int(elapsed_since_start), iters.load(), nash_gap});
-                std::cout << "nash gap " << nash_gap << std::endl;
+                // the evaluations read a reflinked snapshot through a view that normalizes the rows they touch, no copy.
+                // without reflink the average policy is copied out of the live tables once: the gaps read the same
+                // infosets again and again and would see the workers' updates in between
+                using Row = std::array<double, Game::ACTION_MAX_DIM>;
+                std::unique_ptr<MCCFR> snapshot;
+                std::vector<Row> policy_copy;
+                std::function<void(long long, Row&)> policy_source;
+                if(eval_from_snapshot) {
+                    eval_from_snapshot = mccfr.snapshot_store(eval_snapshot_path, barrier);
+                    if(eval_from_snapshot)
+                        snapshot.reset(new MCCFR(eval_snapshot_path, arena::Access::READ_ONLY));
+                }
+                if(snapshot) {
+                    policy_source = snapshot->average_policy_source();
+                } else {
+                    policy_copy = mccfr.get_strategy_data();
+                    policy_source = [&policy_copy](long long idx, Row &out) { out = policy_copy[idx]; };
+                }
+                auto strategy = strategy::make_view<Game>(policy_source);
+                // the evaluation threads share all cpus with the workers instead of piling up on the logger cpu
+                topology::pin_current_thread(cpus);
+                uniform_options.seed++;
+                for(int i = 0; i < Game::NUM_PLAYERS; i++) {
+                    mc_eval::Result uniform = mc_eval::against_uniform<Game>(strategy, Game::players[i], uniform_options);
+                    std::cout << "P" << i + 1 << " against uniform: " << uniform.mean << " +- " << uniform.half_width
+                              << " (" << uniform.games << " games in " << uniform.seconds << "s)" << std::endl;
+                }
+                uint64_t regret_iters = iters.load();
+                mccfr_es::RegretBound regret = mccfr.regret_bound(regret_iters, [](long long idx) {
+                    return mccfr_es::RegretKey{Game::info_set_player(idx), Game::info_set_depth(idx)};
+                });
+                std::cout << "regret bound " << regret.total << " (p0 " << regret.per_player[0] << ", p1 " << regret.per_player[1]
+                          << ", " << regret.seconds << "s)" << std::endl;
+                for(size_t p = 0; p < regret.per_depth.size(); p++) {
+                    std::cout << "  p" << p << " by depth:";
+                    for(size_t d = 0; d < regret.per_depth[p].size(); d++) {
+                        std::cout << " " << regret.per_depth[p][d];
+                    }
+                    std::cout << std::endl;
+                }
+                regret_stats.push_back({double(elapsed_since_start), double(regret_iters), regret.total, regret.per_player[0], regret.per_player[1]});
+                io::NpyWriter<double> regret_writer("./regret_bounds.npy", 5);
+                for(auto &row: regret_stats) {
+                    regret_writer.write(row.data(), 5);
+                }
+                regret_writer.close();
+                sampled_options.seed++;
+                sampled_br::Result sampled = sampled_br::estimate<Game>(strategy, sampled_options);
+                bool exact = chrono::steady_clock::now() - last_exact_gap >= chrono::minutes(EXACT_GAP_EVERY);
+                double nash_gap = exact ? eval.nash_gap(strategy) : 0;
+                topology::pin_current_thread(logger_cpu);
+                std::cout << "sampled nash gap " << sampled.gap << " +- " << sampled.std_error << " (lower " << sampled.lower << ", "
+                          << sampled.players[0].eval_episodes + sampled.players[1].eval_episodes << " episodes in " << sampled.seconds << "s)" << std::endl;
+                sampled_stats.push_back({double(elapsed_since_start), double(iters.load()), sampled.gap, sampled.std_error, sampled.lower, sampled.upper});
+                io::NpyWriter<double> sampled_writer("./sampled_nash_gaps.npy", 6);
+                for(auto &row: sampled_stats) {
+                    sampled_writer.write(row.data(), 6);
+                }
+                sampled_writer.close();
+                if(exact) {
+                    last_exact_gap = chrono::steady_clock::now();
+                    stats.push_back({int(elapsed_since_start), iters.load(), nash_gap});
+                    std::cout << "nash gap " << nash_gap << std::endl;
+                }
 
                 std::vector<double> nash_gap_data;
-                std::vector<int> iters_data;
+                std::vector<uint64_t> iters_data;
                 std::vector<int> minutes_data;
                 for(auto &stat: stats) {
                     nash_gap_data.push_back(stat.nash_gap);
@@ -117,7 +264,7 @@ int main() {
                     minutes_data.push_back(stat.minutes);
                 }
                 io::save_to_numpy<double>("./nash_gaps.npy", nash_gap_data.begin(), nash_gap_data.end());
-                io::save_to_numpy<int>("./iters.npy", iters_data.begin(), iters_data.end());
+                io::save_to_numpy<uint64_t>("./iters.npy", iters_data.begin(), iters_data.end());
                 io::save_to_numpy<int>("./minutes.npy", minutes_data.begin(), minutes_data.end());
 
                 auto end_stat = chrono::steady_clock::now();
@@ -0,0 +1,220 @@
+#ifndef MC_EVAL_HPP
+#define MC_EVAL_HPP
+
+// monte carlo value of a pairing of bots (a strategy or the uniform bot in each seat), played on all cores.
+// games are played in batches of BATCH games (LANES of them in lockstep if the game has a Game::Batch, see
+// pttt::PTTTBatch), batch b draws from its own rng stream (seed, b), and the batches are played in rounds of
+// ROUND_BATCHES. after every round the mean and standard error of all the games so far decide whether the
+// confidence interval is narrow enough to stop. batches are summed in batch order, so the result only depends on
+// the seed, not on the number of threads
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <type_traits>
+#include <vector>
+#include "parallel.hpp"
+#include "strategy.hpp"
+
+namespace mc_eval {
+    using T = double;
+
+    // the uniform bot: picks one of the valid actions uniformly
+    struct Uniform {};
+
+    struct Options {
+        long long min_games = 4096; // before the interval may stop the evaluation
+        long long max_games = 1 << 20;
+        double half_width = 0; // stop once z * std_error is at most this, 0 plays max_games
+        double z = 1.96;
+        int num_threads = -1; // all usable cpus
+        uint64_t seed = 0;
+    };
+
+    struct Result {
+        T mean = 0; // utility of the evaluated player
+        T std_error = 0;
+        T half_width = 0; // z * std_error
+        long long games = 0;
+        bool converged = false; // reached the half width
+        double seconds = 0;
+    };
+
+    static constexpr long long BATCH = 64; // games per rng stream
+    static constexpr long long ROUND_BATCHES = 64; // batches between two looks at the interval
+    static constexpr int LANES = 16; // of the lockstep games, for the games that have a Game::Batch
+
+    struct Moments {
+        T sum = 0, sum_sq = 0;
+        long long games = 0; // finished games, the denominator of the mean
+
+        void add(T u) {
+            sum += u;
+            sum_sq += u * u;
+            games++;
+        }
+    };
+
+    template<typename Game, typename = void>
+    struct has_batch: std::false_type {};
+
+    template<typename Game>
+    struct has_batch<Game, std::void_t<typename Game::template Batch<LANES>>>: std::true_type {};
+
+    // the action of a seat: a strategy (anything with row(idx)) samples a strategy column of the infoset
+    // info_set_idx(), the uniform bot one of the n actions
+    template<typename Game, typename Seat, typename InfoSet, typename Rng>
+    static int pick(const Seat &seat, InfoSet info_set_idx, const std::array<int, Game::ACTION_MAX_DIM> &actions, int n, Rng &rng) {
+        if constexpr(std::is_same<Seat, Uniform>::value) {
+            return actions[std::min(n - 1, int(std::uniform_real_distribution<T>(0, 1)(rng) * n))];
+        } else {
+            return strategy::sample_index(seat.row(info_set_idx()), Game::ACTION_MAX_DIM, rng);
+        }
+    }
+
+    // games games, one after the other
+    template<typename Game, typename Seat0, typename Seat1, typename Rng>
+    static Moments play_serial(const Seat0 &seat0, const Seat1 &seat1, typename Game::Player p, long long games, Rng &rng) {
+        std::array<int, Game::ACTION_MAX_DIM> actions;
+        std::array<T, Game::ACTION_MAX_DIM> probs;
+        Moments m;
+        for(long long g = 0; g < games; g++) {
+            Game state;
+            while(!state.is_terminal()) {
+                int n = state.num_actions();
+                state.actions(actions);
+                auto info_set_idx = [&state]() { return state.info_set_idx(); };
+                int action;
+                if(state.is_chance()) {
+                    state.action_probs(probs);
+                    action = actions[strategy::sample_index(probs, n, rng)];
+                } else if(state.current_player() == Game::players[0]) {
+                    action = pick<Game>(seat0, info_set_idx, actions, n, rng);
+                } else {
+                    action = pick<Game>(seat1, info_set_idx, actions, n, rng);
+                }
+                state.step(action);
+            }
+            m.add(state.utility(p));
+        }
+        return m;
+    }
+
+    // one Batch of play_lockstep, until all its lanes are done. started counts the games it starts
+    template<typename Game, typename Seat0, typename Seat1, typename Rng>
+    static void play_lockstep_batch(const Seat0 &seat0, const Seat1 &seat1, typename Game::Player p, long long games, long long &started,
+                                    Rng &rng, Moments &m) {
+        using Batch = typename Game::template Batch<LANES>;
+        bool need_info_sets = !std::is_same<Seat0, Uniform>::value || !std::is_same<Seat1, Uniform>::value;
+        std::array<uint32_t, LANES> masks;
+        std::array<int, LANES> lane_actions;
+        std::array<bool, LANES> counted;
+        std::array<int, Game::ACTION_MAX_DIM> actions;
+
+        int lanes = int(std::min<long long>(LANES, games - started));
+        Batch batch(need_info_sets, lanes);
+        started += lanes;
+        for(int lane = 0; lane < LANES; lane++) {
+            counted[lane] = lane >= lanes;
+        }
+        while(!batch.all_terminal()) {
+            batch.valid_action_mask_many(masks.data());
+            bool first_seat = batch.current_player() == Game::players[0];
+            for(int lane = 0; lane < LANES; lane++) {
+                if(masks[lane] == 0)
+                    continue;
+                int n = Batch::actions_from_mask(masks[lane], actions);
+                auto info_set_idx = [&batch, lane]() { return batch.info_set_idx(lane); };
+                lane_actions[lane] = first_seat ? pick<Game>(seat0, info_set_idx, actions, n, rng)
+                                                : pick<Game>(seat1, info_set_idx, actions, n, rng);
+            }
+            batch.step_many(lane_actions.data());
+
+            bool can_refill = batch.current_player() == Game::players[0];
+            for(int lane = 0; lane < LANES; lane++) {
+                if(!batch.is_terminal(lane))
+                    continue;
+                if(!counted[lane]) {
+                    m.add(batch.utility(lane, p));
+                    counted[lane] = true;
+                }
+                if(can_refill && started < games) {
+                    batch.reset_lane(lane);
+                    counted[lane] = false;
+                    started++;
+                }
+            }
+        }
+    }
+
+    // games games on the lockstep dynamics of Game::Batch (no chance nodes), LANES at a time. a finished lane gets
+    // the next game as soon as it is the first player's turn again, every started game is counted. all lanes can end
+    // on a move of the second player, when none can be refilled: the remaining games are played in a new batch then
+    template<typename Game, typename Seat0, typename Seat1, typename Rng>
+    static Moments play_lockstep(const Seat0 &seat0, const Seat1 &seat1, typename Game::Player p, long long games, Rng &rng) {
+        Moments m;
+        for(long long started = 0; started < games;) {
+            play_lockstep_batch<Game>(seat0, seat1, p, games, started, rng, m);
+        }
+        return m;
+    }
+
+    // the value for player p of Game::players[0] played by seat0 against Game::players[1] played by seat1. a seat
+    // is a strategy (strategy::Strategy, strategy::View, ...) or Uniform
+    template<typename Game, typename Seat0, typename Seat1>
+    static Result play(const Seat0 &seat0, const Seat1 &seat1, typename Game::Player p, Options options = {}) {
+        auto start = std::chrono::steady_clock::now();
+        int num_threads = options.num_threads > 0 ? options.num_threads : parallel::default_num_threads();
+        std::vector<Moments> batches;
+        Result result;
+        T sum = 0, sum_sq = 0;
+        long long max_batches = (options.max_games + BATCH - 1) / BATCH;
+        while(batches.size() < size_t(max_batches)) {
+            long long first = batches.size();
+            long long count = std::min(ROUND_BATCHES, max_batches - first);
+            batches.resize(first + count);
+            std::atomic<long long> next{first};
+            parallel::parallel_for(0, num_threads, [&](long long, long long) {
+                for(long long b; (b = next.fetch_add(1)) < first + count;) {
+                    std::mt19937_64 rng(options.seed * 1000003 + b);
+                    long long games = std::min(BATCH, options.max_games - b * BATCH);
+                    if constexpr(has_batch<Game>::value) {
+                        batches[b] = play_lockstep<Game>(seat0, seat1, p, games, rng);
+                    } else {
+                        batches[b] = play_serial<Game>(seat0, seat1, p, games, rng);
+                    }
+                }
+            }, std::min<long long>(num_threads, count));
+
+            for(long long b = first; b < first + count; b++) {
+                sum += batches[b].sum;
+                sum_sq += batches[b].sum_sq;
+                result.games += batches[b].games;
+            }
+            long long n = result.games;
+            result.mean = sum / n;
+            result.std_error = n > 1 ? std::sqrt(std::max(T(0), (sum_sq - sum * sum / n) / (n - 1)) / n) : 0;
+            result.half_width = options.z * result.std_error;
+            if(options.half_width > 0 && n >= options.min_games && result.half_width <= options.half_width) {
+                result.converged = true;
+                break;
+            }
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // strategy plays p, the uniform bot the other seat. the value of p
+    template<typename Game, typename S>
+    static Result against_uniform(const S &strategy, typename Game::Player p, Options options = {}) {
+        if(p == Game::players[0])
+            return play<Game>(strategy, Uniform{}, p, options);
+        return play<Game>(Uniform{}, strategy, p, options);
+    }
+} // namespace mc_eval
+
+#endif
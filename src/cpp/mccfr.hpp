@@ -8,6 +8,7 @@
 #include <random>
 #include <mutex>
 #include "strategy.hpp"
+#include "arena.hpp"
 
 
 namespace mccfr {
@@ -107,7 +108,8 @@ namespace mccfr {
 
         // regret minimizers are saved in action index space
         // average policy is saved in **action** space
-        std::vector<RegretMinimizer<Game::ACTION_MAX_DIM>> regret_minimizers; // size Game::NUM_INFO_SETS
+        // huge page backed, interleaved over the numa nodes and constructed in parallel, see arena::Array
+        arena::Array<RegretMinimizer<Game::ACTION_MAX_DIM>> regret_minimizers; // size Game::NUM_INFO_SETS
         
         using Buffer = std::array<T, Game::ACTION_MAX_DIM>;
         using BufferInt = std::array<int, Game::ACTION_MAX_DIM>;
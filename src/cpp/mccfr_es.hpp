@@ -3,13 +3,24 @@
 
 #define RMPLUS 0
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstring>
 #include <vector>
 #include <random>
 #include <mutex>
+#include <memory>
+#include <type_traits>
+#include "block_cache.hpp"
+#include "delta.hpp"
+#include "kernels.hpp"
+#include "snapshot.hpp"
+#include "spinlock.hpp"
 #include "strategy.hpp"
+#include "arena.hpp"
 
 
 namespace mccfr_es {
@@ -21,14 +32,17 @@ namespace mccfr_es {
         using Utility = std::array<T, MAX_DIM>;
         using Policy = std::array<T, MAX_DIM>;
 
+        // all-zero bytes are a fresh regret minimizer (dim 0 means not visited yet), that is what makes the table
+        // usable straight from zeroed or file backed memory (see arena::Array)
         T regret[MAX_DIM]; // todo: made this public so that we can load and save from file but later replace with friend functions
         T average_policy[MAX_DIM];
         T baselines[MAX_DIM];
 
-        T mixing_weight = 0.1; // mixing weight for the baseline
+        static constexpr T mixing_weight = 0.1; // mixing weight for the baseline
 
-        int dim = -1;
-        std::mutex mtx_regret, mtx_policy, mtx_baselines; // mutex for locking
+        int dim = 0;
+        using Lock = spinlock::SpinLock;
+        Lock mtx_regret, mtx_policy, mtx_baselines; // locks for the three arrays
 
     public:
         // note that this is indexed on the action indices and not the actions themselves!
@@ -39,13 +53,19 @@ namespace mccfr_es {
         }
 
         void set_dim(int dim_) {
-            assert(dim == -1 || dim == dim_);
+            assert(dim == 0 || dim == dim_);
             dim = dim_;
             // memset(regret, 0, sizeof(regret)); // otherwise we override the saved version...
         }
 
+        void reset_locks() {
+            mtx_regret.reset();
+            mtx_policy.reset();
+            mtx_baselines.reset();
+        }
+
         void observe_utility(const Utility& utility, const Policy &last_policy) {
-            std::lock_guard<std::mutex> lock(mtx_regret); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_regret); // lock the mutex
             T avg = 0;
             for(int i = 0; i < dim; i++) {
                 avg += last_policy[i] * utility[i];
@@ -59,14 +79,14 @@ namespace mccfr_es {
         }
 
         void update_baselines(const Utility& utility) {
-            std::lock_guard<std::mutex> lock(mtx_baselines); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_baselines); // lock the mutex
             for(int i = 0; i < dim; i++) {
                 baselines[i] = (1 - mixing_weight) * baselines[i] + mixing_weight * utility[i];
             }
         }
 
         void next_policy(Policy &policy) {
-            std::lock_guard<std::mutex> lock(mtx_regret); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_regret); // lock the mutex
             T sum = 0;
             for(int i = 0; i < dim; i++) {
                 policy[i] = std::max(regret[i], 0.0);
@@ -84,52 +104,146 @@ namespace mccfr_es {
         }
 
         void set_average_policy(const Policy &policy_values) {
-            std::lock_guard<std::mutex> lock(mtx_policy); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_policy); // lock the mutex
             for(int i = 0; i < MAX_DIM; i++)
                 average_policy[i] = policy_values[i];
         }
 
         void get_average_policy(Policy &policy_values) {
-            std::lock_guard<std::mutex> lock(mtx_policy); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_policy); // lock the mutex
             for(int i = 0; i < MAX_DIM; i++)
                 policy_values[i] = average_policy[i];
         }
 
         void set_regret(const Utility &regret_values) {
-            std::lock_guard<std::mutex> lock(mtx_regret); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_regret); // lock the mutex
             for(int i = 0; i < MAX_DIM; i++)
                 regret[i] = regret_values[i];
         }
 
+        int get_dim() const {
+            return dim;
+        }
+
+        // max_a R(a)^+, what the infoset adds to the regret bound
+        T max_positive_regret() {
+            std::lock_guard<Lock> lock(mtx_regret); // lock the mutex
+            T result = 0;
+            for(int i = 0; i < dim; i++)
+                result = std::max(result, regret[i]);
+            return result;
+        }
+
         void get_regret(Utility &regret_values) {
-            std::lock_guard<std::mutex> lock(mtx_regret); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_regret); // lock the mutex
             for(int i = 0; i < MAX_DIM; i++)
                 regret_values[i] = regret[i];
         }
 
         void get_baselines(Utility &baseline_values) {
-            std::lock_guard<std::mutex> lock(mtx_baselines); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_baselines); // lock the mutex
             for(int i = 0; i < MAX_DIM; i++)
                 baseline_values[i] = baselines[i];
         }
 
         void increment_avg_policy(int action, T increment) {
-            std::lock_guard<std::mutex> lock(mtx_policy); // lock the mutex
+            std::lock_guard<Lock> lock(mtx_policy); // lock the mutex
             average_policy[action] += increment;
         }
-    };;
+
+        // the remote halves of observe_utility / increment_avg_policy / update_baselines, for deltas computed
+        // by a distributed worker (distributed.hpp)
+        void add_regret(const Utility &regret_delta) {
+            std::lock_guard<Lock> lock(mtx_regret); // lock the mutex
+            for(int i = 0; i < dim; i++) {
+                regret[i] += regret_delta[i];
+                if(RMPLUS) {
+                    regret[i] = std::max(regret[i], 0.0);
+                }
+            }
+        }
+
+        void add_average_policy(const Policy &policy_delta) {
+            std::lock_guard<Lock> lock(mtx_policy); // lock the mutex
+            for(int i = 0; i < MAX_DIM; i++)
+                average_policy[i] += policy_delta[i];
+        }
+
+        // samples updates folded into one: mixing their mean with the weight the samples would have had together
+        void update_baselines(const Utility& mean_utility, int samples) {
+            std::lock_guard<Lock> lock(mtx_baselines); // lock the mutex
+            T weight = 1 - std::pow(1 - mixing_weight, samples);
+            for(int i = 0; i < dim; i++) {
+                baselines[i] = (1 - weight) * baselines[i] + weight * mean_utility[i];
+            }
+        }
+
+        // merging runs: regrets and average policy are sums, so they are added up with the run's weight.
+        // baselines are running means, they are added up as well and divided by the total weight with scale_baselines
+        void accumulate(const RegretMinimizer &other, T weight) {
+            for(int i = 0; i < MAX_DIM; i++) {
+                regret[i] += weight * other.regret[i];
+                average_policy[i] += weight * other.average_policy[i];
+                baselines[i] += weight * other.baselines[i];
+            }
+            dim = std::max(dim, other.dim);
+        }
+
+        void scale_baselines(T factor) {
+            for(int i = 0; i < MAX_DIM; i++) {
+                baselines[i] *= factor;
+            }
+        }
+    };
 
 ////////////////////////////////////////
 
+    // convergence proxy read straight from the regret tables: per player the sum over the infosets of
+    // max_a R(a)^+, divided by the iterations. for CFR the sum of the players' bounds bounds the nash gap of the
+    // average strategy. outcome sampling stores sampled regrets, so here it is an estimate of that bound
+    struct RegretBound {
+        std::vector<std::vector<T>> per_depth; // [player][depth]
+        std::vector<std::vector<long long>> rows_per_depth; // infosets that were visited at least once
+        std::vector<T> per_player;
+        T total = 0;
+        double seconds = 0;
+    };
+
+    struct RegretKey {
+        int player;
+        int depth;
+    };
+
     template<class Game>
     class MCCFR {
         using Player = typename Game::Player;
 
-        static constexpr T EXPLORATION = 0.6;
+    public:
+        static constexpr T EXPLORATION = 0.6; // also used by the distributed workers (distributed.hpp)
+
+    private:
+
+        static_assert(std::is_standard_layout<RegretMinimizer<Game::ACTION_MAX_DIM>>::value, "rows are stored as raw bytes");
 
         // regret minimizers are saved in action index space
         // average policy is saved in **action** space
-        std::vector<RegretMinimizer<Game::ACTION_MAX_DIM>> regret_minimizers; // size Game::NUM_INFO_SETS
+        // huge page backed, interleaved over the numa nodes and constructed in parallel, see arena::Array
+        arena::Array<RegretMinimizer<Game::ACTION_MAX_DIM>> regret_minimizers; // size Game::NUM_INFO_SETS
+        using Row = RegretMinimizer<Game::ACTION_MAX_DIM>;
+
+        // out-of-core mode: the rows are in a store file and only a block cache of them is in memory,
+        // regret_minimizers is empty then (see the cache_bytes constructor)
+        std::unique_ptr<block_cache::BlockCache<Row>> paged;
+        int pin_depth = 0;
+        std::atomic<int> interleaved_callers{0}; // threads in iteration_interleaved, for the cache check
+
+        // rows written since the last delta checkpoint, null unless track_dirty_rows() was called
+        std::unique_ptr<delta::DirtyRows> dirty_rows;
+
+        void mark_dirty(int info_set_idx) {
+            if(dirty_rows)
+                dirty_rows->mark(info_set_idx);
+        }
         
         using Buffer = std::array<T, Game::ACTION_MAX_DIM>;
         using BufferInt = std::array<int, Game::ACTION_MAX_DIM>;
@@ -182,6 +296,8 @@ namespace mccfr_es {
 
     public:
         void iteration() {
+            assert(!paged); // the out-of-core mode only has iteration_interleaved
+            assert(!read_only());
             ComputeMemo memo; // if you don't want to recreate this within the loop, you can also pass it from outside...
             for(auto player: Game::players) {
                 Game state;
@@ -191,28 +307,271 @@ namespace mccfr_es {
         }
 
         void iteration(Player player) {
+            assert(!paged && !read_only());
             ComputeMemo memo;
             Game state;
             episode(memo, state, player);
         }
 
+        // same as calling iteration() group_size times, but the episodes are advanced in lockstep one node at a time.
+        // before touching any regret minimizer the rows of every episode in the group are prefetched,
+        // so the dram latency of one episode is hidden behind the work on the others
+        void iteration_interleaved(int group_size) {
+            assert(!read_only());
+            struct Caller {
+                std::atomic<int> *callers;
+                ~Caller() { if(callers) callers->fetch_sub(1); }
+            } caller{paged ? &interleaved_callers : nullptr};
+            if(paged)
+                check_cache_capacity(group_size, interleaved_callers.fetch_add(1) + 1);
+            ComputeMemo memo;
+            std::vector<InFlightEpisode> group;
+            group.reserve(group_size * Game::NUM_PLAYERS);
+            for(int i = 0; i < group_size * Game::NUM_PLAYERS; i++) {
+                group.emplace_back(Game::players[i % Game::NUM_PLAYERS]);
+            }
+            run_interleaved(memo, group);
+        }
+
         MCCFR(): regret_minimizers(Game::NUM_INFO_SETS) { }
 
-        void save_checkpoint(const std::string &name) {
-            std::vector<std::array<T, Game::ACTION_MAX_DIM>> average_policy_data;
-            average_policy_data.reserve(Game::NUM_INFO_SETS);
-            average_policy_data.resize(Game::NUM_INFO_SETS);
-            for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
-                regret_minimizers[i].get_average_policy(average_policy_data[i]);
+        // regret minimizers live in a file that is updated in place (see arena::Array). an existing file is resumed.
+        // a READ_ONLY store (evaluation snapshots, tools that only compare strategies) is mapped without write access:
+        // only the reading accessors work (strategy_view, get_strategy, save_checkpoint, regret_bound, the header)
+        // and they copy each row out instead of taking its lock. on the store of a running trainer nothing is written
+        // either, but a copied row can be torn and the rows are from different iterations: read a snapshot instead
+        MCCFR(const std::string &store_path, arena::Access access = arena::Access::READ_WRITE):
+            regret_minimizers(Game::NUM_INFO_SETS, store_path, access) {
+            if(regret_minimizers.reopened() && !regret_minimizers.read_only()) {
+                // a crash may have left rows locked
+                parallel::parallel_for(0, Game::NUM_INFO_SETS, [this](long long lo, long long hi) {
+                    for(long long i = lo; i < hi; i++) {
+                        regret_minimizers[i].reset_locks();
+                    }
+                });
             }
-            Game::save_strategy_to_file(name, average_policy_data);
+        }
 
-            std::vector<std::array<T, Game::ACTION_MAX_DIM>> regret_minimizers_data;
-            regret_minimizers_data.reserve(Game::NUM_INFO_SETS);
-            regret_minimizers_data.resize(Game::NUM_INFO_SETS);
-            for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
-                regret_minimizers[i].get_regret(regret_minimizers_data[i]);
+        // out-of-core training on a store file (created if needed, and interchangeable with the ones above) with only
+        // cache_bytes of it in memory. the blocks of the rows visited in the first pin_depth decisions of an episode
+        // are kept in memory for good. only iteration_interleaved, the store header accessors and sync_store work
+        // in this mode, the group size is what gives the read-ahead something to overlap
+        MCCFR(const std::string &store_path, size_t cache_bytes, int pin_depth = 3, size_t block_rows = 0):
+            paged(new block_cache::BlockCache<Row>(Game::NUM_INFO_SETS, store_path, cache_bytes, block_rows,
+                                                   block_cache::DEFAULT_IO_THREADS, [](Row *rows, size_t n) {
+                for(size_t i = 0; i < n; i++) {
+                    rows[i].reset_locks();
+                }
+            })), pin_depth(pin_depth) { }
+
+        bool read_only() const {
+            return !paged && regret_minimizers.read_only();
+        }
+
+        bool resumed() {
+            if(paged)
+                return paged->reopened();
+            return regret_minimizers.file_backed() && regret_minimizers.reopened();
+        }
+
+        // iteration count and a caller defined tag kept in the store file header
+        arena::FileHeader& store_header() {
+            return paged ? paged->header() : regret_minimizers.header();
+        }
+
+        uint64_t stored_iterations() {
+            return store_header().iterations;
+        }
+
+        void set_stored_iterations(uint64_t iterations) {
+            assert(!read_only());
+            store_header().iterations = iterations;
+        }
+
+        uint64_t store_tag() {
+            return store_header().tag;
+        }
+
+        void set_store_tag(uint64_t tag) {
+            assert(!read_only());
+            store_header().tag = tag;
+        }
+
+        block_cache::Stats cache_stats() {
+            assert(paged);
+            return paged->stats();
+        }
+
+        const block_cache::BlockCache<Row>& cache() {
+            assert(paged);
+            return *paged;
+        }
+
+        // checkpoint of a file backed store: flush it, and keep a (reflinked) copy if a path is given.
+        // the copy is itself a store that can be passed to MCCFR(store_path)
+        void sync_store() {
+            if(paged) {
+                paged->flush();
+                return;
+            }
+            regret_minimizers.sync();
+        }
+
+        bool snapshot_store(const std::string &path) {
+            return regret_minimizers.snapshot(path);
+        }
+
+        // consistent snapshot while training is running: the bulk of the dirty pages is flushed while the workers
+        // keep going, then they are stopped at an iteration boundary only for the last flush and the reflink.
+        // without reflink support nothing is written and false is returned: a full copy would stop the workers for
+        // as long as it takes, the caller copies what it needs instead (e.g. get_strategy)
+        bool snapshot_store(const std::string &path, snapshot::PauseBarrier &barrier) {
+            regret_minimizers.sync();
+            bool reflinked = false;
+            barrier.while_paused([this, &path, &reflinked]() {
+                reflinked = regret_minimizers.reflink(path);
+            });
+            return reflinked;
+        }
+
+        // merges independently trained runs of the same game (same infoset layout) into a new store at output_path.
+        // the inputs are mapped and streamed row block by row block, none of them is loaded as a whole.
+        // the iteration count of the result is the sum of the inputs' counts with the same weights as their rows (a
+        // run with weight 2 counts as twice its iterations), training can resume from it like from any store
+        static uint64_t merge_stores(const std::vector<std::string> &input_paths, const std::vector<T> &weights, const std::string &output_path) {
+            assert(input_paths.size() == weights.size() && !input_paths.empty());
+            std::vector<std::unique_ptr<arena::Array<Row>>> runs;
+            T weighted_iterations = 0;
+            for(size_t run = 0; run < input_paths.size(); run++) {
+                const std::string &path = input_paths[run];
+                if(access(path.c_str(), F_OK) != 0) { // mapping it would create it
+                    throw std::runtime_error(path + " does not exist");
+                }
+                runs.emplace_back(new arena::Array<Row>(Game::NUM_INFO_SETS, path, arena::Access::READ_ONLY));
+                if(runs.back()->header().tag != runs.front()->header().tag) {
+                    throw std::runtime_error(path + " was trained with a different infoset layout");
+                }
+                weighted_iterations += weights[run] * runs.back()->header().iterations;
+            }
+            uint64_t iterations = uint64_t(std::llround(std::max(T(0), weighted_iterations)));
+            T total_weight = 0;
+            for(T weight: weights) {
+                total_weight += weight;
+            }
+
+            MCCFR merged(output_path);
+            if(merged.resumed()) {
+                throw std::runtime_error(output_path + " already exists");
+            }
+            parallel::parallel_for(0, Game::NUM_INFO_SETS, [&](long long lo, long long hi) {
+                constexpr long long BLOCK = 4096;
+                for(long long block = lo; block < hi; block += BLOCK) {
+                    long long block_end = std::min(hi, block + BLOCK);
+                    for(size_t run = 0; run < runs.size(); run++) {
+                        for(long long i = block; i < block_end; i++) {
+                            merged.regret_minimizers[i].accumulate((*runs[run])[i], weights[run]);
+                        }
+                    }
+                    for(long long i = block; i < block_end; i++) {
+                        merged.regret_minimizers[i].scale_baselines(1 / total_weight);
+                    }
+                }
+            });
+            merged.set_stored_iterations(iterations);
+            merged.set_store_tag(runs.front()->header().tag);
+            merged.sync_store();
+            return iterations;
+        }
+
+        // delta checkpoints (see delta.hpp). from now on every row that is written is remembered,
+        // save_delta writes those rows and starts over
+        void track_dirty_rows() {
+            dirty_rows.reset(new delta::DirtyRows(Game::NUM_INFO_SETS));
+        }
+
+        // snapshot of the store that becomes the base of a new chain, the dirty rows start over in the same pause.
+        // without reflink support the base is copied after the workers resumed: every row they write during the copy
+        // is dirty again, so base plus the first delta is consistent (load_checkpoint_chain resets the locks)
+        bool start_chain(const std::string &base_path, snapshot::PauseBarrier &barrier) {
+            assert(dirty_rows);
+            regret_minimizers.sync();
+            bool reflinked = false;
+            barrier.while_paused([this, &base_path, &reflinked]() {
+                reflinked = regret_minimizers.reflink(base_path);
+                dirty_rows->take();
+            });
+            if(!reflinked) {
+                regret_minimizers.snapshot(base_path);
+            }
+            return reflinked;
+        }
+
+        // writes the rows touched since the last delta, returns how many. only call it while no worker is running
+        size_t save_delta(const std::string &path, uint64_t iterations) {
+            assert(dirty_rows);
+            std::vector<int64_t> rows;
+            std::vector<char> bytes;
+            collect_dirty_rows(rows, bytes);
+            delta::write_delta(path, delta_header(iterations), rows, bytes);
+            return rows.size();
+        }
+
+        // same while training is running: the workers are stopped only while the dirty rows are copied out,
+        // the file is written after they resumed
+        size_t save_delta(const std::string &path, uint64_t iterations, snapshot::PauseBarrier &barrier) {
+            assert(dirty_rows);
+            std::vector<int64_t> rows;
+            std::vector<char> bytes;
+            barrier.while_paused([this, &rows, &bytes]() {
+                collect_dirty_rows(rows, bytes);
+            });
+            delta::write_delta(path, delta_header(iterations), rows, bytes);
+            return rows.size();
+        }
+
+        // overwrites the rows contained in the delta, returns the iteration count it was taken at
+        uint64_t apply_delta(const std::string &path) {
+            delta::DeltaHeader header = delta::read_delta(path, sizeof(Row), Game::NUM_INFO_SETS, [this](int64_t idx, const char *row) {
+                memcpy(static_cast<void*>(&regret_minimizers[idx]), row, sizeof(Row));
+                regret_minimizers[idx].reset_locks();
+                mark_dirty(idx);
+            });
+            if(regret_minimizers.file_backed()) {
+                set_stored_iterations(header.iterations);
+            }
+            return header.iterations;
+        }
+
+        // loads a base store and replays its deltas on top of it, returns the iteration count of the last one
+        uint64_t load_checkpoint_chain(const std::string &base_path) {
+            uint64_t iterations;
+            if(access(base_path.c_str(), F_OK) != 0) { // mapping it would create it
+                throw std::runtime_error(base_path + " does not exist");
+            }
+            {
+                arena::Array<Row> base(Game::NUM_INFO_SETS, base_path, arena::Access::READ_ONLY);
+                iterations = base.header().iterations;
+                parallel::parallel_for(0, Game::NUM_INFO_SETS, [this, &base](long long lo, long long hi) {
+                    memcpy(static_cast<void*>(&regret_minimizers[lo]), &base[lo], (hi - lo) * sizeof(Row));
+                    for(long long i = lo; i < hi; i++) {
+                        regret_minimizers[i].reset_locks();
+                    }
+                });
+            }
+            if(regret_minimizers.file_backed()) {
+                set_stored_iterations(iterations);
             }
+            for(auto &path: delta::chain(base_path)) {
+                iterations = apply_delta(path);
+            }
+            return iterations;
+        }
+
+        void save_checkpoint(const std::string &name) {
+            Game::save_strategy_to_file(name, get_strategy_data());
+            std::vector<std::array<T, Game::ACTION_MAX_DIM>> regret_minimizers_data = gather_rows([](Row &row, Buffer &out) {
+                row.get_regret(out);
+            });
             Game::save_state_from_file(name, regret_minimizers_data);
         }
 
@@ -223,6 +582,7 @@ namespace mccfr_es {
             Game::load_strategy_from_file(name, average_policy_data);
             for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
                 regret_minimizers[i].set_average_policy(average_policy_data[i]);
+                mark_dirty(i);
             }
 
             std::vector<std::array<T, Game::ACTION_MAX_DIM>> regret_minimizers_data;
@@ -231,36 +591,169 @@ namespace mccfr_es {
             Game::load_state_from_file(name, regret_minimizers_data);
             for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
                 regret_minimizers[i].set_regret(regret_minimizers_data[i]);
+                mark_dirty(i);
             }
         }
 
         std::vector<std::array<T, Game::ACTION_MAX_DIM>> get_strategy_data() {
-            std::vector<std::array<T, Game::ACTION_MAX_DIM>> average_policy_data;
-            average_policy_data.reserve(Game::NUM_INFO_SETS);
-            average_policy_data.resize(Game::NUM_INFO_SETS);
-            for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
-                regret_minimizers[i].get_average_policy(average_policy_data[i]);
-            }
-            return average_policy_data;
+            return gather_rows([](Row &row, Buffer &out) {
+                row.get_average_policy(out);
+            });
         }
 
         strategy::Strategy<Game> get_strategy() {
-            std::vector<std::array<T, Game::ACTION_MAX_DIM>> average_policy_data;
-            average_policy_data.reserve(Game::NUM_INFO_SETS);
-            average_policy_data.resize(Game::NUM_INFO_SETS);
-            for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
-                regret_minimizers[i].get_average_policy(average_policy_data[i]);
+            return Game::get_strategy(get_strategy_data());
+        }
+
+        // source(idx, out) of the unnormalized average policy rows, what strategy_view reads
+        auto average_policy_source() {
+            assert(!paged);
+            return [this](long long idx, Buffer &out) {
+                with_row(idx, [&out](Row &row) { row.get_average_policy(out); });
+            };
+        }
+
+        // the average policy as a strategy::View: normalized row by row when read, nothing is copied. the rows are
+        // read under their lock, so a view of tables that are being trained is only consistent per row: evaluations
+        // that read an infoset more than once (best responses, sampled games) need a snapshot or a copy then
+        auto strategy_view() {
+            return strategy::make_view<Game>(average_policy_source());
+        }
+
+        // regret bound after iterations iterations, broken down by key(idx) (a RegretKey). one parallel pass over the
+        // regret columns, summed per fixed size chunk and then in chunk order so it does not depend on the thread count
+        template<typename KeyFn>
+        RegretBound regret_bound(uint64_t iterations, KeyFn key) {
+            assert(!paged);
+            auto start = std::chrono::steady_clock::now();
+            constexpr long long CHUNK = kernels::REDUCE_CHUNK;
+            long long num_chunks = (Game::NUM_INFO_SETS + CHUNK - 1) / CHUNK;
+            std::vector<RegretBound> partial(num_chunks);
+            auto add = [](RegretBound &bound, int player, int depth, T value, long long rows) {
+                if(int(bound.per_depth.size()) <= player) {
+                    bound.per_depth.resize(player + 1);
+                    bound.rows_per_depth.resize(player + 1);
+                }
+                if(int(bound.per_depth[player].size()) <= depth) {
+                    bound.per_depth[player].resize(depth + 1, 0);
+                    bound.rows_per_depth[player].resize(depth + 1, 0);
+                }
+                bound.per_depth[player][depth] += value;
+                bound.rows_per_depth[player][depth] += rows;
+            };
+            parallel::parallel_for(0, num_chunks, [&](long long lo, long long hi) {
+                for(long long chunk = lo; chunk < hi; chunk++) {
+                    long long end = std::min<long long>(Game::NUM_INFO_SETS, (chunk + 1) * CHUNK);
+                    for(long long i = chunk * CHUNK; i < end; i++) {
+                        if(regret_minimizers[i].get_dim() == 0)
+                            continue;
+                        RegretKey k = key(i);
+                        add(partial[chunk], k.player, k.depth, with_row(i, [](Row &row) { return row.max_positive_regret(); }), 1);
+                    }
+                }
+            });
+            RegretBound bound;
+            bound.per_depth.resize(Game::NUM_PLAYERS);
+            bound.rows_per_depth.resize(Game::NUM_PLAYERS);
+            for(auto &part: partial) {
+                for(size_t p = 0; p < part.per_depth.size(); p++) {
+                    for(size_t d = 0; d < part.per_depth[p].size(); d++) {
+                        add(bound, p, d, part.per_depth[p][d], part.rows_per_depth[p][d]);
+                    }
+                }
             }
-            return Game::get_strategy(average_policy_data);
+            T scale = iterations > 0 ? T(1) / iterations : T(0);
+            bound.per_player.assign(bound.per_depth.size(), 0);
+            for(size_t p = 0; p < bound.per_depth.size(); p++) {
+                for(T &value: bound.per_depth[p]) {
+                    value *= scale;
+                    bound.per_player[p] += value;
+                }
+                bound.total += bound.per_player[p];
+            }
+            bound.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return bound;
+        }
+
+        RegretBound regret_bound(uint64_t iterations) {
+            return regret_bound(iterations, [](long long) { return RegretKey{0, 0}; });
+        }
+
+        // the policy regret matching plays right now, for every infoset (what next_policy returns)
+        std::vector<std::array<T, Game::ACTION_MAX_DIM>> get_current_policy_data() {
+            std::vector<std::array<T, Game::ACTION_MAX_DIM>> regrets = gather_rows([](Row &row, Buffer &out) {
+                row.get_regret(out);
+            });
+            kernels::regret_matching(regrets.data(), regrets.data(), regrets.size(), [this](long long idx) {
+                return regret_minimizers[idx].get_dim();
+            });
+            return regrets;
         }
 
         void set_strategy(const strategy::Strategy<Game> &strategy) {
             for(int i = 0; i < Game::NUM_INFO_SETS; i++) {
                 regret_minimizers[i].set_average_policy(strategy.strat[i]);
+                mark_dirty(i);
             }
         }
 
     private:
+        // a paged table needs a frame for every row the running episodes hold: each thread pins up to
+        // group * NUM_PLAYERS * MAX_DECISIONS blocks from its first forward step to its last backward step.
+        // throws before anything is pinned if the cache cannot hold that for all threads training on it right now
+        void check_cache_capacity(int group_size, int threads) const {
+            size_t per_thread = size_t(group_size) * Game::NUM_PLAYERS * Game::MAX_DECISIONS;
+            size_t pinnable = paged->pinnable_frames();
+            if(threads * per_thread > pinnable) {
+                throw std::runtime_error("block cache too small: " + std::to_string(threads) + " threads with group " + std::to_string(group_size)
+                                         + " pin up to " + std::to_string(threads * per_thread) + " blocks, the cache has "
+                                         + std::to_string(pinnable) + " besides the permanent ones. use a bigger cache, fewer threads or a smaller group");
+            }
+        }
+
+        // f(row idx). the rows of a read only store cannot be locked, f gets a private copy of the row then
+        template<typename F>
+        auto with_row(long long idx, F f) {
+            if(!regret_minimizers.read_only())
+                return f(regret_minimizers[idx]);
+            Row copy;
+            memcpy(static_cast<void*>(&copy), &regret_minimizers[idx], sizeof(Row));
+            copy.reset_locks();
+            return f(copy);
+        }
+
+        // one array per row of the table, filled by get(row, out) on all cores
+        template<typename Get>
+        std::vector<std::array<T, Game::ACTION_MAX_DIM>> gather_rows(Get get) {
+            assert(!paged);
+            std::vector<std::array<T, Game::ACTION_MAX_DIM>> data(Game::NUM_INFO_SETS);
+            parallel::parallel_for(0, Game::NUM_INFO_SETS, [this, &data, &get](long long lo, long long hi) {
+                for(long long i = lo; i < hi; i++) {
+                    with_row(i, [&get, &data, i](Row &row) { get(row, data[i]); });
+                }
+            });
+            return data;
+        }
+
+        void collect_dirty_rows(std::vector<int64_t> &rows, std::vector<char> &bytes) {
+            rows = dirty_rows->take();
+            bytes.resize(rows.size() * sizeof(Row));
+            parallel::parallel_for(0, rows.size(), [this, &rows, &bytes](long long lo, long long hi) {
+                for(long long i = lo; i < hi; i++) {
+                    memcpy(bytes.data() + i * sizeof(Row), static_cast<const void*>(&regret_minimizers[rows[i]]), sizeof(Row));
+                }
+            });
+        }
+
+        delta::DeltaHeader delta_header(uint64_t iterations) {
+            delta::DeltaHeader header;
+            header.element_bytes = sizeof(Row);
+            header.table_size = Game::NUM_INFO_SETS;
+            header.iterations = iterations;
+            header.tag = regret_minimizers.file_backed() ? store_tag() : 0;
+            return header;
+        }
+
         // later put & back for game state... for now we remove it to make simplification 
         T episode(ComputeMemo &memo, const Game state, const Player player, const T reach_me=1.0, const T reach_other=1.0, const T reach_sample=1.0) {
             // std::cout << "entering " << " cur player is " << state.current_player() << std::endl;
@@ -297,6 +790,7 @@ namespace mccfr_es {
             // later put locks here if we are doing parallelism
             regret_minimizers[info_set_idx].set_dim(num_actions); // sets the dimension if you are visiting the regret minimizer for the first time
             regret_minimizers[info_set_idx].next_policy(policy); // gets the policy
+            mark_dirty(info_set_idx); // the baselines are updated on every visit
 
             Utility baseline_values;
             regret_minimizers[info_set_idx].get_baselines(baseline_values);
@@ -369,6 +863,172 @@ namespace mccfr_es {
             return value_estimate;
         }
 
+        // interleaved outcome sampling: the recursion of episode() unrolled into an explicit path.
+        // the forward pass samples down to a terminal, the backward pass does the updates of the recursion in reverse
+        struct Frame {
+            int info_set_idx;
+            Player cur_player;
+            int num_actions;
+            int action_idx;
+            Buffer policy;
+            Buffer sample_policy;
+            BufferInt actions;
+            Utility baseline_values;
+            T reach_me, reach_other, reach_sample;
+        };
+
+        struct InFlightEpisode {
+            Game state;
+            Player player;
+            T reach_me, reach_other, reach_sample;
+            std::vector<Frame> path;
+            int next_info_set_idx; // row the next forward step needs, -1 at chance nodes
+            T value; // value of the subtree below the current frame during the backward pass
+
+            InFlightEpisode(Player player): player(player), reach_me(1.0), reach_other(1.0), reach_sample(1.0), next_info_set_idx(-1), value(0) {}
+        };
+
+        void prefetch_row(int info_set_idx) {
+            if(paged) {
+                paged->prefetch(info_set_idx); // read-ahead from disk, the row is acquired in forward_step
+                return;
+            }
+            const char *row = reinterpret_cast<const char*>(&regret_minimizers[info_set_idx]);
+            for(size_t offset = 0; offset < sizeof(RegretMinimizer<Game::ACTION_MAX_DIM>); offset += 64) {
+                __builtin_prefetch(row + offset, 1, 3);
+            }
+        }
+
+        void run_interleaved(ComputeMemo &memo, std::vector<InFlightEpisode> &group) {
+            // forward: every round resolves the next infoset of all running episodes, prefetches them, then steps them
+            std::vector<InFlightEpisode*> running;
+            for(auto &ep: group) {
+                if(!ep.state.is_terminal())
+                    running.push_back(&ep);
+            }
+            while(!running.empty()) {
+                for(auto *ep: running) {
+                    ep->next_info_set_idx = ep->state.is_chance() ? -1 : ep->state.info_set_idx();
+                    if(ep->next_info_set_idx != -1)
+                        prefetch_row(ep->next_info_set_idx);
+                }
+                int still_running = 0;
+                for(auto *ep: running) {
+                    forward_step(memo, *ep);
+                    if(!ep->state.is_terminal())
+                        running[still_running++] = ep;
+                }
+                running.resize(still_running);
+            }
+
+            // backward: same lockstep, one frame per episode per round, deepest frames first
+            std::vector<InFlightEpisode*> unwinding;
+            for(auto &ep: group) {
+                ep.value = ep.state.utility(ep.player);
+                if(!ep.path.empty())
+                    unwinding.push_back(&ep);
+            }
+            while(!unwinding.empty()) {
+                for(auto *ep: unwinding) {
+                    prefetch_row(ep->path.back().info_set_idx);
+                }
+                int still_unwinding = 0;
+                for(auto *ep: unwinding) {
+                    backward_step(*ep);
+                    if(!ep->path.empty())
+                        unwinding[still_unwinding++] = ep;
+                }
+                unwinding.resize(still_unwinding);
+            }
+        }
+
+        // the part of episode() before the recursive call
+        void forward_step(ComputeMemo &memo, InFlightEpisode &ep) {
+            const Game &state = ep.state;
+            int num_actions = state.num_actions();
+
+            if(state.is_chance()) {
+                Buffer probs;
+                BufferInt actions;
+                state.actions(actions);
+                state.action_probs(probs);
+                int action_idx = memo.sample_index(probs, num_actions);
+                ep.reach_other *= probs[action_idx];
+                ep.reach_sample *= probs[action_idx];
+                ep.state.step(actions[action_idx]);
+                return;
+            }
+
+            ep.path.emplace_back();
+            Frame &frame = ep.path.back();
+            frame.info_set_idx = ep.next_info_set_idx;
+            frame.cur_player = state.current_player();
+            frame.num_actions = num_actions;
+            frame.reach_me = ep.reach_me;
+            frame.reach_other = ep.reach_other;
+            frame.reach_sample = ep.reach_sample;
+            state.actions(frame.actions);
+
+            auto &rm = paged ? paged->acquire(frame.info_set_idx) : regret_minimizers[frame.info_set_idx]; // released in backward_step
+            if(paged && int(ep.path.size()) <= pin_depth)
+                paged->make_permanent(frame.info_set_idx);
+            rm.set_dim(num_actions);
+            rm.next_policy(frame.policy);
+            rm.get_baselines(frame.baseline_values);
+
+            for(int i = 0; i < num_actions; i++) {
+                frame.sample_policy[i] = frame.cur_player == ep.player
+                    ? EXPLORATION / num_actions + (1.0 - EXPLORATION) * frame.policy[i]
+                    : frame.policy[i];
+            }
+            frame.action_idx = memo.sample_index(frame.sample_policy, num_actions);
+
+            ep.reach_sample *= frame.sample_policy[frame.action_idx];
+            if(frame.cur_player == ep.player) {
+                ep.reach_me *= frame.policy[frame.action_idx];
+            } else {
+                ep.reach_other *= frame.policy[frame.action_idx];
+            }
+            ep.state.step(frame.actions[frame.action_idx]);
+        }
+
+        // the part of episode() after the recursive call, ep.value is the value returned by the child
+        void backward_step(InFlightEpisode &ep) {
+            const Frame &frame = ep.path.back();
+            const Player player = ep.player;
+            auto &rm = paged ? paged->pinned(frame.info_set_idx) : regret_minimizers[frame.info_set_idx];
+            mark_dirty(frame.info_set_idx);
+
+            Utility utility;
+            Utility baseline_update;
+            T value_estimate = 0;
+            for(int i = 0; i < frame.num_actions; i++) {
+                // Zero-sum game hack
+                const T baseline = frame.cur_player == player ? frame.baseline_values[i] : -frame.baseline_values[i];
+                T child_value = (
+                    (frame.action_idx == i)
+                    ? (baseline + (ep.value - baseline) / frame.sample_policy[frame.action_idx])
+                    : (baseline)
+                );
+                utility[i] = child_value * frame.reach_other / frame.reach_sample;
+                baseline_update[i] = frame.cur_player == player ? child_value : -child_value;
+                value_estimate += child_value * frame.policy[i];
+            }
+            rm.update_baselines(baseline_update);
+
+            if(frame.cur_player == player) {
+                rm.observe_utility(utility, frame.policy);
+                for(int i = 0; i < frame.num_actions; i++) {
+                    T increment = frame.reach_me * frame.policy[i] / frame.reach_sample;
+                    rm.increment_avg_policy(frame.actions[i], increment);
+                }
+            }
+            ep.value = value_estimate;
+            if(paged)
+                paged->release(frame.info_set_idx);
+            ep.path.pop_back();
+        }
+
     T external_episode(ComputeMemo &memo, const Game state, const Player player, const T reach_me=1.0, const T reach_other=1.0, const T reach_sample=1.0) {
             // std::cout << "entering " << " cur player is " << state.current_player() << std::endl;
             // std::cout << state << std::endl;
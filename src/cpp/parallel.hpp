@@ -0,0 +1,41 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "topology.hpp"
+
+namespace parallel {
+    inline int default_num_threads() {
+        return std::max(1, int(topology::usable_cpus().size()));
+    }
+
+    // splits [begin, end) into one contiguous chunk per thread and calls fn(lo, hi) on each of them.
+    // the calling thread takes the first chunk
+    template<typename Fn>
+    static void parallel_for(long long begin, long long end, Fn fn, int num_threads = -1) {
+        if(num_threads <= 0)
+            num_threads = default_num_threads();
+        long long n = end - begin;
+        if(n <= 0)
+            return;
+        num_threads = int(std::min<long long>(num_threads, n));
+        long long chunk = (n + num_threads - 1) / num_threads;
+
+        std::vector<std::thread> threads;
+        for(int t = 1; t < num_threads; t++) {
+            long long lo = begin + t * chunk;
+            long long hi = std::min(end, lo + chunk);
+            if(lo >= hi)
+                break;
+            threads.emplace_back([&fn, lo, hi]() { fn(lo, hi); });
+        }
+        fn(begin, std::min(end, begin + chunk));
+        for(auto &t: threads) {
+            t.join();
+        }
+    }
+} // namespace parallel
+
+#endif
@@ -7,7 +7,13 @@
 #include <cstring>
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <stdexcept>
 #include "io.hpp"
+#include "kernels.hpp"
+#include "strategy.hpp"
 #include <filesystem>
 #include <string>
 #include "paths.hpp"
@@ -16,9 +22,36 @@
 namespace pttt {
     using PTTT_Infoset = std::pair<std::string, uint32_t>; // name, valid mask
 
+    // order of the infoset indices inside the regret tables.
+    // CANONICAL is the line order of the infoset files, which is also the order of every exported checkpoint.
+    // DFS sorts the infosets by move prefix so that the infosets along one trajectory are close to each other,
+    // DEPTH_MAJOR packs the (hot) shallow infosets together at the front of each player's range.
+    enum class InfosetLayout { CANONICAL, DFS, DEPTH_MAJOR };
+
+    inline std::string layout_name(InfosetLayout layout) {
+        switch(layout) {
+            case InfosetLayout::DFS: return "dfs";
+            case InfosetLayout::DEPTH_MAJOR: return "depth";
+            default: return "canonical";
+        }
+    }
+
+    inline InfosetLayout layout_from_name(const std::string &name) {
+        if(name == "dfs")
+            return InfosetLayout::DFS;
+        if(name == "depth")
+            return InfosetLayout::DEPTH_MAJOR;
+        if(name != "canonical")
+            throw std::invalid_argument("unknown infoset layout " + name + " (canonical, dfs or depth)");
+        return InfosetLayout::CANONICAL;
+    }
+
+    template<int LANES> class PTTTBatch;
+
     class PTTT {
     public:
         using Player = pttt::Player;
+        template<int LANES> using Batch = PTTTBatch<LANES>;
     private:
         PTTTDynamics game_;
         bool done = false;
@@ -30,6 +63,8 @@ namespace pttt {
         static constexpr int ACTION_MAX_DIM = 9;
         static constexpr int NUM_INFO_SETS = 14482810 + 8827459; // later figure out a way to compute this, or at least confirm that this is correct...
         static constexpr int NUM_PLAYERS = 2;
+        // decisions on the longest path, at most: a player never tries the same cell twice
+        static constexpr int MAX_DECISIONS = 18;
 
         using T = double;
         // using Player = pttt::Player;
@@ -118,6 +153,7 @@ namespace pttt {
         }
 
         friend std::ostream& operator<<(std::ostream& os, const PTTT& game);
+        template<int LANES> friend class PTTTBatch;
 
     private:
 
@@ -142,9 +178,97 @@ namespace pttt {
             std::cout << "done " << filename << std::endl;
         }
 
+        static std::vector<int> compute_layout(int p) {
+            const auto &reprs = info_sets_reprs_p[p];
+            std::vector<int> order(reprs.size());
+            for(int i = 0; i < order.size(); i++) {
+                order[i] = i;
+            }
+            if(layout == InfosetLayout::DFS) {
+                // a prefix sorts before its extensions, so this is the preorder of the move tree
+                std::sort(order.begin(), order.end(), [&reprs](int a, int b) {
+                    return reprs[a].first < reprs[b].first;
+                });
+            } else if(layout == InfosetLayout::DEPTH_MAJOR) {
+                std::sort(order.begin(), order.end(), [&reprs](int a, int b) {
+                    if(reprs[a].first.size() != reprs[b].first.size())
+                        return reprs[a].first.size() < reprs[b].first.size();
+                    return reprs[a].first < reprs[b].first;
+                });
+            }
+            return order;
+        }
+
+        // every index in [0, order.size()) exactly once
+        static bool is_permutation(const std::vector<int> &order) {
+            std::vector<bool> seen(order.size(), false);
+            for(int c: order) {
+                if(c < 0 || c >= int(order.size()) || seen[c])
+                    return false;
+                seen[c] = true;
+            }
+            return true;
+        }
+
+        static std::string layout_path(int p) {
+            return paths::get_data_dir() / ("player" + std::to_string(p) + "-infoset-" + layout_name(layout) + ".perm");
+        }
+
+        // sorting 23M strings takes a while, so the permutation is kept next to the infoset files.
+        // a file that is not a permutation of this player's infosets is recomputed
+        static std::vector<int> load_or_compute_layout(int p) {
+            std::string path = layout_path(p);
+            int64_t count = 0;
+            std::ifstream in(path, std::ios::binary);
+            if(in.read(reinterpret_cast<char*>(&count), sizeof(count)) && count == (int64_t)info_sets_reprs_p[p].size()) {
+                std::vector<int> order(count);
+                if(in.read(reinterpret_cast<char*>(order.data()), count * sizeof(int)) && is_permutation(order)) {
+                    std::cout << "loaded infoset layout " << path << std::endl;
+                    return order;
+                }
+            }
+            std::cout << "computing infoset layout " << layout_name(layout) << " for player " << p << std::endl;
+            std::vector<int> order = compute_layout(p);
+            std::ofstream out(path, std::ios::binary);
+            count = order.size();
+            out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            out.write(reinterpret_cast<const char*>(order.data()), count * sizeof(int));
+            return order;
+        }
+
+        // reorders info_sets_reprs_p into the selected layout and remembers where every infoset came from
+        static void apply_layout() {
+            canonical_idx.clear();
+            if(layout == InfosetLayout::CANONICAL)
+                return;
+            canonical_idx.reserve(NUM_INFO_SETS);
+            int offset = 0;
+            for(int p = 0; p < 2; p++) {
+                std::vector<int> order = load_or_compute_layout(p);
+                std::vector<PTTT_Infoset> reordered;
+                reordered.reserve(order.size());
+                for(int c: order) {
+                    reordered.push_back(std::move(info_sets_reprs_p[p][c]));
+                    canonical_idx.push_back(offset + c);
+                }
+                info_sets_reprs_p[p].swap(reordered);
+                offset += info_sets_reprs_p[p].size();
+            }
+        }
+
         static void precompute() {
             load_information_sets(pttt::get_player0_infoset_path(), info_sets_reprs_p[0]);
             load_information_sets(pttt::get_player1_infoset_path(), info_sets_reprs_p[1]);
+            apply_layout();
+
+            // the masks alone, get_strategy would otherwise walk the 23M strings
+            valid_masks.clear();
+            valid_masks.reserve(NUM_INFO_SETS);
+            for(int p = 0; p < 2; p++) {
+                for(auto &repr: info_sets_reprs_p[p]) {
+                    valid_masks.push_back(repr.second);
+                }
+            }
 
             for(int i = 0; i < info_sets_reprs_p[0].size(); i++) {
                 info_set_to_idx[0][info_sets_reprs_p[0][i]] = i;
@@ -157,41 +281,89 @@ namespace pttt {
         }
 
     public:
-        static std::vector<std::array<T, ACTION_MAX_DIM>> get_strategy(const std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
-            std::vector<std::array<T, ACTION_MAX_DIM>> result(NUM_INFO_SETS);
+        // has to be called before precompute_if_needed(), i.e. before the first PTTT object is created
+        static void set_infoset_layout(InfosetLayout layout_) {
+            assert(!precomputed || layout_ == layout);
+            layout = layout_;
+        }
 
-            // TODO: note one needs to assign average strategy to the nodes have value 0!
-            // ugly ugly code... :D
-            int idx = 0;
-            for(int p = 0; p < 2; p++) {
-                for(int i = 0; i < info_sets_reprs_p[p].size(); i++, idx++) {
-                    result[idx] = average_policy[idx];
-                    T sm = 0;
-                    for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                        sm += average_policy[idx][j];
-                    }
-                    if (sm <= 1e-9) {
-                        // assign uniform distribution
-                        auto mask = info_sets_reprs_p[p][i].second;
-                        int num_valid_actions = __builtin_popcount(mask);
-                        sm = num_valid_actions;
-                        for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                            if(mask & (1<<j))
-                                result[idx][j] = 1.0;
-                        }
-                    }
-                    for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                        result[idx][j] /= sm;
-                    }
-                }
+        static InfosetLayout get_infoset_layout() {
+            return layout;
+        }
+
+        // the infosets of player 0 come first in every layout
+        static int info_set_player(int idx) {
+            return idx < int(info_sets_reprs_p[0].size()) ? 0 : 1;
+        }
+
+        // number of own moves before the infoset ("|" followed by (move, observation) pairs)
+        static int info_set_depth(int idx) {
+            int p = info_set_player(idx);
+            return info_sets_reprs_p[p][idx - (p ? info_sets_reprs_p[0].size() : 0)].first.size() / 2;
+        }
+
+        // maps an index of the regret tables to the line order of the infoset files
+        static int canonical_info_set_idx(int idx) {
+            return canonical_idx.empty() ? idx : canonical_idx[idx];
+        }
+
+        template<typename Row>
+        static std::vector<Row> to_canonical_order(const std::vector<Row> &rows) {
+            if(canonical_idx.empty())
+                return rows;
+            std::vector<Row> result(rows.size());
+            for(int i = 0; i < rows.size(); i++) {
+                result[canonical_idx[i]] = rows[i];
             }
             return result;
         }
 
+        template<typename Row>
+        static std::vector<Row> from_canonical_order(const std::vector<Row> &rows) {
+            if(canonical_idx.empty())
+                return rows;
+            std::vector<Row> result(rows.size());
+            for(int i = 0; i < rows.size(); i++) {
+                result[i] = rows[canonical_idx[i]];
+            }
+            return result;
+        }
+
+        // the actions a strategy is uniform over at an infoset that was never reached
+        static uint32_t info_set_action_mask(long long idx) {
+            return valid_masks[idx];
+        }
+
+        // normalized average policy, uniform over the valid actions of the infosets that were never reached
+        static std::vector<std::array<T, ACTION_MAX_DIM>> get_strategy(const std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
+            precompute_if_needed();
+            assert(average_policy.size() == NUM_INFO_SETS);
+            std::vector<std::array<T, ACTION_MAX_DIM>> result(NUM_INFO_SETS);
+            kernels::normalize(average_policy.data(), result.data(), NUM_INFO_SETS, info_set_action_mask);
+            return result;
+        }
+
+        // a checkpoint (save_strategy_to_file) mapped instead of loaded, rows are read through the page cache as the
+        // evaluators ask for them
+        static auto checkpoint_view(const std::string &name) {
+            precompute_if_needed();
+            auto p0 = std::make_shared<io::MappedNpy<T>>(paths::get_checkpoints_dir() / (name + "_p0.npy"));
+            auto p1 = std::make_shared<io::MappedNpy<T>>(paths::get_checkpoints_dir() / (name + "_p1.npy"));
+            long long split = info_sets_reprs_p[0].size();
+            if(p0->rows() != split || p1->rows() != NUM_INFO_SETS - split || p0->cols() != ACTION_MAX_DIM || p1->cols() != ACTION_MAX_DIM)
+                throw std::runtime_error("checkpoint " + name + " does not match the infosets");
+            return strategy::make_view<PTTT>([p0, p1, split](long long idx, std::array<T, ACTION_MAX_DIM> &out) {
+                long long c = canonical_info_set_idx(idx);
+                const T *row = c < split ? p0->row(c) : p1->row(c - split);
+                std::copy(row, row + ACTION_MAX_DIM, out.begin());
+            });
+        }
+
         static void save_strategy_to_file(const std::string &name, const std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
             precompute_if_needed();
 
-            std::vector<std::array<T, ACTION_MAX_DIM>> policy = get_strategy(average_policy);
+            // checkpoints are always written in the canonical order
+            std::vector<std::array<T, ACTION_MAX_DIM>> policy = to_canonical_order(get_strategy(average_policy));
             
             assert(policy.size() == NUM_INFO_SETS);
 
@@ -211,22 +383,26 @@ namespace pttt {
 
             std::vector<std::array<T, ACTION_MAX_DIM>>::iterator it1 = average_policy.begin();
             std::vector<std::array<T, ACTION_MAX_DIM>>::iterator it2 = it1 + info_sets_reprs_p[0].size();
+            std::vector<std::array<T, ACTION_MAX_DIM>>::iterator it3 = average_policy.end();
 
-            io::load_from_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_p0.npy"), it1);
-            io::load_from_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_p1.npy"), it2);
+            io::load_from_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_p0.npy"), it1, it2);
+            io::load_from_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_p1.npy"), it2, it3);
+            average_policy = from_canonical_order(average_policy);
         }
 
         // todo later make the type generic
         template<typename T>
         static void save_state_from_file(const std::string &name, std::vector<std::array<T, ACTION_MAX_DIM>> &state) {
             precompute_if_needed();
-            io::save_to_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_state.npy"), state.begin(), state.end());
+            std::vector<std::array<T, ACTION_MAX_DIM>> canonical_state = to_canonical_order(state);
+            io::save_to_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_state.npy"), canonical_state.begin(), canonical_state.end());
         }
 
         static void load_state_from_file(const std::string &name, std::vector<std::array<T, ACTION_MAX_DIM>> &state) {
             precompute_if_needed();
 
-            io::load_from_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_state.npy"), state.begin());
+            io::load_from_numpy<T, ACTION_MAX_DIM>(paths::get_checkpoints_dir() / (name + "_state.npy"), state.begin(), state.end());
+            state = from_canonical_order(state);
         }
 
         static void precompute_if_needed() {
@@ -236,11 +412,43 @@ namespace pttt {
             precomputed = true;
         }
 
+        // identifies what the infoset indices of the current layout mean, for files keyed on them (the eval::Treeplex
+        // cache): the layout and the size and modification time of the infoset files and of the permutation files.
+        // regenerating any of those gives another fingerprint. bump FORMAT when the indices change in another way
+        static uint64_t layout_fingerprint() {
+            constexpr uint64_t FORMAT = 1;
+            precompute_if_needed(); // writes the permutation files if they are missing
+            uint64_t hash = 14695981039346656037ull; // fnv-1a over the bytes of the fields
+            auto add = [&hash](uint64_t value) {
+                for(int i = 0; i < 8; i++) {
+                    hash ^= (value >> (8 * i)) & 0xff;
+                    hash *= 1099511628211ull;
+                }
+            };
+            add(FORMAT);
+            add(uint64_t(layout));
+            add(NUM_INFO_SETS);
+            std::vector<std::string> files{pttt::get_player0_infoset_path(), pttt::get_player1_infoset_path()};
+            if(layout != InfosetLayout::CANONICAL) {
+                files.push_back(layout_path(0));
+                files.push_back(layout_path(1));
+            }
+            for(auto &file: files) {
+                add(std::filesystem::file_size(file));
+                add(std::filesystem::last_write_time(file).time_since_epoch().count());
+            }
+            return hash;
+        }
+
     private:
         
         static std::vector<PTTT_Infoset> info_sets_reprs_p[2];
         static std::map<PTTT_Infoset, int> info_set_to_idx[2];
 
+        static InfosetLayout layout;
+        static std::vector<int> canonical_idx; // empty for the canonical layout
+        static std::vector<uint32_t> valid_masks; // per table row, in the layout order
+
         // todo later add the ability to load from the last checkpoint...
         // warmstart the regret minimizers...
 
@@ -254,9 +462,136 @@ namespace pttt {
 
     std::vector<PTTT_Infoset> PTTT::info_sets_reprs_p[PTTT::NUM_PLAYERS] = {{}, {}};
     std::map<PTTT_Infoset, int> PTTT::info_set_to_idx[PTTT::NUM_PLAYERS] = {{}, {}};
+    InfosetLayout PTTT::layout = InfosetLayout::CANONICAL;
+    std::vector<int> PTTT::canonical_idx;
+    std::vector<uint32_t> PTTT::valid_masks;
 
     const std::array<Player, PTTT::NUM_PLAYERS> PTTT::players = {Player::P1, Player::P2};
 
+    // LANES games of PTTT in lockstep on top of PTTTDynamicsBatch. finished lanes stay idle until they are refilled with
+    // reset_lane (possible whenever it is P1's turn) or until all of them are done.
+    // keeping the infoset strings is the expensive part, pass track_info_sets=false if info_set_idx is never needed
+    template<int LANES>
+    class PTTTBatch {
+    public:
+        using T = PTTT::T;
+        using ActionInts = PTTT::ActionInts;
+
+    private:
+        PTTTDynamicsBatch<LANES> game_;
+        bool done[LANES];
+        bool tie[LANES];
+        Player winner[LANES];
+        int num_running;
+        bool track_info_sets;
+        PTTT_Infoset info_set_repr[LANES][2];
+
+    public:
+        // only the first active_lanes lanes start a game, the others start out finished
+        PTTTBatch(bool track_info_sets = true, int active_lanes = LANES): track_info_sets(track_info_sets) {
+            if(track_info_sets) {
+                PTTT::precompute_if_needed();
+            }
+            num_running = 0;
+            for(int lane = 0; lane < LANES; lane++) {
+                done[lane] = tie[lane] = true;
+                if(lane < active_lanes) {
+                    reset_lane(lane);
+                }
+            }
+        }
+
+        void reset_lane(int lane) {
+            game_.reset_lane(lane);
+            if(done[lane])
+                num_running++;
+            done[lane] = tie[lane] = false;
+            winner[lane] = Player::P1;
+            for(int p = 0; p < 2; p++) {
+                info_set_repr[lane][p] = PTTT_Infoset("|", (1<<PTTT_NUM_ACTIONS)-1);
+            }
+        }
+
+        bool all_terminal() const {
+            return num_running == 0;
+        }
+
+        bool is_terminal(int lane) const {
+            return done[lane];
+        }
+
+        T utility(int lane, Player player) const {
+            assert(done[lane]);
+            if(tie[lane])
+                return 0;
+            return winner[lane] == player ? 1 : -1;
+        }
+
+        inline Player current_player() const {
+            return game_.current_player();
+        }
+
+        // valid action masks of the current player, 0 for finished lanes
+        void valid_action_mask_many(Actions *out) const {
+            game_.valid_action_mask_many(out);
+            for(int lane = 0; lane < LANES; lane++) {
+                if(done[lane])
+                    out[lane] = 0;
+            }
+        }
+
+        // same order as PTTT::actions
+        static int actions_from_mask(Actions mask, ActionInts &buffer) {
+            int cnt = 0;
+            while(mask) {
+                Action action = mask & -mask;
+                mask -= action;
+                buffer[cnt++] = ACTION_MASK_TO_INT(action);
+            }
+            return cnt;
+        }
+
+        int info_set_idx(int lane) const {
+            assert(track_info_sets);
+            auto idx = PlayerIdx(current_player());
+            auto it = PTTT::info_set_to_idx[idx].find(info_set_repr[lane][idx]);
+            assert(it != PTTT::info_set_to_idx[idx].end());
+            return it->second;
+        }
+
+        // actions[lane] is an action index of the current player, ignored for finished lanes
+        void step_many(const ActionInt *actions) {
+            Player cur_player = current_player();
+            int me = PlayerIdx(cur_player);
+            Action masks[LANES];
+            uint32_t success[LANES], won[LANES], full[LANES];
+            for(int lane = 0; lane < LANES; lane++) {
+                masks[lane] = done[lane] ? 0 : ACTION_INT_TO_MASK(cur_player, actions[lane]);
+            }
+            game_.step_many(masks, success);
+            game_.has_won_many(cur_player, won);
+            game_.board_fully_occupied_many(full);
+            for(int lane = 0; lane < LANES; lane++) {
+                if(done[lane])
+                    continue;
+                if(won[lane]) {
+                    done[lane] = true;
+                    winner[lane] = cur_player;
+                } else if(full[lane]) {
+                    done[lane] = true;
+                    tie[lane] = true;
+                }
+                num_running -= done[lane];
+                if(track_info_sets) {
+                    auto &repr = info_set_repr[lane][me];
+                    repr.first += char('0' + actions[lane]);
+                    repr.first += success[lane] ? '*' : '.';
+                    repr.second &= ~(1 << actions[lane]);
+                }
+            }
+        }
+    };
+
     std::ostream& operator<<(std::ostream& os, const PTTT& game) {
         os << game.game_;
         return os;
@@ -7,6 +7,9 @@
 #include <cstring>
 #include <vector>
 #include <array>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 
 namespace pttt
@@ -155,10 +158,204 @@ namespace pttt
         }
 
         friend std::ostream& operator<<(std::ostream& os, const PTTTDynamics& game);
+        template<int LANES> friend class PTTTDynamicsBatch;
     };
     bool PTTTDynamics::precomputed = false;
     bool PTTTDynamics::win_mask[(1<<(GRID_SIZE*GRID_SIZE))];    
 
+    ////////////////////////////////////////////////////////////////
+    // structure of arrays version of PTTTDynamics: LANES independent games advanced in lockstep.
+    // a failed move also passes the turn, so all lanes alternate together and share the current player.
+    // occupied[p] is kept in the 2-bit cell layout (the bit of p's mark for every cell p owns) so that no ctz is needed
+    // in step_many, it gets compressed back to the 9-bit win_mask index in has_won_many.
+    // there are explicit AVX-512 (LANES % 16 == 0) and AVX2 paths, the scalar fallback is written to auto-vectorize.
+
+    // even bits of x (the P1 bits of the 2-bit layout) -> 9-bit cell mask
+    inline uint32_t compress_cells(uint32_t x) {
+        x &= ALL_P1;
+        x = (x | (x >> 1)) & 0x33333333;
+        x = (x | (x >> 2)) & 0x0F0F0F0F;
+        x = (x | (x >> 4)) & 0x00FF00FF;
+        x = (x | (x >> 8)) & 0x0000FFFF;
+        return x;
+    }
+
+    template<int LANES>
+    class PTTTDynamicsBatch {
+        static_assert(LANES % 8 == 0, "LANES has to be a multiple of 8");
+
+    public:
+        alignas(64) StateObservation obs_player[2][LANES];
+        alignas(64) uint32_t occupied[2][LANES];
+        Player cur_player = Player::P1;
+
+        PTTTDynamicsBatch() {
+            reset();
+        }
+
+        void reset() {
+            memset(obs_player, 0, sizeof(obs_player));
+            memset(occupied, 0, sizeof(occupied));
+            cur_player = Player::P1;
+        }
+
+        // starts a new game in one lane. only valid when it is P1's turn, since all lanes share the turn
+        void reset_lane(int lane) {
+            assert(cur_player == Player::P1);
+            obs_player[0][lane] = obs_player[1][lane] = 0;
+            occupied[0][lane] = occupied[1][lane] = 0;
+        }
+
+        inline Player current_player() const {
+            return cur_player;
+        }
+
+        // valid action masks of the current player, same as valid_action_mask(cur_player, obs) for every lane
+        void valid_action_mask_many(Actions *out) const {
+            const uint32_t *obs = obs_player[PlayerIdx(cur_player)];
+            const uint32_t mask = (cur_player == Player::P1) ? ALL_P1 : ALL_P2;
+            int lane = 0;
+#if defined(__AVX512F__)
+            if(LANES % 16 == 0) {
+                const __m512i p1 = _mm512_set1_epi32(ALL_P1), p2 = _mm512_set1_epi32(ALL_P2), m = _mm512_set1_epi32(mask);
+                for(; lane < LANES; lane += 16) {
+                    __m512i st = _mm512_load_si512(obs + lane);
+                    __m512i occ = _mm512_or_si512(st, _mm512_or_si512(
+                        _mm512_slli_epi32(_mm512_and_si512(st, p1), 1),
+                        _mm512_srli_epi32(_mm512_and_si512(st, p2), 1)));
+                    _mm512_storeu_si512(out + lane, _mm512_andnot_si512(occ, m));
+                }
+            }
+#endif
+#if defined(__AVX2__)
+            const __m256i p1 = _mm256_set1_epi32(ALL_P1), p2 = _mm256_set1_epi32(ALL_P2), m = _mm256_set1_epi32(mask);
+            for(; lane < LANES; lane += 8) {
+                __m256i st = _mm256_load_si256(reinterpret_cast<const __m256i*>(obs + lane));
+                __m256i occ = _mm256_or_si256(st, _mm256_or_si256(
+                    _mm256_slli_epi32(_mm256_and_si256(st, p1), 1),
+                    _mm256_srli_epi32(_mm256_and_si256(st, p2), 1)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + lane), _mm256_andnot_si256(occ, m));
+            }
+#endif
+            for(; lane < LANES; lane++) {
+                uint32_t occ = obs[lane] | ((obs[lane] & ALL_P1) << 1) | ((obs[lane] & ALL_P2) >> 1);
+                out[lane] = ~occ & mask;
+            }
+        }
+
+        // actions[lane] is a single action mask of the current player, or 0 to leave the lane alone (finished games).
+        // success[lane] is 1 if the move was placed, 0 if the cell was taken (or the lane was idle).
+        // the turn passes in all lanes
+        void step_many(const Action *actions, uint32_t *success) {
+            const int me = PlayerIdx(cur_player);
+            const int opp = 1 - me;
+            const bool shift_left = cur_player == Player::P1; // moves the action bit onto the opponent's bit of the same cell
+            uint32_t *obs_me = obs_player[me];
+            uint32_t *occ_me = occupied[me];
+            const uint32_t *obs_opp = obs_player[opp];
+            int lane = 0;
+#if defined(__AVX512F__)
+            if(LANES % 16 == 0) {
+                const __m512i zero = _mm512_setzero_si512();
+                for(; lane < LANES; lane += 16) {
+                    __m512i a = _mm512_loadu_si512(actions + lane);
+                    __m512i changed = shift_left ? _mm512_slli_epi32(a, 1) : _mm512_srli_epi32(a, 1);
+                    __m512i hit = _mm512_and_si512(_mm512_load_si512(obs_opp + lane), changed);
+                    __mmask16 free_cell = _mm512_cmpeq_epi32_mask(hit, zero);
+                    __mmask16 placed = free_cell & _mm512_cmpneq_epi32_mask(a, zero);
+                    __m512i seen = _mm512_mask_blend_epi32(free_cell, changed, a);
+                    _mm512_store_si512(obs_me + lane, _mm512_or_si512(_mm512_load_si512(obs_me + lane), seen));
+                    _mm512_store_si512(occ_me + lane, _mm512_mask_or_epi32(_mm512_load_si512(occ_me + lane), placed, _mm512_load_si512(occ_me + lane), a));
+                    _mm512_storeu_si512(success + lane, _mm512_maskz_set1_epi32(placed, 1));
+                }
+            }
+#endif
+#if defined(__AVX2__)
+            const __m256i zero = _mm256_setzero_si256();
+            for(; lane < LANES; lane += 8) {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(actions + lane));
+                __m256i changed = shift_left ? _mm256_slli_epi32(a, 1) : _mm256_srli_epi32(a, 1);
+                __m256i hit = _mm256_and_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(obs_opp + lane)), changed);
+                __m256i free_cell = _mm256_cmpeq_epi32(hit, zero);
+                __m256i placed = _mm256_andnot_si256(_mm256_cmpeq_epi32(a, zero), free_cell);
+                __m256i seen = _mm256_blendv_epi8(changed, a, free_cell);
+                __m256i *obs_ptr = reinterpret_cast<__m256i*>(obs_me + lane);
+                __m256i *occ_ptr = reinterpret_cast<__m256i*>(occ_me + lane);
+                _mm256_store_si256(obs_ptr, _mm256_or_si256(_mm256_load_si256(obs_ptr), seen));
+                _mm256_store_si256(occ_ptr, _mm256_or_si256(_mm256_load_si256(occ_ptr), _mm256_and_si256(placed, a)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(success + lane), _mm256_srli_epi32(placed, 31));
+            }
+#endif
+            for(; lane < LANES; lane++) {
+                uint32_t a = actions[lane];
+                uint32_t changed = shift_left ? a << 1 : a >> 1;
+                bool free_cell = (obs_opp[lane] & changed) == 0;
+                bool placed = free_cell && a != 0;
+                obs_me[lane] |= free_cell ? a : changed;
+                occ_me[lane] |= placed ? a : 0;
+                success[lane] = placed;
+            }
+            cur_player = OtherPlayer(cur_player);
+        }
+
+        // out[lane] = 1 if player has three in a row in that lane
+        void has_won_many(Player player, uint32_t *out) const {
+            const uint32_t *table = win_table();
+            const uint32_t *occ = occupied[PlayerIdx(player)];
+            const int shift = player == Player::P1 ? 0 : 1;
+            int lane = 0;
+#if defined(__AVX2__)
+            const __m256i c0 = _mm256_set1_epi32(ALL_P1), c1 = _mm256_set1_epi32(0x33333333), c2 = _mm256_set1_epi32(0x0F0F0F0F),
+                          c3 = _mm256_set1_epi32(0x00FF00FF), c4 = _mm256_set1_epi32(0x0000FFFF);
+            for(; lane < LANES; lane += 8) {
+                __m256i x = _mm256_srli_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(occ + lane)), shift);
+                x = _mm256_and_si256(x, c0);
+                x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 1)), c1);
+                x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 2)), c2);
+                x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 4)), c3);
+                x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 8)), c4);
+                __m256i won = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), x, 4);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + lane), won);
+            }
+#endif
+            for(; lane < LANES; lane++) {
+                out[lane] = table[compress_cells(occ[lane] >> shift)];
+            }
+        }
+
+        // out[lane] = 1 if every cell is taken
+        void board_fully_occupied_many(uint32_t *out) const {
+            for(int lane = 0; lane < LANES; lane++) {
+                out[lane] = (occupied[0][lane] | (occupied[1][lane] >> 1)) == ALL_P1;
+            }
+        }
+
+        // a single lane as a scalar game, mostly for checking the batch against PTTTDynamics
+        PTTTDynamics lane(int idx) const {
+            PTTTDynamics game;
+            game.obs_player[0] = obs_player[0][idx];
+            game.obs_player[1] = obs_player[1][idx];
+            game.player_occupied[0] = compress_cells(occupied[0][idx]);
+            game.player_occupied[1] = compress_cells(occupied[1][idx] >> 1);
+            game.cur_player = cur_player;
+            return game;
+        }
+
+    private:
+        // win_mask as 32 bit ints so that it can be gathered
+        static const uint32_t* win_table() {
+            static const std::array<uint32_t, (1<<NUM_CELLS)> table = []() {
+                PTTTDynamics(); // makes sure win_mask is computed
+                std::array<uint32_t, (1<<NUM_CELLS)> res;
+                for(int mask = 0; mask < (1<<NUM_CELLS); mask++) {
+                    res[mask] = PTTTDynamics::win_mask[mask];
+                }
+                return res;
+            }();
+            return table.data();
+        }
+    };
+
     std::ostream& operator<<(std::ostream& os, const PTTTDynamics& game) {
         os << "Game (Turn=" << (game.cur_player == Player::P1 ? "X" : "O") << ")\n";
         for(int i = 0; i < GRID_SIZE; i++) {
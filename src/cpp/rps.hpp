@@ -10,6 +10,7 @@
 #include <array>
 #include <filesystem>
 #include <string>
+#include "kernels.hpp"
 
 namespace rps {
     class RPS {
@@ -26,6 +27,7 @@ namespace rps {
         static constexpr int ACTION_MAX_DIM = 3;
         static constexpr int NUM_INFO_SETS = 2;
         static constexpr int NUM_PLAYERS = 2;
+        static constexpr int MAX_DECISIONS = 2; // on the longest path
 
         static const std::array<Player, NUM_PLAYERS> players;
 
@@ -99,27 +101,14 @@ namespace rps {
     public:
         static std::vector<std::array<T, ACTION_MAX_DIM>> get_strategy(const std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
             std::vector<std::array<T, ACTION_MAX_DIM>> result(NUM_INFO_SETS);
-            for(int idx = 0; idx < NUM_INFO_SETS; idx++) {
-                result[idx] = average_policy[idx];
-                T sm = 0;
-                for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                    sm += average_policy[idx][j];
-                }
-                if (sm <= 1e-9) {
-                    // assign uniform distribution
-                    int num_valid_actions = ACTION_MAX_DIM;
-                    sm = num_valid_actions;
-                    for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                        result[idx][j] = 1.0;
-                    }
-                }
-                for(int j = 0; j < ACTION_MAX_DIM; j++) {
-                    result[idx][j] /= sm;
-                }
-            }
+            kernels::normalize(average_policy.data(), result.data(), NUM_INFO_SETS, info_set_action_mask);
             return result;
         }
 
+        static uint32_t info_set_action_mask(long long) {
+            return uint32_t(1 << ACTION_MAX_DIM) - 1;
+        }
+
         static void save_strategy_to_file(const std::string &name, std::vector<std::array<T, ACTION_MAX_DIM>> &average_policy) {
             std::cout << "not implemented yet" << std::endl;
         }
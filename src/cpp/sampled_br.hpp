@@ -0,0 +1,296 @@
+#ifndef SAMPLED_BR_HPP
+#define SAMPLED_BR_HPP
+
+// monte carlo estimate of the nash gap for games whose tree is too large for an exact best response (PTTT).
+// per player, in a time budget:
+//   1. build: sample episodes where chance and the opponent follow the strategy and the responder explores (a mix
+//      of uniform and its own strategy). the utility weighted by 1 / (exploration probability of the responder's
+//      actions) is an unbiased estimate of the value of the responder's last sequence. the sampled infosets are then
+//      solved bottom up like a treeplex: every infoset takes the action with the best estimate.
+//   2. evaluate: fresh episodes where the responder plays the chosen actions (its strategy at infosets that were
+//      never sampled) against the strategy.
+// the response of step 1 is a real strategy, so its value is at most the one of the best response: the estimate of
+// step 2 is an unbiased estimate of a lower bound of the gap, with a normal confidence interval around it.
+// the threads sample independently (own rng, own tables) and are merged in thread order
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "parallel.hpp"
+#include "strategy.hpp"
+
+namespace sampled_br {
+    using T = double;
+
+    struct Options {
+        double seconds = 30; // for everything, split over the two players and the two steps
+        double build_fraction = 0.5; // of the time spent in step 1
+        long long max_episodes = 1 << 22; // per player and step, also bounds the memory of the sampled infosets
+        double exploration = 0.6; // weight of uniform in the exploration of the responder
+        double z = 1.96; // confidence interval of +-z standard errors
+        int num_threads = -1; // all usable cpus
+        uint64_t seed = 0;
+    };
+
+    struct PlayerResult {
+        T value = 0; // utility of the sampled response against the strategy
+        T std_error = 0;
+        long long build_episodes = 0;
+        long long eval_episodes = 0;
+        size_t infosets = 0; // sampled infosets of the responder
+    };
+
+    struct Result {
+        std::vector<PlayerResult> players;
+        T gap = 0; // sum of the values, at most the nash gap up to sampling noise
+        T std_error = 0;
+        T lower = 0, upper = 0; // gap -+ z * std_error
+        double seconds = 0;
+    };
+
+    // S is any strategy with row(idx) (strategy::Strategy, strategy::View)
+    template<typename Game, typename S = strategy::Strategy<Game>>
+    class Estimator {
+        using Player = typename Game::Player;
+        using Buffer = std::array<T, Game::ACTION_MAX_DIM>;
+        using Actions = std::array<int, Game::ACTION_MAX_DIM>;
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr long long BATCH = 64; // episodes between two looks at the clock
+
+        struct Node {
+            Buffer value{}; // sum of the weighted utilities of each action, plus the best values of the children
+            std::array<uint32_t, Game::ACTION_MAX_DIM> visits{};
+            int32_t parent = -1; // infoset of the previous decision of the responder
+            uint8_t parent_action = 0;
+            uint8_t num_actions = 0;
+            uint16_t depth = 0; // decisions of the responder before this one
+            Actions actions;
+        };
+        using Table = std::unordered_map<int32_t, Node>;
+
+        const S &strategy;
+        Options options;
+
+        template<typename Rng>
+        static int sample_index(const Buffer &probs, int n, Rng &rng) {
+            T sum = 0;
+            for(int i = 0; i < n; i++) {
+                sum += probs[i];
+            }
+            std::uniform_real_distribution<T> dis(0, 1);
+            if(sum <= 1e-9)
+                return std::min(n - 1, int(dis(rng) * n));
+            T r = dis(rng) * sum, cumulative = 0;
+            for(int i = 0; i < n; i++) {
+                cumulative += probs[i];
+                if(r < cumulative)
+                    return i;
+            }
+            return n - 1;
+        }
+
+        // probabilities of the strategy (or of chance) over the actions of state
+        void policy(const Game &state, const Actions &actions, int n, Buffer &probs) const {
+            if(state.is_chance()) {
+                state.action_probs(probs);
+                return;
+            }
+            const auto &row = strategy.row(state.info_set_idx());
+            for(int i = 0; i < n; i++) {
+                probs[i] = row[actions[i]];
+            }
+        }
+
+        int num_threads() const {
+            return options.num_threads > 0 ? options.num_threads : parallel::default_num_threads();
+        }
+
+        // runs episode(rng, thread) on all threads until the deadline or max_episodes, returns the number of episodes
+        template<typename Episode>
+        long long run(double seconds, Episode episode, uint64_t stream) {
+            auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+            std::atomic<long long> claimed{0};
+            std::atomic<long long> done{0};
+            parallel::parallel_for(0, num_threads(), [&](long long thread, long long) {
+                std::mt19937_64 rng(options.seed * 1000003 + stream * 1009 + thread);
+                // at least one batch each, so that a tiny budget still gives an estimate
+                for(bool first = true; first || Clock::now() < deadline; first = false) {
+                    long long start = claimed.fetch_add(BATCH);
+                    if(start >= options.max_episodes)
+                        break;
+                    long long count = std::min(BATCH, options.max_episodes - start);
+                    for(long long e = 0; e < count; e++) {
+                        episode(rng, thread);
+                    }
+                    done.fetch_add(count);
+                }
+            }, num_threads());
+            return done.load();
+        }
+
+        // step 1, returns the chosen action (strategy column) of every sampled infoset
+        std::unordered_map<int32_t, int> build(Player responder, double seconds, PlayerResult &result) {
+            std::vector<Table> tables(num_threads());
+            result.build_episodes = run(seconds, [&](std::mt19937_64 &rng, long long thread) {
+                Table &table = tables[thread];
+                Game state;
+                T weight = 1; // 1 / probability of the responder's actions
+                int32_t parent = -1;
+                int parent_action = 0;
+                int depth = 0;
+                Actions actions;
+                Buffer probs;
+                while(!state.is_terminal()) {
+                    int n = state.num_actions();
+                    state.actions(actions);
+                    policy(state, actions, n, probs);
+                    int i;
+                    if(state.is_chance() || state.current_player() != responder) {
+                        i = sample_index(probs, n, rng);
+                    } else {
+                        int32_t idx = state.info_set_idx();
+                        auto [it, inserted] = table.try_emplace(idx);
+                        Node &node = it->second;
+                        if(inserted) {
+                            node.parent = parent;
+                            node.parent_action = parent_action;
+                            node.num_actions = n;
+                            node.depth = depth;
+                            node.actions = actions;
+                        }
+                        for(int a = 0; a < n; a++) {
+                            probs[a] = options.exploration / n + (1 - options.exploration) * probs[a];
+                        }
+                        i = sample_index(probs, n, rng);
+                        weight /= probs[i];
+                        node.visits[i]++;
+                        parent = idx;
+                        parent_action = i;
+                        depth++;
+                    }
+                    state.step(actions[i]);
+                }
+                if(parent != -1) // the value of the empty sequence does not depend on the response
+                    table[parent].value[parent_action] += state.utility(responder) * weight;
+            }, 2 * int(responder_index(responder)));
+
+            // merge in thread order, then solve bottom up (deepest first, by infoset for a fixed order)
+            Table merged;
+            for(auto &table: tables) {
+                for(auto &[idx, node]: table) {
+                    auto [it, inserted] = merged.try_emplace(idx, node);
+                    if(inserted)
+                        continue;
+                    for(int a = 0; a < node.num_actions; a++) {
+                        it->second.value[a] += node.value[a];
+                        it->second.visits[a] += node.visits[a];
+                    }
+                }
+                Table().swap(table);
+            }
+            std::vector<std::pair<int, int32_t>> order;
+            order.reserve(merged.size());
+            for(auto &[idx, node]: merged) {
+                order.push_back({-int(node.depth), idx});
+            }
+            std::sort(order.begin(), order.end());
+            std::unordered_map<int32_t, int> choice;
+            choice.reserve(merged.size());
+            for(auto [_, idx]: order) {
+                Node &node = merged[idx];
+                int best = -1;
+                for(int a = 0; a < node.num_actions; a++) {
+                    if(node.visits[a] > 0 && (best == -1 || node.value[best] < node.value[a]))
+                        best = a;
+                }
+                choice[idx] = node.actions[best];
+                if(node.parent != -1)
+                    merged[node.parent].value[node.parent_action] += node.value[best];
+            }
+            result.infosets = choice.size();
+            return choice;
+        }
+
+        // step 2: mean and standard error of the utility of the response
+        void evaluate(Player responder, const std::unordered_map<int32_t, int> &choice, double seconds, PlayerResult &result) {
+            struct alignas(64) Moments {
+                T sum = 0, sum_sq = 0;
+            };
+            std::vector<Moments> moments(num_threads());
+            result.eval_episodes = run(seconds, [&](std::mt19937_64 &rng, long long thread) {
+                Game state;
+                Actions actions;
+                Buffer probs;
+                while(!state.is_terminal()) {
+                    int n = state.num_actions();
+                    state.actions(actions);
+                    if(!state.is_chance() && state.current_player() == responder) {
+                        auto it = choice.find(state.info_set_idx());
+                        if(it != choice.end()) {
+                            state.step(it->second);
+                            continue;
+                        }
+                    }
+                    policy(state, actions, n, probs);
+                    state.step(actions[sample_index(probs, n, rng)]);
+                }
+                T u = state.utility(responder);
+                moments[thread].sum += u;
+                moments[thread].sum_sq += u * u;
+            }, 2 * int(responder_index(responder)) + 1);
+
+            T sum = 0, sum_sq = 0;
+            for(auto &m: moments) {
+                sum += m.sum;
+                sum_sq += m.sum_sq;
+            }
+            long long n = result.eval_episodes;
+            result.value = sum / n;
+            result.std_error = n > 1 ? std::sqrt(std::max(T(0), (sum_sq - sum * sum / n) / (n - 1)) / n) : 0;
+        }
+
+        static int responder_index(Player p) {
+            for(int i = 0; i < Game::NUM_PLAYERS; i++) {
+                if(Game::players[i] == p)
+                    return i;
+            }
+            return 0;
+        }
+
+    public:
+        Estimator(const S &strategy, Options options = {}): strategy(strategy), options(options) {}
+
+        Result estimate() {
+            auto start = Clock::now();
+            Result result;
+            double per_player = options.seconds / Game::NUM_PLAYERS;
+            for(auto p: Game::players) {
+                PlayerResult player_result;
+                auto choice = build(p, per_player * options.build_fraction, player_result);
+                evaluate(p, choice, per_player * (1 - options.build_fraction), player_result);
+                result.players.push_back(player_result);
+                result.gap += player_result.value;
+                result.std_error += player_result.std_error * player_result.std_error;
+            }
+            result.std_error = std::sqrt(result.std_error);
+            result.lower = result.gap - options.z * result.std_error;
+            result.upper = result.gap + options.z * result.std_error;
+            result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            return result;
+        }
+    };
+
+    template<typename Game, typename S>
+    static Result estimate(const S &strategy, Options options = {}) {
+        return Estimator<Game, S>(strategy, options).estimate();
+    }
+} // namespace sampled_br
+
+#endif
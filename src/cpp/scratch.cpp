@@ -98,14 +98,14 @@ int main() {
     // cout << strategy << endl;
     // cout << evaluator_fast.best_response(strategy, Game::Player::P1) << endl;
     mccfr::MCCFR<Game> mccfr;
-    eval::Eval<Game> evaluator;
+    eval::EvalIncremental<Game> evaluator; // only redoes what the last iteration changed
     eval::EvalFast<Game> evaluator_fast;
 
     std::vector<double> gaps;
     std::vector<double> gaps_fast;
     for(int i = 0; i < 500000; i++) {
         mccfr.iteration();
-        strategy::Strategy<Game> strategy = mccfr.get_strategy();
+        auto strategy = Game::get_strategy(mccfr.get_strategy_data());
         auto gap = evaluator.nash_gap(strategy);
         gaps.push_back(gap);
         // auto gap_fast = evaluator_fast.nash_gap(strategy);
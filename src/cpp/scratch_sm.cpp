@@ -91,12 +91,12 @@ int main() {
     using Game = loaded_game::Leduc;
 
     MCCFR<Game> mccfr;
-    eval::Eval<Game> evaluator;
+    eval::EvalIncremental<Game> evaluator; // only redoes what the last iteration changed
 
     std::vector<double> gaps;
     for(int i = 0; i < 500000; i++) {
         mccfr.iteration();
-        strategy::Strategy<Game> strategy = mccfr.get_strategy();
+        auto strategy = Game::get_strategy(mccfr.get_strategy_data());
         auto gap = evaluator.nash_gap(strategy);
         gaps.push_back(gap);
         std::cout << "nash gap: " << gap << std::endl;
@@ -0,0 +1,63 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+// consistent images of the training tables while the workers keep running.
+//
+// PauseBarrier stops all workers between two iterations (no worker holds a row lock there), which is the only point
+// where the tables are not a torn mix of iterations. what happens during the pause has to be short, e.g. flushing and
+// reflinking a file backed store (MCCFR::snapshot_store) or copying out the dirty rows of a delta (MCCFR::save_delta)
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace snapshot {
+    class PauseBarrier {
+        int num_workers;
+        int parked = 0;
+        std::atomic<bool> pause_requested{false}; // read by the workers without taking the mutex
+        std::mutex mtx;
+        std::condition_variable cv;
+        double last_pause_ms = 0;
+
+    public:
+        PauseBarrier(int num_workers): num_workers(num_workers) {}
+
+        // workers call this between iterations, it only blocks while a pause is going on
+        void checkpoint() {
+            if(!pause_requested.load(std::memory_order_acquire))
+                return;
+            std::unique_lock<std::mutex> lock(mtx);
+            parked++;
+            cv.notify_all();
+            cv.wait(lock, [this]() { return !pause_requested; });
+            parked--;
+        }
+
+        // waits until every worker is parked, runs fn and lets them continue
+        template<typename Fn>
+        void while_paused(Fn fn) {
+            auto start = std::chrono::steady_clock::now();
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                pause_requested = true;
+                cv.wait(lock, [this]() { return parked == num_workers; });
+            }
+            fn();
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                pause_requested = false;
+            }
+            cv.notify_all();
+            last_pause_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        // how long the workers were stopped by the last while_paused
+        double last_pause_duration_ms() const {
+            return last_pause_ms;
+        }
+    };
+} // namespace snapshot
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef SPARSE_CKPT_HPP
+#define SPARSE_CKPT_HPP
+
+// compact container for (rows x cols) tables of doubles where most rows are trivial.
+// most PTTT rows of the average policy and of the regrets are all zero, or uniform over the valid actions, so every row
+// is stored as one kind byte plus only what is needed to rebuild it exactly:
+//   ZERO     nothing
+//   UNIFORM  bitmask of the non zero columns + the one value they all share
+//   DENSE    all cols values
+// rows are grouped in chunks that are encoded and zlib compressed independently, by all cores at once.
+// file: Header, ChunkEntry[num_chunks], compressed chunks. a chunk decompresses to kinds[n], then the packed payloads.
+// the round trip is bit exact
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "parallel.hpp"
+
+namespace sparse_ckpt {
+    using T = double;
+
+    constexpr char MAGIC[8] = {'S', 'P', 'R', 'S', 'C', 'K', 'P', 'T'};
+    constexpr uint32_t VERSION = 1;
+    constexpr size_t CHUNK_ROWS = 1 << 16;
+    constexpr int MAX_UNIFORM_COLS = 16; // the mask is a uint16_t
+    constexpr int COMPRESSION_LEVEL = 1; // the payload is already packed, higher levels buy little and cost a lot
+
+    enum RowKind: uint8_t {ZERO = 0, UNIFORM = 1, DENSE = 2};
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t value_bytes;
+        uint64_t rows;
+        uint64_t cols;
+        uint64_t chunk_rows;
+        uint64_t num_chunks;
+    };
+
+    struct ChunkEntry {
+        uint64_t offset;
+        uint64_t compressed_bytes;
+        uint64_t raw_bytes;
+    };
+
+    struct Stats {
+        size_t zero_rows = 0;
+        size_t uniform_rows = 0;
+        size_t dense_rows = 0;
+        size_t file_bytes = 0;
+    };
+
+    inline bool is_zero(const T &value) {
+        static const T zero = 0;
+        return memcmp(&value, &zero, sizeof(T)) == 0; // -0.0 is not zero here, we want the exact bits back
+    }
+
+    inline RowKind classify(const T *row, size_t cols, uint16_t &mask, T &value) {
+        mask = 0;
+        bool any = false;
+        bool uniform = cols <= MAX_UNIFORM_COLS;
+        for(size_t j = 0; j < cols; j++) {
+            if(is_zero(row[j]))
+                continue;
+            if(!any) {
+                value = row[j];
+                any = true;
+            } else if(memcmp(&row[j], &value, sizeof(T)) != 0) {
+                uniform = false;
+            }
+            if(uniform)
+                mask |= uint16_t(1) << j;
+        }
+        if(!any)
+            return ZERO;
+        return uniform ? UNIFORM : DENSE;
+    }
+
+    inline void encode_chunk(const T *rows, size_t n, size_t cols, std::vector<char> &raw, Stats &stats) {
+        raw.reserve(n * (1 + cols * sizeof(T)));
+        raw.assign(n, 0);
+        for(size_t i = 0; i < n; i++) {
+            const T *row = rows + i * cols;
+            uint16_t mask;
+            T value;
+            RowKind kind = classify(row, cols, mask, value);
+            raw[i] = char(kind);
+            if(kind == UNIFORM) {
+                raw.insert(raw.end(), reinterpret_cast<const char*>(&mask), reinterpret_cast<const char*>(&mask) + sizeof(mask));
+                raw.insert(raw.end(), reinterpret_cast<const char*>(&value), reinterpret_cast<const char*>(&value) + sizeof(value));
+                stats.uniform_rows++;
+            } else if(kind == DENSE) {
+                raw.insert(raw.end(), reinterpret_cast<const char*>(row), reinterpret_cast<const char*>(row + cols));
+                stats.dense_rows++;
+            } else {
+                stats.zero_rows++;
+            }
+        }
+    }
+
+    // false if the chunk is corrupt
+    inline bool decode_chunk(const std::vector<char> &raw, size_t n, size_t cols, T *rows) {
+        if(raw.size() < n)
+            return false;
+        size_t pos = n;
+        for(size_t i = 0; i < n; i++) {
+            T *row = rows + i * cols;
+            switch(RowKind(raw[i])) {
+                case ZERO:
+                    std::fill(row, row + cols, T(0));
+                    break;
+                case UNIFORM: {
+                    uint16_t mask;
+                    T value;
+                    if(pos + sizeof(mask) + sizeof(value) > raw.size())
+                        return false;
+                    memcpy(&mask, raw.data() + pos, sizeof(mask));
+                    memcpy(&value, raw.data() + pos + sizeof(mask), sizeof(value));
+                    pos += sizeof(mask) + sizeof(value);
+                    for(size_t j = 0; j < cols; j++) {
+                        row[j] = (mask >> j) & 1 ? value : T(0);
+                    }
+                    break;
+                }
+                case DENSE:
+                    if(pos + cols * sizeof(T) > raw.size())
+                        return false;
+                    memcpy(row, raw.data() + pos, cols * sizeof(T));
+                    pos += cols * sizeof(T);
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    inline void write_all(int fd, const void *data, size_t bytes, off_t offset, const std::string &path) {
+        const char *ptr = static_cast<const char*>(data);
+        while(bytes > 0) {
+            ssize_t written = pwrite(fd, ptr, bytes, offset);
+            if(written <= 0)
+                throw std::runtime_error("could not write " + path);
+            ptr += written;
+            bytes -= written;
+            offset += written;
+        }
+    }
+
+    inline void read_all(int fd, void *data, size_t bytes, off_t offset, const std::string &path) {
+        char *ptr = static_cast<char*>(data);
+        while(bytes > 0) {
+            ssize_t got = pread(fd, ptr, bytes, offset);
+            if(got <= 0)
+                throw std::runtime_error(path + " is truncated");
+            ptr += got;
+            bytes -= got;
+            offset += got;
+        }
+    }
+
+    // chunks are encoded and compressed in batches of a few per thread, so memory stays bounded for huge tables
+    inline Stats save(const std::string &path, const T *data, size_t rows, size_t cols, int num_threads = -1) {
+        if(num_threads <= 0)
+            num_threads = parallel::default_num_threads();
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            throw std::runtime_error("could not create " + path);
+        }
+        Header header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.value_bytes = sizeof(T);
+        header.rows = rows;
+        header.cols = cols;
+        header.chunk_rows = CHUNK_ROWS;
+        header.num_chunks = (rows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+        std::vector<ChunkEntry> directory(header.num_chunks);
+        off_t offset = sizeof(Header) + directory.size() * sizeof(ChunkEntry);
+
+        Stats total;
+        std::atomic<bool> failed(false); // workers can't throw, the error is raised after the join
+        size_t batch = size_t(num_threads) * 4;
+        for(size_t first = 0; first < header.num_chunks; first += batch) {
+            size_t count = std::min<size_t>(batch, header.num_chunks - first);
+            std::vector<std::vector<unsigned char>> compressed(count);
+            std::vector<Stats> stats(count);
+            parallel::parallel_for(0, count, [&](long long lo, long long hi) {
+                std::vector<char> raw;
+                for(long long c = lo; c < hi; c++) {
+                    size_t chunk = first + c;
+                    size_t begin = chunk * CHUNK_ROWS;
+                    size_t n = std::min(CHUNK_ROWS, rows - begin);
+                    encode_chunk(data + begin * cols, n, cols, raw, stats[c]);
+                    uLongf bound = compressBound(raw.size());
+                    compressed[c].resize(bound);
+                    if(compress2(compressed[c].data(), &bound, reinterpret_cast<const Bytef*>(raw.data()), raw.size(), COMPRESSION_LEVEL) != Z_OK) {
+                        failed = true;
+                        return;
+                    }
+                    compressed[c].resize(bound);
+                    directory[chunk].raw_bytes = raw.size();
+                }
+            }, num_threads);
+            if(failed) {
+                close(fd);
+                throw std::runtime_error("could not compress " + path);
+            }
+            for(size_t c = 0; c < count; c++) {
+                directory[first + c].offset = offset;
+                directory[first + c].compressed_bytes = compressed[c].size();
+                write_all(fd, compressed[c].data(), compressed[c].size(), offset, path);
+                offset += compressed[c].size();
+                total.zero_rows += stats[c].zero_rows;
+                total.uniform_rows += stats[c].uniform_rows;
+                total.dense_rows += stats[c].dense_rows;
+            }
+        }
+        write_all(fd, &header, sizeof(header), 0, path);
+        write_all(fd, directory.data(), directory.size() * sizeof(ChunkEntry), sizeof(Header), path);
+        close(fd);
+        total.file_bytes = offset;
+        return total;
+    }
+
+    inline Header read_header(int fd, const std::string &path) {
+        Header header;
+        read_all(fd, &header, sizeof(header), 0, path);
+        if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.value_bytes != sizeof(T)) {
+            throw std::runtime_error(path + " is not a sparse checkpoint");
+        }
+        return header;
+    }
+
+    // rows and cols of a file, to size the destination
+    inline Header info(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error("could not open " + path);
+        }
+        Header header = read_header(fd, path);
+        close(fd);
+        return header;
+    }
+
+    // decompresses straight into dst, which has room for rows x cols values.
+    // nothing read from the file is used as a size before it is checked against rows, cols and the file size
+    inline void load(const std::string &path, T *dst, size_t rows, size_t cols, int num_threads = -1) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error("could not open " + path);
+        }
+        Header header = read_header(fd, path);
+        if(header.rows != rows || header.cols != cols) {
+            close(fd);
+            throw std::runtime_error(path + " has shape (" + std::to_string(header.rows) + ", " + std::to_string(header.cols) + ")");
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("could not stat " + path);
+        }
+        if(header.chunk_rows == 0 || header.num_chunks != rows / header.chunk_rows + (rows % header.chunk_rows != 0)) {
+            close(fd);
+            throw std::runtime_error(path + " is corrupt: " + std::to_string(header.num_chunks) + " chunks of " + std::to_string(header.chunk_rows) + " rows");
+        }
+        std::vector<ChunkEntry> directory(header.num_chunks);
+        read_all(fd, directory.data(), directory.size() * sizeof(ChunkEntry), sizeof(Header), path);
+        std::atomic<bool> failed(false);
+        parallel::parallel_for(0, header.num_chunks, [&](long long lo, long long hi) {
+            std::vector<unsigned char> compressed;
+            std::vector<char> raw;
+            for(long long chunk = lo; chunk < hi && !failed; chunk++) {
+                const ChunkEntry &entry = directory[chunk];
+                size_t begin = chunk * header.chunk_rows;
+                size_t n = std::min<size_t>(header.chunk_rows, rows - begin);
+                // the kinds plus every row as large as it gets
+                size_t max_raw_bytes = n + n * std::max(sizeof(uint16_t) + sizeof(T), cols * sizeof(T));
+                if(entry.raw_bytes > max_raw_bytes || entry.compressed_bytes > uint64_t(st.st_size)) {
+                    failed = true;
+                    break;
+                }
+                compressed.resize(entry.compressed_bytes);
+                raw.resize(entry.raw_bytes);
+                uLongf raw_bytes = entry.raw_bytes;
+                if(pread(fd, compressed.data(), compressed.size(), entry.offset) != ssize_t(compressed.size())
+                   || uncompress(reinterpret_cast<Bytef*>(raw.data()), &raw_bytes, compressed.data(), compressed.size()) != Z_OK
+                   || raw_bytes != entry.raw_bytes || !decode_chunk(raw, n, cols, dst + begin * cols)) {
+                    failed = true;
+                }
+            }
+        }, num_threads);
+        close(fd);
+        if(failed) {
+            throw std::runtime_error(path + " has a corrupt chunk");
+        }
+    }
+} // namespace sparse_ckpt
+
+#endif
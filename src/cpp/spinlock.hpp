@@ -0,0 +1,37 @@
+#ifndef SPINLOCK_HPP
+#define SPINLOCK_HPP
+
+#include <atomic>
+#include <cstdint>
+
+namespace spinlock {
+    // one byte lock for the per-infoset rows. the critical sections are a handful of flops, so spinning is cheaper
+    // than a std::mutex, and all-zero bytes are the unlocked state so rows can live in zeroed or file backed memory
+    class SpinLock {
+        std::atomic<uint8_t> locked;
+
+    public:
+        SpinLock(): locked(0) {}
+
+        void lock() {
+            while(locked.exchange(1, std::memory_order_acquire)) {
+                while(locked.load(std::memory_order_relaxed)) {
+                    __builtin_ia32_pause();
+                }
+            }
+        }
+
+        void unlock() {
+            locked.store(0, std::memory_order_release);
+        }
+
+        // only for rows mapped back from a file written by a process that died while holding the lock.
+        // writes only a lock that is actually held, so the pages of a file backed table are not all dirtied
+        void reset() {
+            if(locked.load(std::memory_order_relaxed))
+                locked.store(0, std::memory_order_relaxed);
+        }
+    };
+} // namespace spinlock
+
+#endif
@@ -3,11 +3,105 @@
 
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <cassert>
 #include <random>
+#include <utility>
+#include "kernels.hpp"
 
 namespace strategy
 {
+    // the evaluators take any strategy S with a row(info_set_idx) that returns the normalized policy of an infoset (by
+    // value or by const reference). Strategy owns its table, a View normalizes the rows on access from some other
+    // store: the live mccfr tables (mccfr_es::MCCFR::strategy_view), a snapshot store opened by an MCCFR, a mapped
+    // checkpoint (pttt::PTTT::checkpoint_view). nothing of the size of the tables is allocated
+    template <class Game, typename Source>
+    class View
+    {
+    public:
+        using T = typename Game::T;
+        using Buffer = std::array<T, Game::ACTION_MAX_DIM>;
+
+        // source(idx, row) writes the unnormalized row idx (an average policy)
+        explicit View(Source source) : source(std::move(source)) {}
+
+        Buffer row(long long info_set_idx) const {
+            Buffer raw, result;
+            source(info_set_idx, raw);
+            kernels::normalize_row(raw, result, info_set_idx, Game::info_set_action_mask);
+            return result;
+        }
+
+    private:
+        Source source;
+    };
+
+    template <class Game, typename Source>
+    View<Game, Source> make_view(Source source) {
+        return View<Game, Source>(std::move(source));
+    }
+
+    // the rows of any strategy as a table, for results that are a modified copy of it (best responses)
+    template <class Game, typename S>
+    static std::vector<std::array<typename Game::T, Game::ACTION_MAX_DIM>> to_table(const S &strategy) {
+        std::vector<std::array<typename Game::T, Game::ACTION_MAX_DIM>> rows(Game::NUM_INFO_SETS);
+        for (long long idx = 0; idx < Game::NUM_INFO_SETS; idx++) {
+            rows[idx] = strategy.row(idx);
+        }
+        return rows;
+    }
+
+    template <typename Buffer, typename Rng>
+    static int sample_index(const Buffer &probs, int size, Rng &gen) {
+        using T = typename Buffer::value_type;
+        T sum = 0;
+        for (int i = 0; i < size; i++) {
+            sum += probs[i];
+        }
+        assert(abs(sum-1) <= 1e-5); // this is a probability distribution
+
+        T r = std::uniform_real_distribution<T>(0.0, 1.0)(gen);
+        T cumulative = 0.0;
+        for (int i = 0; i < size; i++) {
+            cumulative += probs[i];
+            if (r < cumulative) {
+                return i;
+            }
+        }
+        return size - 1; // should not reach here
+    }
+
+    // p follows the strategy, the other seats play uniformly
+    template <class Game, typename S, typename Rng>
+    static typename Game::T evaluate_against_uniform(const S &strategy, typename Game::Player p, int iters, Rng &gen) {
+        using T = typename Game::T;
+        std::uniform_real_distribution<T> dis(0.0, 1.0);
+        T sum = 0;
+        for(int _ = 0; _ < iters; _++) {
+            Game state;
+            std::array<int, Game::ACTION_MAX_DIM> actions;
+            std::array<T, Game::ACTION_MAX_DIM> policy;
+
+            while(!state.is_terminal()) {
+                int num_actions = state.num_actions();
+                state.actions(actions);
+                int action;
+
+                if(state.is_chance()) {
+                    state.action_probs(policy);
+                    action = actions[sample_index(policy, num_actions, gen)];
+                } else if(state.current_player() == p) {
+                    action = sample_index(strategy.row(state.info_set_idx()), Game::ACTION_MAX_DIM, gen);
+                } else {
+                    action = actions[int(dis(gen) * num_actions)];
+                }
+                state.step(action);
+            }
+            sum += state.utility(p);
+        }
+        return sum / iters;
+    }
+
     template <class Game>
     class Strategy
     {
@@ -24,13 +118,16 @@ namespace strategy
         Strategy(const Strat &strat) : strat(strat) {
             assert(strat.size() == Game::NUM_INFO_SETS);
 
+            std::random_device rd;
             gen = std::mt19937(rd());
             dis = std::uniform_real_distribution<T>(0.0, 1.0);
         }
 
-        Strategy(Strategy &&other) : strat(std::move(other.strat)) {
-            gen = std::mt19937(rd());
-            dis = std::uniform_real_distribution<T>(0.0, 1.0);
+        // takes the rng along, a moved strategy continues the same random stream
+        Strategy(Strategy &&other) : strat(std::move(other.strat)), gen(std::move(other.gen)), dis(other.dis) {}
+
+        const Buffer& row(long long info_set_idx) const {
+            return strat[info_set_idx];
         }
 
         Action sample_action(const Game &state) {
@@ -67,31 +164,7 @@ namespace strategy
         }
 
         T evaluate_against_uniform(Player p, int iters=1000) {
-            T sum = 0;
-            for(int _ = 0; _ < iters; _++) {
-                Game state;
-                BufferInt actions;
-                state.actions(actions);
-                Buffer policy;
-
-                while(!state.is_terminal()) {
-                    int num_actions = state.num_actions();
-                    state.actions(actions);
-                    Action action;
-
-                    if(state.is_chance()) {
-                        state.action_probs(policy);
-                        action = actions[sample_index(policy, num_actions)];
-                    } else if(state.current_player() == p) {
-                        action = sample_index(strat[state.info_set_idx()], Game::ACTION_MAX_DIM);
-                    } else {
-                        action = actions[int(dis(gen) * num_actions)];
-                    }
-                    state.step(action);
-                }
-                sum += state.utility(p);
-            }
-            return sum / iters;
+            return strategy::evaluate_against_uniform<Game>(*this, p, iters, gen);
         }
 
 
@@ -122,6 +195,23 @@ namespace strategy
         }
 
 
+        // lockstep versions of evaluate, evaluate_against_uniform and uniform_vs_uniform for games that have a
+        // Game::Batch<LANES> (see pttt::PTTTBatch). LANES games are played at once on the batched dynamics
+        template<int LANES = 16>
+        T evaluate_batch(Player p, int iters=1000) {
+            return play_batches<LANES>(p, iters, true, true);
+        }
+
+        template<int LANES = 16>
+        T evaluate_against_uniform_batch(Player p, int iters=1000) {
+            return play_batches<LANES>(p, iters, true, false);
+        }
+
+        template<int LANES = 16>
+        T uniform_vs_uniform_batch(Player p, int iters=1000) {
+            return play_batches<LANES>(p, iters, false, false);
+        }
+
         // using Utils = std::vector<std::array<T, Game::ACTION_MAX_DIM>>;
         
         // struct InfosetInfo {
@@ -192,25 +282,60 @@ namespace strategy
         }
 
     private:
-        int sample_index(const Buffer &probs, int size) {
+        // p's seat follows the strategy if strat_me, the other seat if strat_other, uniform otherwise
+        template<int LANES>
+        T play_batches(Player p, int iters, bool strat_me, bool strat_other) {
+            using Batch = typename Game::template Batch<LANES>;
             T sum = 0;
-            for (int i = 0; i < size; i++) {
-                sum += probs[i];
+            std::array<uint32_t, LANES> masks;
+            std::array<int, LANES> actions;
+            std::array<bool, LANES> counted;
+            BufferInt lane_actions;
+
+            int started = std::min(LANES, iters);
+            Batch batch(strat_me || strat_other, started);
+            for(int lane = 0; lane < LANES; lane++) {
+                counted[lane] = lane >= started;
             }
-            assert(abs(sum-1) <= 1e-5); // this is a probability distribution
-
-            T r = dis(gen);
-            T cumulative = 0.0;
-            for (int i = 0; i < size; i++) {
-                cumulative += probs[i];
-                if (r < cumulative) {
-                    return i;
+            while(!batch.all_terminal()) {
+                batch.valid_action_mask_many(masks.data());
+                bool use_strat = batch.current_player() == p ? strat_me : strat_other;
+                for(int lane = 0; lane < LANES; lane++) {
+                    if(masks[lane] == 0)
+                        continue;
+                    if(use_strat) {
+                        actions[lane] = sample_index(strat[batch.info_set_idx(lane)], Game::ACTION_MAX_DIM);
+                    } else {
+                        int num_actions = Batch::actions_from_mask(masks[lane], lane_actions);
+                        actions[lane] = lane_actions[int(dis(gen) * num_actions)];
+                    }
+                }
+                batch.step_many(actions.data());
+
+                // every started game is counted (not just the first ones to finish, those would be the short ones),
+                // finished lanes get a new game as soon as it is the first player's turn again
+                bool can_refill = batch.current_player() == Game::players[0];
+                for(int lane = 0; lane < LANES; lane++) {
+                    if(!batch.is_terminal(lane))
+                        continue;
+                    if(!counted[lane]) {
+                        sum += batch.utility(lane, p);
+                        counted[lane] = true;
+                    }
+                    if(can_refill && started < iters) {
+                        batch.reset_lane(lane);
+                        counted[lane] = false;
+                        started++;
+                    }
                 }
             }
-            return size - 1; // should not reach here
+            return sum / iters;
+        }
+
+        int sample_index(const Buffer &probs, int size) {
+            return strategy::sample_index(probs, size, gen);
         }
 
-        std::random_device rd;
         std::mt19937 gen;
         std::uniform_real_distribution<T> dis;
     };
@@ -0,0 +1,146 @@
+#ifndef TOPOLOGY_HPP
+#define TOPOLOGY_HPP
+
+// cpu / numa helpers for the training loop.
+// libnuma is optional (HAVE_LIBNUMA is set by cmake when it is found), without it everything behaves like a single node machine
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+namespace topology {
+    // cpus this process is allowed to run on (taskset / cpuset), not the ones the machine has
+    inline std::vector<int> available_cpus() {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if(CPU_ISSET(cpu, &set))
+                    cpus.push_back(cpu);
+            }
+        }
+        if(cpus.empty()) { // should not happen, but don't leave the caller without any cpu
+            int n = std::max(1u, std::thread::hardware_concurrency());
+            for(int cpu = 0; cpu < n; cpu++)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    // cpu quota of the cgroup we are in, rounded up. returns -1 if there is no limit
+    inline int cgroup_cpu_limit() {
+        // cgroup v2: "max 100000" or "<quota> <period>"
+        std::ifstream v2("/sys/fs/cgroup/cpu.max");
+        if(v2.is_open()) {
+            std::string quota;
+            long long period = 0;
+            if(v2 >> quota >> period && quota != "max" && period > 0) {
+                return std::max(1, int(std::ceil(double(std::stoll(quota)) / period)));
+            }
+            return -1;
+        }
+        // cgroup v1
+        std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        long long quota = -1, period = 0;
+        if(quota_file >> quota && period_file >> period && quota > 0 && period > 0) {
+            return std::max(1, int(std::ceil(double(quota) / period)));
+        }
+        return -1;
+    }
+
+    inline bool pin_current_thread(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    // lets the current thread (and the threads it starts from now on) run on any of cpus
+    inline bool pin_current_thread(const std::vector<int> &cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(int cpu: cpus) {
+            CPU_SET(cpu, &set);
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    inline int num_numa_nodes() {
+#ifdef HAVE_LIBNUMA
+        if(numa_available() >= 0)
+            return std::max(1, numa_num_configured_nodes());
+#endif
+        return 1;
+    }
+
+    inline int numa_node_of_cpu([[maybe_unused]] int cpu) {
+#ifdef HAVE_LIBNUMA
+        if(numa_available() >= 0)
+            return std::max(0, ::numa_node_of_cpu(cpu));
+#endif
+        return 0;
+    }
+
+    // orders the cpus so that consecutive workers alternate between numa nodes.
+    // the tables are interleaved over all nodes, so every node should get its share of workers
+    inline std::vector<int> spread_over_nodes(const std::vector<int> &cpus) {
+        int nodes = num_numa_nodes();
+        if(nodes == 1)
+            return cpus;
+        std::vector<std::vector<int>> per_node(nodes);
+        for(int cpu: cpus) {
+            per_node[numa_node_of_cpu(cpu) % nodes].push_back(cpu);
+        }
+        std::vector<int> res;
+        for(size_t i = 0; res.size() < cpus.size(); i++) {
+            for(auto &node_cpus: per_node) {
+                if(i < node_cpus.size())
+                    res.push_back(node_cpus[i]);
+            }
+        }
+        return res;
+    }
+
+    // the cpus we should actually put threads on: the affinity mask cut down to the cgroup quota.
+    // spread over the nodes before it is cut, so that a quota does not put every thread on the first node
+    inline std::vector<int> usable_cpus() {
+        std::vector<int> cpus = spread_over_nodes(available_cpus());
+        int limit = cgroup_cpu_limit();
+        if(limit != -1 && limit < int(cpus.size())) {
+            cpus.resize(limit);
+        }
+        return cpus;
+    }
+
+    // spreads the pages of [ptr, ptr + bytes) round robin over all nodes. must be called before the memory is touched
+    inline void interleave_memory([[maybe_unused]] void *ptr, [[maybe_unused]] size_t bytes) {
+#ifdef HAVE_LIBNUMA
+        if(num_numa_nodes() > 1) {
+            numa_interleave_memory(ptr, bytes, numa_all_nodes_ptr);
+        }
+#endif
+    }
+
+    inline void print_summary(const std::vector<int> &cpus) {
+        std::cout << "usable cpus: " << cpus.size()
+                  << " (affinity=" << available_cpus().size()
+                  << ", cgroup limit=" << cgroup_cpu_limit()
+                  << ", hardware_concurrency=" << std::thread::hardware_concurrency()
+                  << ", numa nodes=" << num_numa_nodes() << ")" << std::endl;
+    }
+} // namespace topology
+
+#endif
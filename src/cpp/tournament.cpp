@@ -0,0 +1,135 @@
+// plays K strategies against each other exactly (tournament::Tournament): one walk of the game tree gives the
+// expected value of every pairing in both seatings, plus the nash gap of every strategy (EvalFast)
+//
+//   tournament <pttt|leduc|kuhn> <input> <input> ... [--no-gap] [--out <path>]
+//
+// an input ending in .store is a regret store, mapped read only and its average policy read in place. it must not be the
+// store of a running trainer, use a snapshot of it (a reflinked copy, a checkpoint base) instead. for pttt any
+// other input is the name of an npy checkpoint (checkpoints/<name>_{p0,p1}.npy), which is mapped. nothing is loaded
+// as a whole. writes <out>.npy with one row per strategy: its K payoffs against the others (averaged over the seats),
+// the mean of those and its nash gap (0 with --no-gap). out defaults to checkpoints/tournament
+
+#include "loaded_game.hpp"
+#include "mccfr_es.hpp"
+#include "pttt.hpp"
+#include "tournament.hpp"
+#include <functional>
+#include <iomanip>
+#include <memory>
+
+using namespace std;
+
+// the strategies of one tournament have a single type, this one wraps the different views
+template<class Game>
+struct AnyStrategy {
+    function<array<double, Game::ACTION_MAX_DIM>(long long)> row;
+};
+
+static bool is_store(const string &input) {
+    return input.size() > 6 && input.compare(input.size() - 6, 6, ".store") == 0;
+}
+
+template<class Game>
+static void set_layout(const vector<unique_ptr<mccfr_es::MCCFR<Game>>> &) {}
+
+// the rows of a store are in the infoset layout it was trained with (main_pttt writes it to the store tag)
+template<>
+void set_layout<pttt::PTTT>(const vector<unique_ptr<mccfr_es::MCCFR<pttt::PTTT>>> &stores) {
+    if(stores.empty())
+        return;
+    uint64_t tag = stores.front()->store_tag();
+    for(auto &store: stores) {
+        if(store->store_tag() != tag) {
+            throw runtime_error("the stores were trained with different infoset layouts");
+        }
+    }
+    pttt::PTTT::set_infoset_layout(pttt::InfosetLayout(tag));
+}
+
+template<class Game>
+static AnyStrategy<Game> checkpoint(const string &name) {
+    throw runtime_error(name + " is not a .store, npy checkpoints are only supported for pttt");
+}
+
+template<>
+AnyStrategy<pttt::PTTT> checkpoint<pttt::PTTT>(const string &name) {
+    auto view = pttt::PTTT::checkpoint_view(name);
+    return {[view](long long idx) { return view.row(idx); }};
+}
+
+template<class Game>
+static void run(const vector<string> &inputs, bool gap, const string &out) {
+    vector<unique_ptr<mccfr_es::MCCFR<Game>>> stores;
+    for(auto &input: inputs) {
+        if(!is_store(input))
+            continue;
+        // read only: no lock byte is written. the walk reads rows many times and at different times, against live
+        // tables those reads would not fit together, hence no running trainer's store (see the top of the file)
+        stores.emplace_back(new mccfr_es::MCCFR<Game>(input, arena::Access::READ_ONLY));
+    }
+    set_layout<Game>(stores);
+
+    vector<AnyStrategy<Game>> strategies;
+    size_t next_store = 0;
+    for(auto &input: inputs) {
+        if(is_store(input)) {
+            auto view = stores[next_store++]->strategy_view();
+            strategies.push_back({[view](long long idx) { return view.row(idx); }});
+        } else {
+            strategies.push_back(checkpoint<Game>(input));
+        }
+    }
+
+    tournament::Result result = tournament::run<Game>(strategies, gap);
+    int k = result.k;
+    cout << setprecision(6) << fixed;
+    for(int i = 0; i < k; i++) {
+        cout << setw(3) << i << " ";
+        for(int j = 0; j < k; j++) {
+            cout << setw(10) << result.payoff[i * k + j] << " ";
+        }
+        cout << "| mean " << setw(10) << result.mean_payoff[i];
+        if(gap)
+            cout << " gap " << setw(10) << result.exploitability[i];
+        cout << "  " << inputs[i] << endl;
+    }
+
+    io::NpyWriter<double> writer(out + ".npy", k + 2);
+    for(int i = 0; i < k; i++) {
+        vector<double> row(result.payoff.begin() + i * k, result.payoff.begin() + (i + 1) * k);
+        row.push_back(result.mean_payoff[i]);
+        row.push_back(gap ? result.exploitability[i] : 0);
+        writer.write(row.data(), k + 2);
+    }
+    writer.close();
+    cout << "wrote " << out << ".npy in " << result.seconds << "s" << endl;
+}
+
+int main(int argc, char **argv) {
+    string what = argc > 1 ? argv[1] : "";
+    vector<string> inputs;
+    bool gap = true;
+    string out = paths::get_checkpoints_dir() / "tournament";
+    for(int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--no-gap") {
+            gap = false;
+        } else if(arg == "--out" && i + 1 < argc) {
+            out = argv[++i];
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if(inputs.empty() || (what != "pttt" && what != "leduc" && what != "kuhn")) {
+        cout << "usage: tournament <pttt|leduc|kuhn> <input> <input> ... [--no-gap] [--out <path>]" << endl;
+        return 1;
+    }
+
+    if(what == "pttt") {
+        run<pttt::PTTT>(inputs, gap, out);
+    } else if(what == "leduc") {
+        run<loaded_game::Leduc>(inputs, gap, out);
+    } else {
+        run<loaded_game::Kuhn>(inputs, gap, out);
+    }
+}
@@ -0,0 +1,207 @@
+#ifndef TOURNAMENT_HPP
+#define TOURNAMENT_HPP
+
+// exact expected values of all pairings of K strategies (e.g. checkpoints) of a two player zero sum game in one walk
+// of the game tree. the reach of a history factorizes into chance * reach of seat 0 * reach of seat 1, so the walk
+// carries the K reaches of both seats (one contiguous vector each) and a terminal adds
+// chance * u * reach0[i] * reach1[j] to entry (i, j) of the matrix. branches that no strategy reaches are skipped.
+//
+// like eval::Treeplex, the first plies are expanded into subtrees that the threads take one at a time. every subtree
+// sums into its own K x K matrix and those are added in subtree order, the split does not depend on the number of
+// threads so neither does the result
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <vector>
+#include "evaluator.hpp"
+#include "parallel.hpp"
+
+namespace tournament {
+    using T = double;
+
+    struct Result {
+        int k = 0;
+        std::vector<T> seat_values; // k * k, strategy i in seat 0 against strategy j in seat 1, value of seat 0
+        std::vector<T> payoff; // k * k, value of i against j averaged over both seatings
+        std::vector<T> mean_payoff; // per strategy, its row of payoff averaged over all strategies
+        std::vector<T> exploitability; // per strategy, its nash gap (empty if not computed)
+        double seconds = 0;
+    };
+
+    // S is any strategy with row(idx) (strategy::Strategy, strategy::View), all of the same type
+    template<typename Game, typename S>
+    class Tournament {
+        using Actions = std::array<int, Game::ACTION_MAX_DIM>;
+        using Buffer = std::array<T, Game::ACTION_MAX_DIM>;
+
+        static constexpr int SPLIT_PLIES = 8; // at most, stops earlier once there are enough subtrees
+        static constexpr size_t SUBTREES = 4096; // independent of the thread count, so is the order of the sums
+
+        const std::vector<S> &strategies;
+        int k;
+
+        struct Subtree {
+            Game state;
+            T chance;
+            std::vector<T> reach; // 2 * k: seat 0 then seat 1
+        };
+
+        // per thread, the reach vectors and policy rows of every depth of the walk
+        struct Workspace {
+            std::vector<std::vector<T>> reach;
+            std::vector<std::vector<Buffer>> rows;
+
+            void ensure(size_t depth, int k) {
+                while(reach.size() <= depth) {
+                    reach.emplace_back(2 * k);
+                    rows.emplace_back(k);
+                }
+            }
+        };
+
+        static int seat(const Game &state) {
+            return state.current_player() == Game::players[0] ? 0 : 1;
+        }
+
+        // calls visit(child, chance of the child, reach of the child) for every child that some strategy reaches.
+        // the reach passed to visit lives in ws at depth + 1 until the next child
+        template<typename Visit>
+        void for_each_child(const Game &state, T chance, const T *reach, Workspace &ws, size_t depth, Visit visit) const {
+            Actions actions;
+            state.actions(actions);
+            int n = state.num_actions();
+            if(state.is_chance()) {
+                Buffer probs;
+                state.action_probs(probs);
+                for(int i = 0; i < n; i++) {
+                    if(probs[i] == 0)
+                        continue;
+                    Game child = state;
+                    child.step(actions[i]);
+                    visit(child, chance * probs[i], reach);
+                }
+                return;
+            }
+            ws.ensure(depth + 1, k);
+            int s = seat(state);
+            Buffer *rows = ws.rows[depth].data(); // the buffers stay in place when ensure grows ws
+            for(int j = 0; j < k; j++) {
+                rows[j] = strategies[j].row(state.info_set_idx());
+            }
+            T *child_reach = ws.reach[depth + 1].data();
+            const T *other = reach + (1 - s) * k;
+            std::copy(other, other + k, child_reach + (1 - s) * k);
+            for(int i = 0; i < n; i++) {
+                T *own = child_reach + s * k;
+                T any = 0;
+                for(int j = 0; j < k; j++) {
+                    own[j] = reach[s * k + j] * rows[j][actions[i]];
+                    any += own[j];
+                }
+                if(any == 0)
+                    continue;
+                Game child = state;
+                child.step(actions[i]);
+                visit(child, chance, child_reach);
+            }
+        }
+
+        void walk(const Game &state, T chance, const T *reach, Workspace &ws, size_t depth, T *matrix) const {
+            if(state.is_terminal()) {
+                T u = chance * state.utility(Game::players[0]);
+                const T *reach1 = reach + k;
+                for(int i = 0; i < k; i++) {
+                    T a = u * reach[i];
+                    if(a == 0)
+                        continue;
+                    T *row = matrix + i * k;
+                    for(int j = 0; j < k; j++) {
+                        row[j] += a * reach1[j];
+                    }
+                }
+                return;
+            }
+            for_each_child(state, chance, reach, ws, depth, [&](const Game &child, T p, const T *child_reach) {
+                walk(child, p, child_reach, ws, depth + 1, matrix);
+            });
+        }
+
+        std::vector<T> seat_values(int num_threads) const {
+            // breadth first over the first plies until there are enough subtrees to balance the threads
+            std::vector<T> top(k * k, 0);
+            Workspace ws;
+            std::vector<Subtree> subtrees{{Game(), 1, std::vector<T>(2 * k, 1)}};
+            for(int ply = 0; ply < SPLIT_PLIES && subtrees.size() < SUBTREES; ply++) {
+                std::vector<Subtree> next;
+                for(auto &subtree: subtrees) {
+                    if(subtree.state.is_terminal()) {
+                        walk(subtree.state, subtree.chance, subtree.reach.data(), ws, 0, top.data());
+                        continue;
+                    }
+                    for_each_child(subtree.state, subtree.chance, subtree.reach.data(), ws, 0, [&](const Game &child, T p, const T *reach) {
+                        next.push_back({child, p, std::vector<T>(reach, reach + 2 * k)});
+                    });
+                }
+                subtrees.swap(next);
+            }
+
+            std::vector<T> partial(subtrees.size() * k * k, 0);
+            std::atomic<size_t> next_subtree{0};
+            parallel::parallel_for(0, num_threads, [&](long long, long long) {
+                Workspace thread_ws;
+                for(size_t i; (i = next_subtree.fetch_add(1)) < subtrees.size();) {
+                    walk(subtrees[i].state, subtrees[i].chance, subtrees[i].reach.data(), thread_ws, 0, partial.data() + i * k * k);
+                }
+            }, num_threads);
+
+            for(size_t i = 0; i < subtrees.size(); i++) {
+                for(int c = 0; c < k * k; c++) {
+                    top[c] += partial[i * k * k + c];
+                }
+            }
+            return top;
+        }
+
+    public:
+        Tournament(const std::vector<S> &strategies): strategies(strategies), k(strategies.size()) {}
+
+        // num_threads <= 0 uses all usable cpus. the exploitabilities take one best response per strategy and seat
+        Result run(bool exploitability = true, int num_threads = -1) const {
+            // only for two player zero sum games
+            assert(Game::NUM_PLAYERS == 2);
+            auto start = std::chrono::steady_clock::now();
+            if(num_threads <= 0)
+                num_threads = parallel::default_num_threads();
+            Result result;
+            result.k = k;
+            result.seat_values = seat_values(num_threads);
+            result.payoff.resize(k * k);
+            result.mean_payoff.assign(k, 0);
+            for(int i = 0; i < k; i++) {
+                for(int j = 0; j < k; j++) {
+                    // i in seat 0 gets V[i][j], i in seat 1 gets -V[j][i]
+                    result.payoff[i * k + j] = (result.seat_values[i * k + j] - result.seat_values[j * k + i]) / 2;
+                    result.mean_payoff[i] += result.payoff[i * k + j] / k;
+                }
+            }
+            if(exploitability) {
+                eval::EvalFast<Game> eval(num_threads);
+                for(int i = 0; i < k; i++) {
+                    result.exploitability.push_back(eval.nash_gap(strategies[i]));
+                }
+            }
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        }
+    };
+
+    template<typename Game, typename S>
+    static Result run(const std::vector<S> &strategies, bool exploitability = true, int num_threads = -1) {
+        return Tournament<Game, S>(strategies).run(exploitability, num_threads);
+    }
+} // namespace tournament
+
+#endif
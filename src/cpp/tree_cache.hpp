@@ -0,0 +1,206 @@
+#ifndef TREE_CACHE_HPP
+#define TREE_CACHE_HPP
+
+// the compiled structures of the evaluators (the arrays of eval::EvalFlat and eval::Treeplex) written to a file
+// once and mapped read only by later runs, instead of walking the game tree again in every process. the mapping is
+// MAP_SHARED, so evaluator processes on one machine share the pages of the file.
+// file layout: a Header, num_sections Sections, then the arrays, each one 64 byte aligned. the key is chosen by the
+// caller (e.g. the infoset layout the indices refer to): a file with another key, version or shape is not used and
+// the caller builds and writes it again. so does a file whose sections have other element types (Reader::stale)
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace tree_cache {
+    constexpr char MAGIC[8] = {'E', 'V', 'A', 'L', 'T', 'R', 'E', 'E'};
+    constexpr uint32_t VERSION = 1;
+    constexpr size_t ALIGNMENT = 64;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_sections;
+        uint64_t key;
+        uint64_t bytes; // of the whole file, a shorter file was cut off
+    };
+
+    struct Section {
+        uint64_t offset;
+        uint64_t count;
+        uint64_t element_bytes;
+    };
+
+    class Mapping {
+        void *ptr = nullptr;
+        size_t bytes = 0;
+
+    public:
+        Mapping(void *ptr, size_t bytes): ptr(ptr), bytes(bytes) {}
+        Mapping(const Mapping &) = delete;
+        Mapping& operator=(const Mapping &) = delete;
+
+        ~Mapping() {
+            munmap(ptr, bytes);
+        }
+
+        const char* data() const { return static_cast<const char*>(ptr); }
+        size_t size() const { return bytes; }
+    };
+
+    // read only array that either owns its elements (just built) or points into a mapped file
+    template<typename T>
+    class Array {
+        std::vector<T> owned;
+        std::shared_ptr<const Mapping> mapping; // keeps the file mapped
+        const T *data_ = nullptr;
+        size_t size_ = 0;
+
+    public:
+        Array() = default;
+        Array(std::vector<T> values): owned(std::move(values)), data_(owned.data()), size_(owned.size()) {}
+        Array(std::shared_ptr<const Mapping> mapping, const T *data, size_t size): mapping(std::move(mapping)), data_(data), size_(size) {}
+
+        // moving a vector keeps its buffer, so data_ stays valid
+        Array(Array &&) = default;
+        Array& operator=(Array &&) = default;
+        Array(const Array &) = delete;
+        Array& operator=(const Array &) = delete;
+
+        const T& operator[](size_t i) const { return data_[i]; }
+        const T* data() const { return data_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const T* begin() const { return data_; }
+        const T* end() const { return data_ + size_; }
+        const T& back() const { return data_[size_ - 1]; }
+        bool mapped() const { return mapping != nullptr; }
+    };
+
+    class Writer {
+        struct Pending {
+            const void *data;
+            size_t count;
+            size_t element_bytes;
+        };
+        std::vector<Pending> pending;
+
+        static size_t align(size_t bytes) {
+            return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        }
+
+    public:
+        // the data has to stay alive until write
+        template<typename T>
+        void add(const Array<T> &array) {
+            pending.push_back({array.data(), array.size(), sizeof(T)});
+        }
+
+        // written to a temporary file and renamed, so other processes see either no file or a complete one
+        void write(const std::string &path, uint64_t key) const {
+            std::vector<Section> sections(pending.size());
+            size_t offset = align(sizeof(Header) + sections.size() * sizeof(Section));
+            for(size_t i = 0; i < pending.size(); i++) {
+                sections[i] = {offset, pending[i].count, pending[i].element_bytes};
+                offset = align(offset + pending[i].count * pending[i].element_bytes);
+            }
+            Header header{};
+            memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.num_sections = sections.size();
+            header.key = key;
+            header.bytes = offset;
+
+            std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+            FILE *file = fopen(tmp_path.c_str(), "wb");
+            if(file == nullptr) {
+                throw std::runtime_error("could not create " + tmp_path);
+            }
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            ok = ok && fwrite(sections.data(), sizeof(Section), sections.size(), file) == sections.size();
+            for(size_t i = 0; ok && i < pending.size(); i++) {
+                ok = fseek(file, sections[i].offset, SEEK_SET) == 0;
+                size_t bytes = pending[i].count * pending[i].element_bytes;
+                ok = ok && fwrite(pending[i].data, 1, bytes, file) == bytes;
+            }
+            // pads the last section up to header.bytes
+            ok = ok && fflush(file) == 0 && ftruncate(fileno(file), offset) == 0;
+            ok = fclose(file) == 0 && ok;
+            if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+                unlink(tmp_path.c_str());
+                throw std::runtime_error("could not write " + path);
+            }
+        }
+    };
+
+    class Reader {
+        std::shared_ptr<const Mapping> mapping;
+        const Section *sections = nullptr;
+        uint32_t num_sections = 0;
+        uint32_t next_section = 0;
+        bool stale_ = false;
+
+    public:
+        // false (and nothing mapped) if the file does not exist or does not match key and num_sections
+        bool open(const std::string &path, uint64_t key, uint32_t expected_sections) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0)
+                return false;
+            struct stat st;
+            if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+                close(fd);
+                return false;
+            }
+            size_t bytes = st.st_size;
+            void *ptr = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if(ptr == MAP_FAILED)
+                return false;
+            auto candidate = std::make_shared<const Mapping>(ptr, bytes);
+
+            const Header *header = reinterpret_cast<const Header*>(candidate->data());
+            if(memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION || header->key != key
+               || header->num_sections != expected_sections || header->bytes != bytes
+               || sizeof(Header) + expected_sections * sizeof(Section) > bytes)
+                return false;
+            const Section *candidate_sections = reinterpret_cast<const Section*>(candidate->data() + sizeof(Header));
+            for(uint32_t i = 0; i < expected_sections; i++) {
+                const Section &s = candidate_sections[i];
+                if(s.offset % ALIGNMENT != 0 || s.offset > bytes || s.count * s.element_bytes > bytes - s.offset)
+                    return false;
+            }
+            mapping = std::move(candidate);
+            sections = candidate_sections;
+            num_sections = expected_sections;
+            next_section = 0;
+            stale_ = false;
+            return true;
+        }
+
+        // the sections in the order they were added to the Writer. a section of another element type means the file
+        // was written by a different build, like a wrong key: it returns an empty array and stale() becomes true
+        template<typename T>
+        Array<T> next() {
+            if(stale_ || next_section >= num_sections || sections[next_section].element_bytes != sizeof(T)) {
+                stale_ = true;
+                return Array<T>();
+            }
+            const Section &s = sections[next_section++];
+            return Array<T>(mapping, reinterpret_cast<const T*>(mapping->data() + s.offset), s.count);
+        }
+
+        // the caller has to build and write the cache again
+        bool stale() const { return stale_; }
+    };
+} // namespace tree_cache
+
+#endif